@@ -0,0 +1,137 @@
+/*
+** $Id: strhash.c $
+** Benchmark of the hash of long strings
+** See Copyright Notice in lua.h
+*/
+
+/*
+** For keys following a few common patterns (URLs, paths, ...), count
+** how 'luaS_hashlongstr' spreads them over the node part of a table,
+** against the old hash, which sampled at most 32 bytes of each string.
+** Then time the hash of fresh 64 KB strings. All hashes use the same
+** fixed seed, so that the counts are the same on every run.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lstate.h"
+#include "lstring.h"
+
+
+#define NKEYS		100000
+#define SEED		0x2545F491u
+
+/* size and number of strings for the timing of the hash */
+#define BIGLEN		65536
+#define NBIG		10000
+
+
+typedef unsigned int (*Hash) (lua_State *L, const char *s, size_t l);
+
+
+/* the hash of long strings before they were hashed over all bytes */
+static unsigned int sampled (lua_State *L, const char *s, size_t l) {
+  unsigned int h = SEED ^ (unsigned int)l;
+  size_t step = (l >> 5) + 1;
+  (void)L;
+  for (; l >= step; l -= step)
+    h ^= ((h<<5) + (h>>2) + (unsigned char)s[l - 1]);
+  return h;
+}
+
+
+/* the current hash of long strings, computed as for a new key */
+static unsigned int full (lua_State *L, const char *s, size_t l) {
+  TString *ts = luaS_createlngstrobj(L, l);
+  memcpy(getstr(ts), s, l);
+  ts->hash = SEED;
+  ts->extra = 0;  /* no hash yet */
+  return luaS_hashlongstr(ts);
+}
+
+
+/*
+** Count the keys made from 'fmt' in each bucket of a node part with
+** the size 'ltable.c' would give it. 'probes/hit' is the mean position
+** of a key in its chain.
+*/
+static void chains (lua_State *L, const char *name, Hash h,
+                    const char *fmt) {
+  int *b;
+  int nb = 1;
+  int i, maxc = 0, used = 0;
+  double probes = 0;
+  while (nb < NKEYS) nb <<= 1;
+  b = (int *)calloc(nb, sizeof(int));
+  if (b == NULL) {
+    fprintf(stderr, "not enough memory\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < NKEYS; i++) {
+    char buff[256];
+    int l = snprintf(buff, sizeof(buff), fmt, i, i * 7 % 1000, i % 97);
+    b[h(L, buff, (size_t)l) & (nb - 1)]++;
+  }
+  for (i = 0; i < nb; i++) {
+    if (b[i] > maxc) maxc = b[i];
+    if (b[i] > 0) used++;
+    probes += (double)b[i] * (b[i] + 1) / 2;
+  }
+  printf("  %-8s max chain %4d   used buckets %5.1f%%   probes/hit %6.2f\n",
+         name, maxc, 100.0 * used / nb, probes / NKEYS);
+  free(b);
+}
+
+
+static void timebig (lua_State *L) {
+  TString *ts = luaS_createlngstrobj(L, BIGLEN);
+  clock_t t;
+  unsigned int sum = 0;
+  int i;
+  for (i = 0; i < BIGLEN; i++)
+    getstr(ts)[i] = (char)('a' + i % 26);
+  t = clock();
+  for (i = 0; i < NBIG; i++) {
+    ts->hash = SEED + (unsigned int)i;
+    ts->extra = 0;  /* a fresh string */
+    sum += luaS_hashlongstr(ts);
+  }
+  t = clock() - t;
+  printf("hash of a %d-byte string: %.2f us, %.2f GB/s (%08x)\n", BIGLEN,
+         (double)t / CLOCKS_PER_SEC / NBIG * 1e6,
+         (double)BIGLEN * NBIG / ((double)t / CLOCKS_PER_SEC) / 1e9, sum);
+}
+
+
+int main (void) {
+  static const char *const patterns[] = {
+    "https://cdn.example.com/assets/v2/images/products/%08d/thumb_%03d.jpg"
+      "?w=%d",
+    "/var/lib/service/data/2026/10/19/shard-%06d/object-%04d-part%02d.bin",
+    "session:eu-west-1:tenant-000042:user-%09d:scope-%03d:rev-%02d",
+    "SELECT * FROM orders WHERE customer_id = %d AND region = %d "
+      "AND status = %d",
+    NULL
+  };
+  lua_State *L = luaL_newstate();
+  int i;
+  if (L == NULL) {
+    fprintf(stderr, "cannot create state\n");
+    return EXIT_FAILURE;
+  }
+  lua_gc(L, LUA_GCSTOP, 0);  /* strings made by 'full' are not anchored */
+  for (i = 0; patterns[i] != NULL; i++) {
+    printf("%s\n", patterns[i]);
+    chains(L, "sampled", sampled, patterns[i]);
+    chains(L, "full", full, patterns[i]);
+  }
+  timebig(L);
+  lua_close(L);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,33 @@
+-- Time the use of long strings as table keys: insert 100k path keys
+-- in a table and look all of them up 20 times. Prints the best time
+-- of 7 runs. Any Lua 5.3 interpreter can run it, so that trees can be
+-- compared: lua strhash.lua
+
+local N, ROUNDS, RUNS = 100000, 20, 7
+
+local keys = {}
+for i = 1, N do
+  keys[i] = string.format(
+    "/var/lib/service/data/2026/10/19/shard-%06d/object-%04d.bin",
+    i, i % 1000)
+end
+
+local function run ()
+  local c = os.clock()
+  local t = {}
+  for i = 1, N do t[keys[i]] = i end
+  local s = 0
+  for _ = 1, ROUNDS do
+    for i = 1, N do s = s + t[keys[i]] end
+  end
+  assert(s == ROUNDS * N * (N + 1) // 2)
+  return os.clock() - c
+end
+
+local best = math.huge
+for _ = 1, RUNS do
+  collectgarbage()
+  best = math.min(best, run())
+end
+print(string.format("%d path keys, %d lookups: %.2fs (best of %d runs)",
+                    N, ROUNDS * N, best, RUNS))
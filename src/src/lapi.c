@@ -56,6 +56,10 @@ const char lua_ident[] =
 #define api_checkstackindex(l, i, o)  \
 	api_check(l, isstackindex(i, o), "index not in the stack")
 
+/* frozen tables cannot be changed, not even by raw accesses */
+#define checkwritable(l,t)  \
+	{ if (isfrozen(t)) luaG_runerror(l, "attempt to modify a frozen table"); }
+
 
 static TValue *index2addr (lua_State *L, int idx) {
   CallInfo *ci = L->ci;
@@ -383,6 +387,11 @@ LUA_API const char *lua_tolstring (lua_State *L, int idx, size_t *len) {
     o = index2addr(L, idx);  /* previous call may reallocate the stack */
     lua_unlock(L);
   }
+  if (isbufstr(tsvalue(o))) {  /* may lack its final zero? */
+    lua_lock(L);
+    luaS_seal(L, tsvalue(o));
+    lua_unlock(L);
+  }
   if (len != NULL)
     *len = vslen(o);
   return svalue(o);
@@ -420,6 +429,24 @@ LUA_API void *lua_touserdata (lua_State *L, int idx) {
 }
 
 
+/*
+** Return the elements of the typed array at index 'idx', with their
+** kind in '*kind' and their number in '*n', or NULL if the value is
+** not a typed array.
+*/
+LUA_API void *lua_toarray (lua_State *L, int idx, int *kind, size_t *n) {
+  StkId o = index2addr(L, idx);
+  if (!isarray(o))
+    return NULL;
+  else {
+    Udata *u = uvalue(o);
+    if (kind) *kind = u->arrkind;
+    if (n) *n = arraylen(u);
+    return getudatamem(u);
+  }
+}
+
+
 LUA_API lua_State *lua_tothread (lua_State *L, int idx) {
   StkId o = index2addr(L, idx);
   return (!ttisthread(o)) ? NULL : thvalue(o);
@@ -488,6 +515,24 @@ LUA_API const char *lua_pushlstring (lua_State *L, const char *s, size_t len) {
 }
 
 
+/*
+** Push a string whose contents stay in 's' (owned by the caller until
+** 'falloc' releases it), without copying them.
+*/
+LUA_API const char *lua_pushexternalstring (lua_State *L,
+                const char *s, size_t len, lua_Alloc falloc, void *ud) {
+  TString *ts;
+  lua_lock(L);
+  api_check(L, s[len] == '\0', "string not ending with zero");
+  ts = luaS_newextstr(L, s, len, falloc, ud);
+  setsvalue2s(L, L->top, ts);
+  api_incr_top(L);
+  luaC_checkGC(L);
+  lua_unlock(L);
+  return getstr(ts);
+}
+
+
 LUA_API const char *lua_pushstring (lua_State *L, const char *s) {
   lua_lock(L);
   if (s == NULL)
@@ -805,6 +850,7 @@ LUA_API void lua_rawset (lua_State *L, int idx) {
   api_checknelems(L, 2);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  checkwritable(L, hvalue(o));
   slot = luaH_set(L, hvalue(o), L->top - 2);
   setobj2t(L, slot, L->top - 1);
   invalidateTMcache(hvalue(o));
@@ -820,6 +866,7 @@ LUA_API void lua_rawseti (lua_State *L, int idx, lua_Integer n) {
   api_checknelems(L, 1);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  checkwritable(L, hvalue(o));
   luaH_setint(L, hvalue(o), n, L->top - 1);
   luaC_barrierback(L, hvalue(o), L->top-1);
   L->top--;
@@ -834,6 +881,7 @@ LUA_API void lua_rawsetp (lua_State *L, int idx, const void *p) {
   api_checknelems(L, 1);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  checkwritable(L, hvalue(o));
   setpvalue(&k, cast(void *, p));
   slot = luaH_set(L, hvalue(o), &k);
   setobj2t(L, slot, L->top - 1);
@@ -843,6 +891,17 @@ LUA_API void lua_rawsetp (lua_State *L, int idx, const void *p) {
 }
 
 
+LUA_API void lua_cleartable (lua_State *L, int idx) {
+  StkId t;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  api_check(L, ttistable(t), "table expected");
+  checkwritable(L, hvalue(t));
+  luaH_clear(hvalue(t));
+  lua_unlock(L);
+}
+
+
 LUA_API int lua_setmetatable (lua_State *L, int objindex) {
   TValue *obj;
   Table *mt;
@@ -857,6 +916,7 @@ LUA_API int lua_setmetatable (lua_State *L, int objindex) {
   }
   switch (ttnov(obj)) {
     case LUA_TTABLE: {
+      checkwritable(L, hvalue(obj));
       hvalue(obj)->metatable = mt;
       if (mt) {
         luaC_objbarrier(L, gcvalue(obj), mt);
@@ -1106,6 +1166,129 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
 
 
 
+/*
+** frozen objects (shared heap)
+*/
+
+
+LUA_API void lua_freeze (lua_State *L, int idx) {
+  lua_lock(L);
+  luaC_freeze(L, index2addr(L, idx));
+  lua_unlock(L);
+}
+
+
+/*
+** Values that are not collectable are immutable, so they can be
+** shared like frozen ones. A Lua function is frozen if its prototype
+** is frozen.
+*/
+LUA_API int lua_isfrozen (lua_State *L, int idx) {
+  const TValue *o = index2addr(L, idx);
+  if (ttisLclosure(o))
+    return isfrozen(clLvalue(o)->p);
+  else
+    return (!iscollectable(o) || isfrozen(gcvalue(o)));
+}
+
+
+/*
+** Push a new closure over frozen prototype 'p', with fresh upvalues and
+** with the global table of 'L' as its first upvalue (as done by
+** 'lua_load'), as closures themselves cannot be shared.
+*/
+static void pushfrozenproto (lua_State *L, Proto *p) {
+  LClosure *cl = luaF_newLclosure(L, p->sizeupvalues);
+  cl->p = p;
+  setclLvalue(L, L->top, cl);
+  api_incr_top(L);
+  luaF_initupvals(L, cl);
+  if (cl->nupvalues >= 1) {  /* does it have an upvalue? */
+    /* get global table from registry */
+    Table *reg = hvalue(&G(L)->l_registry);
+    const TValue *gt = luaH_getint(reg, LUA_RIDX_GLOBALS);
+    /* set global table as 1st upvalue of 'cl' (may be LUA_ENV) */
+    setobj(L, cl->upvals[0]->v, gt);
+    luaC_upvalbarrier(L, cl->upvals[0]);
+  }
+  luaC_checkGC(L);
+}
+
+
+/*
+** Push into 'to' a frozen value from 'from', without copying it. A
+** frozen Lua function is pushed as a new closure over its prototype.
+*/
+LUA_API void lua_xshare (lua_State *from, lua_State *to, int idx) {
+  const TValue *o;
+  lua_lock(to);
+  api_check(to, G(from)->sharedg != NULL &&
+                G(from)->sharedg == G(to)->sharedg,
+                "states do not share a heap");
+  o = index2addr(from, idx);
+  if (ttisLclosure(o)) {
+    api_check(to, isfrozen(clLvalue(o)->p), "function is not frozen");
+    pushfrozenproto(to, clLvalue(o)->p);
+  }
+  else {
+    api_check(to, !iscollectable(o) || isfrozen(gcvalue(o)),
+                  "value is not frozen");
+    setobj2s(to, to->top, o);
+    api_incr_top(to);
+  }
+  lua_unlock(to);
+}
+
+
+/*
+** Return an address for a frozen table or function, which any state
+** sharing its heap can give to 'lua_pushfrozen', even when the state
+** that produced it is gone or busy in another system thread; '*heap'
+** receives the identity of that heap. Return NULL for other values.
+*/
+LUA_API const void *lua_tofrozen (lua_State *L, int idx, const void **heap) {
+  const TValue *o = index2addr(L, idx);
+  GCObject *p;
+  if (ttisLclosure(o))
+    p = obj2gco(clLvalue(o)->p);
+  else if (ttistable(o))
+    p = gcvalue(o);
+  else
+    return NULL;
+  if (!isfrozen(p))
+    return NULL;
+  *heap = G(L)->sharedg;
+  return p;
+}
+
+
+/*
+** Push a value given by 'lua_tofrozen', if 'L' shares 'heap'. Return
+** 0 (pushing nothing) otherwise. With a NULL 'p', only tell whether
+** 'L' shares 'heap'.
+*/
+LUA_API int lua_pushfrozen (lua_State *L, const void *heap, const void *p) {
+  GCObject *o = cast(GCObject *, p);
+  int res = 0;
+  lua_lock(L);
+  if (heap != NULL && heap == G(L)->sharedg) {
+    if (o != NULL) {  /* not only checking? */
+      api_check(L, isfrozen(o), "value is not frozen");
+      if (o->tt == LUA_TPROTO)
+        pushfrozenproto(L, gco2p(o));
+      else {
+        sethvalue(L, L->top, gco2t(o));
+        api_incr_top(L);
+      }
+    }
+    res = 1;
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
+
 /*
 ** miscellaneous functions
 */
@@ -1163,6 +1346,112 @@ LUA_API void lua_len (lua_State *L, int idx) {
 }
 
 
+/*
+** Push the concatenation of 't[i .. j]', with 'sep' between values,
+** where 't' is the table at index 'idx'. Returns 0, pushing nothing,
+** unless all values are strings or numbers in the array part of 't'.
+*/
+LUA_API int lua_rawconcat (lua_State *L, int idx, lua_Integer i,
+                           lua_Integer j, const char *sep, size_t lsep) {
+  StkId t;
+  int res = 0;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  api_check(L, ttistable(t), "table expected");
+  if (1 <= i && i <= j && l_castS2U(j) <= hvalue(t)->sizearray) {
+    setnilvalue(L->top);  /* room for the result */
+    api_incr_top(L);
+    res = luaV_concattable(L, L->top - 1, hvalue(t), cast(unsigned int, i),
+                           cast(unsigned int, j), sep, lsep);
+    if (!res)
+      L->top--;  /* remove room */
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** Copy 't[i .. i + n - 1]' as floats into 'buff', where 't' is the table
+** at index 'idx'. Returns how many values were copied, which is less
+** than 'n' only if 't[i + result]' is not a number.
+*/
+LUA_API lua_Integer lua_rawgetnumbers (lua_State *L, int idx, lua_Integer i,
+                                       lua_Integer n, lua_Number *buff) {
+  Table *t;
+  lua_Integer k;
+  lua_lock(L);
+  api_check(L, ttistable(index2addr(L, idx)), "table expected");
+  t = hvalue(index2addr(L, idx));
+  for (k = 0; k < n; k++) {
+    lua_Unsigned p = l_castS2U(i + k) - 1u;
+    const TValue *o = (p < t->sizearray) ? &t->array[p]
+                                          : luaH_getint(t, i + k);
+    if (ttisfloat(o))
+      buff[k] = fltvalue(o);
+    else if (ttisinteger(o))
+      buff[k] = cast_num(ivalue(o));
+    else break;  /* not a number */
+  }
+  lua_unlock(L);
+  return k;
+}
+
+
+/*
+** Set 't[i .. i + n - 1]' to the floats in 'buff', where 't' is the
+** table at index 'idx'. If 'toint' is true, floats with an exact
+** integer representation are stored as integers.
+*/
+LUA_API void lua_rawsetnumbers (lua_State *L, int idx, lua_Integer i,
+                                lua_Integer n, const lua_Number *buff,
+                                int toint) {
+  Table *t;
+  lua_Integer k;
+  lua_lock(L);
+  api_check(L, ttistable(index2addr(L, idx)), "table expected");
+  t = hvalue(index2addr(L, idx));
+  checkwritable(L, t);
+  for (k = 0; k < n; k++) {
+    lua_Unsigned p = l_castS2U(i + k) - 1u;
+    lua_Integer v;
+    TValue aux;
+    TValue *o = (p < t->sizearray) ? &t->array[p] : &aux;
+    setfltvalue(o, buff[k]);
+    if (toint && luaV_tointeger(o, &v, 0)) {  /* exact integer? */
+      setivalue(o, v);
+    }
+    if (o == &aux)  /* not in the array part? */
+      luaH_setint(L, t, i + k, o);
+  }
+  lua_unlock(L);
+}
+
+
+/*
+** Sort 't[1 .. n]' in place as told by 'how', where 't' is the table at
+** index 'idx', with the order function on the top of the stack (or '<'
+** if it is nil), which is popped.
+*/
+LUA_API void lua_rawsort (lua_State *L, int idx, lua_Integer n, int how,
+                          lua_Integer k) {
+  StkId t;
+  lua_lock(L);
+  api_checknelems(L, 1);
+  api_check(L, ttisnil(L->top - 1) || ttisfunction(L->top - 1),
+                "function or nil expected");
+  t = index2addr(L, idx);
+  api_check(L, ttistable(t), "table expected");
+  api_check(L, 0 <= n && n < INT_MAX, "invalid size");
+  api_check(L, how != LUA_SORTTOPK || (0 <= k && k <= n), "invalid 'k'");
+  api_check(L, how != LUA_SORTNTH || (1 <= k && k <= n), "invalid 'k'");
+  checkwritable(L, hvalue(t));
+  luaH_sort(L, hvalue(t), cast(unsigned int, n), how, cast(unsigned int, k));
+  L->top--;  /* remove order function */
+  lua_unlock(L);
+}
+
+
 LUA_API lua_Alloc lua_getallocf (lua_State *L, void **ud) {
   lua_Alloc f;
   lua_lock(L);
@@ -1193,6 +1482,28 @@ LUA_API void *lua_newuserdata (lua_State *L, size_t size) {
 }
 
 
+/*
+** Push a new typed array of 'n' elements of the given kind, all zero.
+*/
+LUA_API void *lua_newarray (lua_State *L, int kind, size_t n) {
+  Udata *u;
+  size_t esize;
+  lua_lock(L);
+  api_check(L, LUA_ARRINT <= kind && kind <= LUA_ARRBYTE, "invalid kind");
+  esize = arrelemsize(kind);
+  if (n > MAX_SIZE / esize)
+    luaM_toobig(L);
+  u = luaS_newudata(L, n * esize);
+  u->arrkind = cast_byte(kind);
+  memset(getudatamem(u), 0, n * esize);
+  setuvalue(L, L->top, u);
+  api_incr_top(L);
+  luaC_checkGC(L);
+  lua_unlock(L);
+  return getudatamem(u);
+}
+
+
 
 static const char *aux_upvalue (StkId fi, int n, TValue **val,
                                 CClosure **owner, UpVal **uv) {
@@ -0,0 +1,294 @@
+/*
+** $Id: larraylib.c $
+** Typed arrays
+** See Copyright Notice in lua.h
+*/
+
+#define larraylib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <limits.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** A typed array is a fixed number of numbers of one kind kept in plain
+** memory (see 'lua_newarray'). The core itself reads, writes, and
+** measures typed arrays, so that 'a[i]', 'a[i] = v', and '#a' cost no
+** metamethod calls; this library creates them and gives them their
+** metatables, with the bulk operations as methods.
+*/
+
+
+/* names of the metatables of each kind of array */
+static const char *const arraynames[] =
+  {NULL, "Int64Array", "Float64Array", "ByteArray"};
+
+/* names of the kinds, as returned by 'array.type' */
+static const char *const kindnames[] = {NULL, "int64", "float64", "uint8"};
+
+
+#define elemsize(k)  \
+	((k) == LUA_ARRBYTE ? 1 : \
+	 (k) == LUA_ARRINT ? sizeof(lua_Integer) : sizeof(lua_Number))
+
+
+static char *checkarray (lua_State *L, int arg, int *kind, size_t *n) {
+  char *p = (char *)lua_toarray(L, arg, kind, n);
+  if (p == NULL) {
+    const char *msg = lua_pushfstring(L, "typed array expected, got %s",
+                                      luaL_typename(L, arg));
+    luaL_argerror(L, arg, msg);
+  }
+  return p;
+}
+
+
+/* push a new array with all elements zero */
+static char *newarray (lua_State *L, int kind, size_t n) {
+  char *p = (char *)lua_newarray(L, kind, n);
+  luaL_setmetatable(L, arraynames[kind]);
+  return p;
+}
+
+
+/* from strlib */
+/* translate a relative position: negative means back from end */
+static lua_Integer posrelat (lua_Integer pos, size_t len) {
+  if (pos >= 0) return pos;
+  else if (0u - (size_t)pos > len) return 0;
+  else return (lua_Integer)len + pos + 1;
+}
+
+
+/*
+** Get the interval given by the optional arguments 'arg' and 'arg + 1'
+** (as in 'string.sub', default is the whole array), clipped to the
+** bounds of an array with 'n' elements. Returns the length of the
+** interval, with its 0-based start in '*i'.
+*/
+static size_t getrange (lua_State *L, int arg, size_t n, size_t *i) {
+  lua_Integer start = posrelat(luaL_optinteger(L, arg, 1), n);
+  lua_Integer end = posrelat(luaL_optinteger(L, arg + 1, -1), n);
+  if (start < 1) start = 1;
+  if (end > (lua_Integer)n) end = n;
+  *i = (size_t)start - 1;
+  return (start <= end) ? (size_t)(end - start) + 1 : 0;
+}
+
+
+/*
+** Create an array from a size, from a list of numbers, or (for byte
+** arrays) from the bytes of a string or a view.
+*/
+static int create (lua_State *L, int kind) {
+  switch (lua_type(L, 1)) {
+    case LUA_TNUMBER: {
+      lua_Integer n = luaL_checkinteger(L, 1);
+      luaL_argcheck(L, n >= 0, 1, "size out of range");
+      newarray(L, kind, (size_t)n);
+      break;
+    }
+    case LUA_TTABLE: {
+      lua_Integer n = luaL_len(L, 1);
+      lua_Integer i;
+      luaL_argcheck(L, n >= 0, 1, "invalid list length");
+      newarray(L, kind, (size_t)n);
+      for (i = 1; i <= n; i++) {
+        if (lua_geti(L, 1, i) != LUA_TNUMBER)
+          return luaL_error(L, "invalid value (at index %I) in list", i);
+        lua_seti(L, -2, i);
+      }
+      break;
+    }
+    default: {
+      size_t l;
+      const char *s;
+      if (kind != LUA_ARRBYTE)
+        return luaL_argerror(L, 1, "size or list expected");
+      s = luaL_checkview(L, 1, &l);
+      if (l > 0)
+        memcpy(newarray(L, kind, l), s, l);
+      else newarray(L, kind, 0);
+      break;
+    }
+  }
+  return 1;
+}
+
+
+static int newint64 (lua_State *L) {
+  return create(L, LUA_ARRINT);
+}
+
+
+static int newfloat64 (lua_State *L) {
+  return create(L, LUA_ARRFLT);
+}
+
+
+static int newuint8 (lua_State *L) {
+  return create(L, LUA_ARRBYTE);
+}
+
+
+static int arr_type (lua_State *L) {
+  int kind;
+  luaL_checkany(L, 1);
+  if (lua_toarray(L, 1, &kind, NULL) == NULL)
+    lua_pushnil(L);  /* not a typed array */
+  else
+    lua_pushstring(L, kindnames[kind]);
+  return 1;
+}
+
+
+static int arr_fill (lua_State *L) {
+  int kind;
+  size_t n, i, m;
+  char *p = checkarray(L, 1, &kind, &n);
+  m = getrange(L, 3, n, &i);
+  switch (kind) {
+    case LUA_ARRINT: {
+      lua_Integer v = luaL_checkinteger(L, 2);
+      lua_Integer *a = (lua_Integer *)p + i;
+      while (m-- > 0) *a++ = v;
+      break;
+    }
+    case LUA_ARRFLT: {
+      lua_Number v = luaL_checknumber(L, 2);
+      lua_Number *a = (lua_Number *)p + i;
+      while (m-- > 0) *a++ = v;
+      break;
+    }
+    default: {
+      lua_Integer v = luaL_checkinteger(L, 2);
+      luaL_argcheck(L, 0 <= v && v <= UCHAR_MAX, 2, "value out of range");
+      if (m > 0)
+        memset(p + i, (int)v, m);
+      break;
+    }
+  }
+  lua_settop(L, 1);
+  return 1;  /* return the array */
+}
+
+
+/*
+** Move elements a1[f .. e] to a2[t ..] (as in 'table.move'). Between
+** arrays of the same kind this is a plain copy; otherwise, each element
+** is converted as in an assignment.
+*/
+static int arr_move (lua_State *L) {
+  int k1, k2;
+  size_t n1, n2;
+  char *p1 = checkarray(L, 1, &k1, &n1);
+  lua_Integer f = luaL_checkinteger(L, 2);
+  lua_Integer e = luaL_checkinteger(L, 3);
+  lua_Integer t = luaL_checkinteger(L, 4);
+  int tt = !lua_isnoneornil(L, 5) ? 5 : 1;  /* destination array */
+  char *p2 = checkarray(L, tt, &k2, &n2);
+  if (e >= f) {  /* otherwise, nothing to move */
+    size_t m;
+    luaL_argcheck(L, f >= 1 && (lua_Unsigned)e <= n1, 3,
+                  "interval out of bounds");
+    m = (size_t)(e - f) + 1;
+    luaL_argcheck(L, t >= 1 && m <= n2 && (lua_Unsigned)t - 1 <= n2 - m, 4,
+                  "destination out of bounds");
+    if (k1 == k2) {
+      size_t es = elemsize(k1);
+      memmove(p2 + (size_t)(t - 1) * es, p1 + (size_t)(f - 1) * es, m * es);
+    }
+    else {  /* different arrays; no overlap */
+      lua_Integer i;
+      for (i = 0; i < (lua_Integer)m; i++) {
+        lua_geti(L, 1, f + i);
+        lua_seti(L, tt, t + i);
+      }
+    }
+  }
+  lua_pushvalue(L, tt);  /* return destination array */
+  return 1;
+}
+
+
+static int arr_sub (lua_State *L) {
+  int kind;
+  size_t n, i, m;
+  const char *p = checkarray(L, 1, &kind, &n);
+  m = getrange(L, 2, n, &i);
+  if (m > 0) {
+    size_t es = elemsize(kind);
+    memcpy(newarray(L, kind, m), p + i * es, m * es);
+  }
+  else newarray(L, kind, 0);
+  return 1;
+}
+
+
+static int arr_totable (lua_State *L) {
+  int kind;
+  size_t n, i, m, k;
+  const char *p = checkarray(L, 1, &kind, &n);
+  m = getrange(L, 2, n, &i);
+  if (m >= (size_t)INT_MAX)
+    return luaL_error(L, "too many elements to convert");
+  lua_createtable(L, (int)m, 0);
+  for (k = 0; k < m; k++) {
+    switch (kind) {
+      case LUA_ARRINT:
+        lua_pushinteger(L, ((const lua_Integer *)p)[i + k]);
+        break;
+      case LUA_ARRFLT:
+        lua_pushnumber(L, ((const lua_Number *)p)[i + k]);
+        break;
+      default:
+        lua_pushinteger(L, (unsigned char)p[i + k]);
+        break;
+    }
+    lua_rawseti(L, -2, (lua_Integer)k + 1);
+  }
+  return 1;
+}
+
+
+static const luaL_Reg arr_funcs[] = {
+  {"int64", newint64},
+  {"float64", newfloat64},
+  {"uint8", newuint8},
+  {"type", arr_type},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg arr_meth[] = {
+  {"fill", arr_fill},
+  {"move", arr_move},
+  {"sub", arr_sub},
+  {"totable", arr_totable},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_array (lua_State *L) {
+  int kind;
+  luaL_newlib(L, arr_funcs);
+  luaL_newlib(L, arr_meth);  /* methods, common to all kinds */
+  for (kind = LUA_ARRINT; kind <= LUA_ARRBYTE; kind++) {
+    luaL_newmetatable(L, arraynames[kind]);
+    lua_pushvalue(L, -2);
+    lua_setfield(L, -2, "__index");  /* metatable.__index = methods */
+    lua_pop(L, 1);  /* pop metatable */
+  }
+  lua_pop(L, 1);  /* pop methods */
+  return 1;
+}
+
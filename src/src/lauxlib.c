@@ -394,6 +394,28 @@ LUALIB_API const char *luaL_checklstring (lua_State *L, int arg, size_t *len) {
 }
 
 
+/*
+** Get the contents of a string (or number) or of a view, without
+** copying them. Byte arrays (see 'lua_newarray') are views too.
+*/
+LUALIB_API const char *luaL_checkview (lua_State *L, int arg, size_t *len) {
+  if (lua_type(L, arg) == LUA_TUSERDATA) {
+    int kind;
+    const char *p = (const char *)lua_toarray(L, arg, &kind, len);
+    if (p != NULL && kind == LUA_ARRBYTE)  /* byte array? */
+      return p;
+    if (luaL_getmetafield(L, arg, LUAL_VIEWFIELD) != LUA_TNIL) {
+      luaL_View *v = (luaL_View *)lua_touserdata(L, arg);
+      lua_pop(L, 1);  /* remove metafield */
+      luaL_argcheck(L, v->p != NULL, arg, "attempt to use a closed view");
+      if (len) *len = v->len;
+      return v->p;
+    }
+  }
+  return luaL_checklstring(L, arg, len);
+}
+
+
 LUALIB_API const char *luaL_optlstring (lua_State *L, int arg,
                                         const char *def, size_t *len) {
   if (lua_isnoneornil(L, arg)) {
@@ -700,6 +722,113 @@ static int skipcomment (LoadF *lf, int *cp) {
 }
 
 
+/*
+** {======================================================
+** Load functions over files mapped in memory
+** =======================================================
+*/
+
+/*
+** l_mapchunk(filename,size) maps a file to be loaded as a chunk and
+** l_unmapchunk(p,size) releases it. (They are not the 'l_mapfile'
+** macros of 'liolib.c', which map files into views for 'io.mmap'.)
+** Files are mapped only with LUA_USE_MAPCHUNK (see 'luaconf.h').
+*/
+
+#if !defined(l_mapchunk)		/* { */
+
+#if defined(LUA_USE_POSIX) && defined(LUA_USE_MAPCHUNK)
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* map a non-empty regular file; return NULL if that is not possible */
+static char *l_mapchunk (const char *filename, size_t *size) {
+  struct stat st;
+  void *p = MAP_FAILED;
+  int err = errno;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      (off_t)(size_t)st.st_size == st.st_size) {  /* fits in memory? */
+    *size = (size_t)st.st_size;
+    p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  errno = err;  /* failures are not errors: file is read by other means */
+  return (p == MAP_FAILED) ? NULL : (char *)p;
+}
+
+#define l_unmapchunk(p,size)	munmap(p, size)
+
+#else
+
+#define l_mapchunk(filename,size)	((void)(filename), (void)(size), \
+					 (char *)NULL)
+#define l_unmapchunk(p,size)		((void)0)
+
+#endif
+
+#endif				/* } */
+
+
+typedef struct LoadM {
+  const char *prefix;  /* text to be read before the file (or NULL) */
+  const char *s;  /* rest of the file */
+  size_t size;
+} LoadM;
+
+
+static const char *getM (lua_State *L, void *ud, size_t *size) {
+  LoadM *lm = (LoadM *)ud;
+  const char *s;
+  (void)L;  /* not used */
+  if (lm->prefix != NULL) {
+    s = lm->prefix;
+    *size = strlen(s);
+    lm->prefix = NULL;
+  }
+  else {
+    if (lm->size == 0) return NULL;
+    s = lm->s;
+    *size = lm->size;
+    lm->size = 0;
+  }
+  return s;
+}
+
+
+/*
+** Load the file mapped at 's', skipping an optional BOM mark in its
+** beginning plus its first line if it starts with '#', like the
+** stream loader. The parser copies everything it keeps, so the file
+** can be unmapped after the load.
+*/
+static int loadmapped (lua_State *L, const char *s, size_t size,
+                       const char *chunkname, const char *mode) {
+  LoadM lm;
+  lm.prefix = NULL;
+  if (size >= 3 && memcmp(s, "\xEF\xBB\xBF", 3) == 0) {  /* UTF-8 BOM? */
+    s += 3; size -= 3;
+  }
+  if (size > 0 && *s == '#') {  /* first line is a comment? */
+    const char *nl = (const char *)memchr(s, '\n', size);
+    size_t skip = (nl != NULL) ? (size_t)(nl - s) + 1 : size;
+    s += skip; size -= skip;
+    if (size == 0 || *s != LUA_SIGNATURE[0])  /* not a binary chunk? */
+      lm.prefix = "\n";  /* add line to correct line numbers */
+  }
+  lm.s = s;
+  lm.size = size;
+  return lua_load(L, getM, &lm, chunkname, mode);
+}
+
+/* }====================================================== */
+
+
 LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
                                              const char *mode) {
   LoadF lf;
@@ -711,7 +840,15 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
     lf.f = stdin;
   }
   else {
+    size_t size;
+    char *m;
     lua_pushfstring(L, "@%s", filename);
+    if ((m = l_mapchunk(filename, &size)) != NULL) {  /* could map it? */
+      status = loadmapped(L, m, size, lua_tostring(L, -1), mode);
+      l_unmapchunk(m, size);
+      lua_remove(L, fnameindex);
+      return status;
+    }
     lf.f = fopen(filename, "r");
     if (lf.f == NULL) return errfile(L, "open", fnameindex);
   }
@@ -28,6 +28,10 @@
 #define LUA_PRELOAD_TABLE	"_PRELOAD"
 
 
+/* key, in the registry, for the cache of compiled patterns */
+#define LUA_PATTERNS_TABLE	"_PATTERNS"
+
+
 typedef struct luaL_Reg {
   const char *name;
   lua_CFunction func;
@@ -199,6 +203,34 @@ typedef struct luaL_Stream {
 
 
 
+/*
+** {======================================================
+** Views
+** =======================================================
+*/
+
+/*
+** A view is a userdata that presents a block of memory as a string
+** to functions that accept views (see 'luaL_checkview'). It has
+** initial structure 'luaL_View' and a metatable with a true field
+** 'LUAL_VIEWFIELD'.
+*/
+
+#define LUAL_VIEWFIELD		"__view"
+
+
+typedef struct luaL_View {
+  const char *p;  /* contents (NULL for closed views) */
+  size_t len;  /* size of contents */
+} luaL_View;
+
+
+LUALIB_API const char *(luaL_checkview) (lua_State *L, int arg, size_t *l);
+
+/* }====================================================== */
+
+
+
 /* compatibility with old module system */
 #if defined(LUA_COMPAT_MODULE)
 
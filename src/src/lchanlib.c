@@ -0,0 +1,994 @@
+/*
+** $Id: lchanlib.c $
+** Channels for message passing among independent states
+** See Copyright Notice in lua.h
+*/
+
+#define lchanlib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "lchanlib.h"
+
+
+/*
+** A channel is a bounded queue of messages that lives outside any
+** state, so that independent states (usually each one running in its
+** own system thread) can use it to talk to each other. A message is a
+** sequence of values copied into a block of plain memory; the queue
+** itself is lock free, and a mutex and a condition variable are used
+** only by system threads that have to wait for a full or empty queue.
+*/
+
+
+/* default number of messages a channel can hold */
+#if !defined(CHAN_DEFSIZE)
+#define CHAN_DEFSIZE	64
+#endif
+
+/* maximum nesting of tables in a message */
+#if !defined(CHAN_MAXDEPTH)
+#define CHAN_MAXDEPTH	200
+#endif
+
+/* size of a cache line, to keep senders and receivers apart */
+#if !defined(CHAN_LINESIZE)
+#define CHAN_LINESIZE	64
+#endif
+
+
+#define CHANNEL		"channel"
+
+
+/*
+** {======================================================
+** Atomic operations and synchronization
+** =======================================================
+*/
+
+#if !defined(chan_load)	/* { */
+
+#if defined(LUA_USE_POSIX) && defined(__GNUC__)	/* { */
+
+#include <pthread.h>
+
+#define CHAN_THREADS
+
+#define chan_load(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define chan_loadrelaxed(p)	__atomic_load_n(p, __ATOMIC_RELAXED)
+#define chan_store(p,v)		__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define chan_cas(p,e,d)  \
+	__atomic_compare_exchange_n(p, e, d, 1, __ATOMIC_RELAXED, \
+	                            __ATOMIC_RELAXED)
+#define chan_add(p,v)		__atomic_add_fetch(p, v, __ATOMIC_SEQ_CST)
+
+typedef struct ChanSync {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} ChanSync;
+
+#define chan_syncinit(s)  \
+	(pthread_mutex_init(&(s)->mutex, NULL), \
+	 pthread_cond_init(&(s)->cond, NULL))
+#define chan_syncfree(s)  \
+	(pthread_cond_destroy(&(s)->cond), \
+	 pthread_mutex_destroy(&(s)->mutex))
+#define chan_lock(s)		pthread_mutex_lock(&(s)->mutex)
+#define chan_unlock(s)		pthread_mutex_unlock(&(s)->mutex)
+#define chan_wait(s)		pthread_cond_wait(&(s)->cond, &(s)->mutex)
+#define chan_wakeall(s)		pthread_cond_broadcast(&(s)->cond)
+
+/* lock for the list of named channels */
+static pthread_mutex_t namedlock = PTHREAD_MUTEX_INITIALIZER;
+#define chan_lockall()		pthread_mutex_lock(&namedlock)
+#define chan_unlockall()	pthread_mutex_unlock(&namedlock)
+
+#else				/* }{ */
+
+/* no system threads: only coroutines can wait for a channel */
+
+#define chan_load(p)		(*(p))
+#define chan_loadrelaxed(p)	(*(p))
+#define chan_store(p,v)		(*(p) = (v))
+#define chan_cas(p,e,d)  \
+	((*(p) == *(e)) ? (*(p) = (d), 1) : (*(e) = *(p), 0))
+#define chan_add(p,v)		(*(p) += (v))
+
+typedef int ChanSync;
+
+#define chan_syncinit(s)	((void)(s))
+#define chan_syncfree(s)	((void)(s))
+#define chan_lock(s)		((void)(s))
+#define chan_unlock(s)		((void)(s))
+#define chan_wakeall(s)		((void)(s))
+
+#define chan_lockall()		((void)0)
+#define chan_unlockall()	((void)0)
+
+#endif				/* } */
+
+#endif				/* } */
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Messages
+** =======================================================
+*/
+
+struct Channel;
+
+
+struct Message {
+  char *data;  /* encoded values */
+  size_t size;  /* number of bytes used in 'data' */
+  size_t capacity;  /* size of 'data' */
+  struct Channel **chans;  /* channels carried by the message */
+  int nchans;
+  int ntables;  /* number of (copied) tables in the message */
+  int nvalues;  /* number of values in the message */
+  const void *heap;  /* heap of frozen values sent by address (or NULL) */
+};
+
+
+/* tags for encoded values */
+enum {
+  MNIL, MFALSE, MTRUE, MINT, MFLT, MSTR, MLUD, MTABLE, MEND, MREF,
+  MFROZEN, MFUNC, MCFUNC, MCHAN
+};
+
+
+static void unrefchannel (struct Channel *c);
+
+
+static void freemessage (Message *m) {
+  int i;
+  for (i = 0; i < m->nchans; i++)
+    unrefchannel(m->chans[i]);
+  free(m->chans);
+  free(m->data);
+  free(m);
+}
+
+
+/*
+** Messages being built or unpacked are kept in a "box" in the stack,
+** so that they are released if there are errors.
+*/
+static int boxgc (lua_State *L) {
+  Message **box = (Message **)lua_touserdata(L, 1);
+  if (*box != NULL) {
+    freemessage(*box);
+    *box = NULL;
+  }
+  return 0;
+}
+
+
+static Message **newbox (lua_State *L) {
+  Message **box = (Message **)lua_newuserdata(L, sizeof(Message *));
+  *box = NULL;
+  if (luaL_newmetatable(L, "_CHANBOX")) {  /* creating metatable? */
+    lua_pushcfunction(L, boxgc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  return box;
+}
+
+
+static Message *newmessage (lua_State *L, Message **box) {
+  Message *m = (Message *)malloc(sizeof(Message));
+  if (m == NULL)
+    luaL_error(L, "not enough memory");
+  memset(m, 0, sizeof(Message));
+  *box = m;
+  return m;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Channels
+** =======================================================
+*/
+
+typedef struct Cell {
+  size_t seq;  /* position this cell is waiting for */
+  Message *msg;
+  const void *heap;  /* copy of 'msg->heap', for receivers to check */
+} Cell;
+
+
+/*
+** Bounded multi-producer multi-consumer queue. Each cell has a
+** sequence number that tells whether it is ready for the sender or
+** for the receiver at a given position, so that producers and
+** consumers only have to compete (with a compare-and-swap) for their
+** own end of the queue.
+*/
+typedef struct Channel {
+  size_t enqpos;  /* position for the next message sent */
+  char pad1[CHAN_LINESIZE - sizeof(size_t)];
+  size_t deqpos;  /* position for the next message received */
+  char pad2[CHAN_LINESIZE - sizeof(size_t)];
+  Cell *cells;
+  size_t mask;  /* size of 'cells' minus 1 */
+  int refs;  /* number of references to this channel */
+  int waiters;  /* number of system threads waiting on this channel */
+  ChanSync sync;
+  char *name;  /* name of a named channel (or NULL) */
+  struct Channel *next;  /* list of named channels */
+} Channel;
+
+
+/* list of named channels */
+static Channel *namedchans = NULL;
+
+
+static int trypush (Channel *c, Message *m) {
+  size_t pos = chan_loadrelaxed(&c->enqpos);
+  Cell *cell;
+  for (;;) {
+    size_t seq;
+    cell = &c->cells[pos & c->mask];
+    seq = chan_load(&cell->seq);
+    if (seq == pos) {  /* cell is free? */
+      if (chan_cas(&c->enqpos, &pos, pos + 1))  /* got it? */
+        break;
+    }
+    else if ((ptrdiff_t)(seq - pos) < 0)  /* cell still in use? */
+      return 0;  /* queue is full */
+    else  /* another sender got this position */
+      pos = chan_loadrelaxed(&c->enqpos);
+  }
+  cell->msg = m;
+  chan_store(&cell->heap, m->heap);  /* (read before getting the cell) */
+  chan_store(&cell->seq, pos + 1);  /* ready for a receiver */
+  return 1;
+}
+
+
+/*
+** Take the next message from the channel. A message with frozen values
+** from a heap that 'L' does not share stays in the channel, and sets
+** '*foreign' (if 'L' is not NULL), as 'L' could not receive it. The
+** heap is read before taking the cell, so it is checked again after
+** reading it: if no one took the cell in between, it belongs to the
+** message at 'pos'.
+*/
+static Message *trypop (Channel *c, lua_State *L, int *foreign) {
+  size_t pos = chan_loadrelaxed(&c->deqpos);
+  Cell *cell;
+  Message *m;
+  for (;;) {
+    size_t seq;
+    cell = &c->cells[pos & c->mask];
+    seq = chan_load(&cell->seq);
+    if (seq == pos + 1) {  /* cell has a message? */
+      const void *heap;
+      if (L != NULL && (heap = chan_load(&cell->heap)) != NULL &&
+          !lua_pushfrozen(L, heap, NULL) && chan_load(&c->deqpos) == pos) {
+        *foreign = 1;
+        return NULL;  /* leave message in the channel */
+      }
+      if (chan_cas(&c->deqpos, &pos, pos + 1))  /* got it? */
+        break;
+    }
+    else if ((ptrdiff_t)(seq - (pos + 1)) < 0)  /* cell still empty? */
+      return NULL;  /* queue is empty */
+    else  /* another receiver got this position */
+      pos = chan_loadrelaxed(&c->deqpos);
+  }
+  m = cell->msg;
+  chan_store(&cell->seq, pos + c->mask + 1);  /* ready for next round */
+  return m;
+}
+
+
+/*
+** Wake up system threads waiting on the channel after a successful
+** operation. Waiters are counted before they check the queue for the
+** last time (see 'waitpush'/'waitpop'), so a waiter either sees the
+** operation or is counted here.
+*/
+static void wakeup (Channel *c) {
+  if (chan_add(&c->waiters, 0) > 0) {  /* (a full barrier) */
+    chan_lock(&c->sync);
+    chan_wakeall(&c->sync);
+    chan_unlock(&c->sync);
+  }
+}
+
+
+#if defined(CHAN_THREADS)
+
+static void waitpush (lua_State *L, Channel *c, Message *m) {
+  (void)L;
+  chan_lock(&c->sync);
+  chan_add(&c->waiters, 1);
+  while (!trypush(c, m))
+    chan_wait(&c->sync);
+  chan_add(&c->waiters, -1);
+  chan_unlock(&c->sync);
+}
+
+
+static Message *waitpop (lua_State *L, Channel *c, int *foreign) {
+  Message *m;
+  chan_lock(&c->sync);
+  chan_add(&c->waiters, 1);
+  while ((m = trypop(c, L, foreign)) == NULL && !*foreign)
+    chan_wait(&c->sync);
+  chan_add(&c->waiters, -1);
+  chan_unlock(&c->sync);
+  return m;
+}
+
+#else
+
+/* with no other system threads, waiting outside a coroutine is forever */
+
+static void waitpush (lua_State *L, Channel *c, Message *m) {
+  (void)c; (void)m;
+  luaL_error(L, "channel is full (and there are no other threads)");
+}
+
+
+static Message *waitpop (lua_State *L, Channel *c, int *foreign) {
+  (void)c; (void)foreign;
+  luaL_error(L, "channel is empty (and there are no other threads)");
+  return NULL;
+}
+
+#endif
+
+
+/* create a new channel; return NULL if there is no memory */
+static Channel *newchannel (lua_Integer size) {
+  size_t n = 2;
+  size_t i;
+  Channel *c = (Channel *)malloc(sizeof(Channel));
+  while ((lua_Integer)n < size)  /* size must be a power of 2 */
+    n *= 2;
+  if (c == NULL || (c->cells = (Cell *)malloc(n * sizeof(Cell))) == NULL) {
+    free(c);
+    return NULL;
+  }
+  for (i = 0; i < n; i++)
+    c->cells[i].seq = i;
+  c->enqpos = c->deqpos = 0;
+  c->mask = n - 1;
+  c->refs = 1;
+  c->waiters = 0;
+  c->name = NULL;
+  c->next = NULL;
+  chan_syncinit(&c->sync);
+  return c;
+}
+
+
+static void unrefchannel (Channel *c) {
+  if (chan_add(&c->refs, -1) == 0) {  /* last reference? */
+    Message *m;
+    while ((m = trypop(c, NULL, NULL)) != NULL)  /* free pending messages */
+      freemessage(m);
+    chan_syncfree(&c->sync);
+    free(c->cells);
+    free(c);
+  }
+}
+
+
+/* push a new reference to channel 'c' */
+static void pushchannel (lua_State *L, Channel *c) {
+  Channel **p = (Channel **)lua_newuserdata(L, sizeof(Channel *));
+  *p = c;
+  chan_add(&c->refs, 1);
+  luaL_setmetatable(L, CHANNEL);
+}
+
+
+static Channel *tochannel (lua_State *L) {
+  Channel **p = (Channel **)luaL_checkudata(L, 1, CHANNEL);
+  luaL_argcheck(L, *p != NULL, 1, "invalid channel");
+  return *p;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Encoding and decoding of values
+** =======================================================
+*/
+
+typedef struct Encoder {
+  lua_State *L;
+  Message *msg;
+  int seen;  /* stack index of table with tables already encoded */
+  int byaddress;  /* true to send frozen values by address */
+} Encoder;
+
+
+static void putbytes (Encoder *e, const void *p, size_t n) {
+  Message *m = e->msg;
+  if (m->capacity - m->size < n) {  /* not enough space? */
+    size_t newsize = m->capacity * 2;
+    char *newdata;
+    if (newsize - m->size < n)  /* double is not big enough? */
+      newsize = m->size + n;
+    if (newsize < 128)
+      newsize = 128;
+    newdata = (char *)realloc(m->data, newsize);
+    if (newdata == NULL)
+      luaL_error(e->L, "not enough memory");
+    m->data = newdata;
+    m->capacity = newsize;
+  }
+  memcpy(m->data + m->size, p, n);
+  m->size += n;
+}
+
+
+static void puttag (Encoder *e, int tag) {
+  char c = (char)tag;
+  putbytes(e, &c, 1);
+}
+
+
+#define putvalue(e,v)	putbytes(e, &(v), sizeof(v))
+
+
+static int writer (lua_State *L, const void *p, size_t sz, void *ud) {
+  (void)L;
+  putbytes((Encoder *)ud, p, sz);
+  return 0;
+}
+
+
+static void addchannel (Encoder *e, Channel *c) {
+  Message *m = e->msg;
+  Channel **chans = (Channel **)realloc(m->chans,
+                                        (m->nchans + 1) * sizeof(Channel *));
+  if (chans == NULL)
+    luaL_error(e->L, "not enough memory");
+  m->chans = chans;
+  chan_add(&c->refs, 1);
+  chans[m->nchans] = c;
+  putvalue(e, m->nchans);
+  m->nchans++;
+}
+
+
+/*
+** Functions are copied as binary chunks, so they cannot have upvalues
+** other than the global environment (which is set to the globals of
+** the receiver).
+*/
+static void encodefunction (Encoder *e, int idx) {
+  lua_State *L = e->L;
+  size_t pos, len;
+  int n;
+  const char *name;
+  for (n = 1; (name = lua_getupvalue(L, idx, n)) != NULL; n++) {
+    lua_pop(L, 1);
+    if (!(n == 1 && strcmp(name, "_ENV") == 0))
+      luaL_error(L, "cannot send a function with upvalues");
+  }
+  if (lua_iscfunction(L, idx)) {
+    lua_CFunction f = lua_tocfunction(L, idx);
+    puttag(e, MCFUNC);
+    putvalue(e, f);
+    return;
+  }
+  puttag(e, MFUNC);
+  pos = e->msg->size;
+  len = 0;
+  putvalue(e, len);  /* reserve space for length */
+  lua_pushvalue(L, idx);
+  lua_dump(L, writer, e, 0);
+  lua_pop(L, 1);
+  len = e->msg->size - pos - sizeof(len);
+  memcpy(e->msg->data + pos, &len, sizeof(len));
+}
+
+
+static void encode (Encoder *e, int idx, int depth);
+
+
+static void encodetable (Encoder *e, int idx, int depth) {
+  lua_State *L = e->L;
+  int ref;
+  if (lua_rawgetp(L, e->seen, lua_topointer(L, idx)) != LUA_TNIL) {
+    ref = (int)lua_tointeger(L, -1);  /* table already in the message */
+    lua_pop(L, 1);
+    puttag(e, MREF);
+    putvalue(e, ref);
+    return;
+  }
+  lua_pop(L, 1);
+  if (depth > CHAN_MAXDEPTH)
+    luaL_error(L, "table too deep to send");
+  luaL_checkstack(L, 3, "table too deep to send");
+  ref = ++e->msg->ntables;
+  lua_pushinteger(L, ref);
+  lua_rawsetp(L, e->seen, lua_topointer(L, idx));
+  puttag(e, MTABLE);
+  lua_pushnil(L);  /* first key */
+  while (lua_next(L, idx)) {
+    int top = lua_gettop(L);
+    encode(e, top - 1, depth + 1);
+    encode(e, top, depth + 1);
+    lua_pop(L, 1);  /* remove value; keep key for next iteration */
+  }
+  puttag(e, MEND);
+}
+
+
+static void encode (Encoder *e, int idx, int depth) {
+  lua_State *L = e->L;
+  switch (lua_type(L, idx)) {
+    case LUA_TNIL: puttag(e, MNIL); break;
+    case LUA_TBOOLEAN: puttag(e, lua_toboolean(L, idx) ? MTRUE : MFALSE); break;
+    case LUA_TNUMBER: {
+      if (lua_isinteger(L, idx)) {
+        lua_Integer i = lua_tointeger(L, idx);
+        puttag(e, MINT);
+        putvalue(e, i);
+      }
+      else {
+        lua_Number n = lua_tonumber(L, idx);
+        puttag(e, MFLT);
+        putvalue(e, n);
+      }
+      break;
+    }
+    case LUA_TSTRING: {
+      size_t len;
+      const char *s = lua_tolstring(L, idx, &len);
+      puttag(e, MSTR);
+      putvalue(e, len);
+      putbytes(e, s, len);
+      break;
+    }
+    case LUA_TLIGHTUSERDATA: {
+      void *p = lua_touserdata(L, idx);
+      puttag(e, MLUD);
+      putvalue(e, p);
+      break;
+    }
+    case LUA_TTABLE: case LUA_TFUNCTION: {
+      const void *heap;
+      const void *p = e->byaddress ? lua_tofrozen(L, idx, &heap) : NULL;
+      if (p != NULL) {  /* frozen value? send only its address */
+        e->msg->heap = heap;  /* receivers must share it */
+        puttag(e, MFROZEN);
+        putvalue(e, heap);
+        putvalue(e, p);
+      }
+      else if (lua_istable(L, idx))
+        encodetable(e, idx, depth);
+      else
+        encodefunction(e, idx);
+      break;
+    }
+    case LUA_TUSERDATA: {
+      Channel **c = (Channel **)luaL_testudata(L, idx, CHANNEL);
+      if (c != NULL) {
+        puttag(e, MCHAN);
+        addchannel(e, *c);
+        break;
+      }
+    }  /* FALLTHROUGH */
+    default:
+      luaL_error(L, "cannot send a %s value", luaL_typename(L, idx));
+  }
+}
+
+
+/*
+** Encode the values from index 'first' to index 'last' into a new
+** message, kept in a new box pushed on the stack.
+*/
+static Message **encodeall (lua_State *L, int first, int last,
+                            int byaddress) {
+  Message **box;
+  Encoder e;
+  int i;
+  luaL_checkstack(L, 5, "too many values to send");
+  box = newbox(L);
+  e.L = L;
+  e.msg = newmessage(L, box);
+  e.byaddress = byaddress;
+  lua_newtable(L);
+  e.seen = lua_gettop(L);
+  for (i = first; i <= last; i++)
+    encode(&e, i, 0);
+  e.msg->nvalues = last - first + 1;
+  lua_pop(L, 1);  /* remove 'seen' table */
+  return box;
+}
+
+
+typedef struct Decoder {
+  lua_State *L;
+  const Message *msg;
+  const char *p;  /* next byte to be decoded */
+  int tables;  /* stack index of table with tables already decoded */
+  int ntables;  /* number of tables already decoded */
+} Decoder;
+
+
+#define getvalue(d,v)	(memcpy(&(v), (d)->p, sizeof(v)), (d)->p += sizeof(v))
+
+
+static void decode (Decoder *d) {
+  lua_State *L = d->L;
+  switch (*d->p++) {
+    case MNIL: lua_pushnil(L); break;
+    case MFALSE: lua_pushboolean(L, 0); break;
+    case MTRUE: lua_pushboolean(L, 1); break;
+    case MINT: {
+      lua_Integer i;
+      getvalue(d, i);
+      lua_pushinteger(L, i);
+      break;
+    }
+    case MFLT: {
+      lua_Number n;
+      getvalue(d, n);
+      lua_pushnumber(L, n);
+      break;
+    }
+    case MSTR: {
+      size_t len;
+      getvalue(d, len);
+      lua_pushlstring(L, d->p, len);
+      d->p += len;
+      break;
+    }
+    case MLUD: {
+      void *p;
+      getvalue(d, p);
+      lua_pushlightuserdata(L, p);
+      break;
+    }
+    case MTABLE: {
+      luaL_checkstack(L, 3, "table too deep to receive");
+      lua_newtable(L);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, d->tables, ++d->ntables);
+      while (*d->p != MEND) {
+        decode(d);  /* key */
+        decode(d);  /* value */
+        lua_rawset(L, -3);
+      }
+      d->p++;  /* skip MEND */
+      break;
+    }
+    case MREF: {
+      int ref;
+      getvalue(d, ref);
+      lua_rawgeti(L, d->tables, ref);
+      break;
+    }
+    case MFROZEN: {
+      const void *heap, *p;
+      getvalue(d, heap);
+      getvalue(d, p);
+      if (!lua_pushfrozen(L, heap, p))
+        luaL_error(L, "cannot receive a frozen value from another heap");
+      break;
+    }
+    case MFUNC: {
+      size_t len;
+      getvalue(d, len);
+      if (luaL_loadbufferx(L, d->p, len, "=(channel)", "b") != LUA_OK)
+        lua_error(L);
+      d->p += len;
+      break;
+    }
+    case MCFUNC: {
+      lua_CFunction f;
+      getvalue(d, f);
+      lua_pushcfunction(L, f);
+      break;
+    }
+    case MCHAN: {
+      int i;
+      getvalue(d, i);
+      pushchannel(L, d->msg->chans[i]);
+      break;
+    }
+    default: lua_assert(0);
+  }
+}
+
+
+/* push the values of message 'm'; return the number of values pushed */
+static int decodemsg (lua_State *L, const Message *m) {
+  Decoder d;
+  int n = m->nvalues;
+  int i;
+  luaL_checkstack(L, n + 2, "too many values to receive");
+  d.L = L;
+  d.msg = m;
+  d.p = m->data;
+  d.ntables = 0;
+  if (m->ntables > 0) {
+    lua_createtable(L, m->ntables, 0);
+    d.tables = lua_gettop(L);
+  }
+  else
+    d.tables = 0;
+  for (i = 0; i < n; i++)
+    decode(&d);
+  if (d.tables != 0)
+    lua_remove(L, d.tables);
+  return n;
+}
+
+
+/* push the values of the message in 'box' and free it */
+static int decodeall (lua_State *L, Message **box) {
+  Message *m = *box;
+  int n = decodemsg(L, m);
+  *box = NULL;
+  freemessage(m);
+  return n;
+}
+
+
+/*
+** Messages for other libraries (see 'lchanlib.h'). These ones always
+** copy frozen values, as their receivers may not share the heap.
+*/
+
+Message *luaCH_pack (lua_State *L, int first, int last) {
+  Message **box = encodeall(L, first, last, 0);
+  Message *m = *box;
+  *box = NULL;  /* message now belongs to the caller */
+  lua_pop(L, 1);  /* remove box */
+  return m;
+}
+
+
+int luaCH_unpack (lua_State *L, const Message *m) {
+  return decodemsg(L, m);
+}
+
+
+void luaCH_free (Message *m) {
+  freemessage(m);
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Library functions
+** =======================================================
+*/
+
+/*
+** An operation that cannot be done right away yields when inside a
+** coroutine, giving the channel and the name of the operation to the
+** resumer (e.g., a scheduler), and tries again when resumed; otherwise,
+** it waits until another system thread makes it possible. 'ctx' is the
+** stack index of the message box.
+*/
+static int sendk (lua_State *L, int status, lua_KContext ctx) {
+  Channel *c = tochannel(L);
+  Message **box = (Message **)lua_touserdata(L, (int)ctx);
+  (void)status;
+  lua_settop(L, (int)ctx);  /* remove values given to 'resume' */
+  if (!trypush(c, *box)) {  /* channel is full? */
+    if (lua_isyieldable(L)) {
+      lua_pushvalue(L, 1);
+      lua_pushliteral(L, "send");
+      return lua_yieldk(L, 2, ctx, sendk);
+    }
+    waitpush(L, c, *box);
+  }
+  *box = NULL;  /* message now belongs to the channel */
+  wakeup(c);
+  return 0;
+}
+
+
+static int ch_send (lua_State *L) {
+  tochannel(L);
+  encodeall(L, 2, lua_gettop(L), 1);
+  return sendk(L, LUA_OK, lua_gettop(L));
+}
+
+
+static int ch_trysend (lua_State *L) {
+  Channel *c = tochannel(L);
+  Message **box = encodeall(L, 2, lua_gettop(L), 1);
+  if (trypush(c, *box)) {
+    *box = NULL;  /* message now belongs to the channel */
+    wakeup(c);
+    lua_pushboolean(L, 1);
+  }
+  else
+    lua_pushboolean(L, 0);
+  return 1;
+}
+
+
+static int foreignerror (lua_State *L) {
+  return luaL_error(L, "cannot receive a frozen value from another heap");
+}
+
+
+static int recvk (lua_State *L, int status, lua_KContext ctx) {
+  Channel *c = tochannel(L);
+  Message **box = (Message **)lua_touserdata(L, (int)ctx);
+  int foreign = 0;
+  (void)status;
+  lua_settop(L, (int)ctx);  /* remove values given to 'resume' */
+  if ((*box = trypop(c, L, &foreign)) == NULL) {  /* channel is empty? */
+    if (foreign)
+      return foreignerror(L);
+    if (lua_isyieldable(L)) {
+      lua_pushvalue(L, 1);
+      lua_pushliteral(L, "recv");
+      return lua_yieldk(L, 2, ctx, recvk);
+    }
+    if ((*box = waitpop(L, c, &foreign)) == NULL)
+      return foreignerror(L);
+  }
+  wakeup(c);
+  return decodeall(L, box);
+}
+
+
+static int ch_recv (lua_State *L) {
+  tochannel(L);
+  lua_settop(L, 1);
+  newbox(L);
+  return recvk(L, LUA_OK, 2);
+}
+
+
+static int ch_tryrecv (lua_State *L) {
+  Channel *c = tochannel(L);
+  Message **box;
+  int foreign = 0;
+  lua_settop(L, 1);
+  box = newbox(L);
+  if ((*box = trypop(c, L, &foreign)) == NULL) {
+    if (foreign)
+      return foreignerror(L);
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  wakeup(c);
+  lua_pushboolean(L, 1);
+  return 1 + decodeall(L, box);
+}
+
+
+static int ch_gc (lua_State *L) {
+  Channel **p = (Channel **)luaL_checkudata(L, 1, CHANNEL);
+  if (*p != NULL) {
+    unrefchannel(*p);
+    *p = NULL;
+  }
+  return 0;
+}
+
+
+static int ch_tostring (lua_State *L) {
+  Channel *c = tochannel(L);
+  if (c->name != NULL)
+    lua_pushfstring(L, "channel (%s): %p", c->name, (void *)c);
+  else
+    lua_pushfstring(L, "channel: %p", (void *)c);
+  return 1;
+}
+
+
+static lua_Integer checksize (lua_State *L, int arg) {
+  lua_Integer size = luaL_optinteger(L, arg, CHAN_DEFSIZE);
+  luaL_argcheck(L, 0 < size && size <= (INT_MAX / 2), arg,
+                   "invalid channel size");
+  return size;
+}
+
+
+static int chan_new (lua_State *L) {
+  lua_Integer size = checksize(L, 1);
+  Channel **p = (Channel **)lua_newuserdata(L, sizeof(Channel *));
+  *p = NULL;
+  luaL_setmetatable(L, CHANNEL);
+  if ((*p = newchannel(size)) == NULL)
+    return luaL_error(L, "not enough memory");
+  return 1;
+}
+
+
+/*
+** Named channels are created on first use and then live until the end
+** of the program, so that independent states can find each other.
+*/
+static int chan_named (lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  lua_Integer size = checksize(L, 2);
+  Channel *c;
+  chan_lockall();
+  for (c = namedchans; c != NULL; c = c->next) {
+    if (strcmp(c->name, name) == 0)
+      break;
+  }
+  if (c == NULL) {  /* new name? */
+    size_t len = strlen(name) + 1;
+    char *cname = (char *)malloc(len);
+    if (cname == NULL || (c = newchannel(size)) == NULL) {
+      chan_unlockall();
+      free(cname);
+      return luaL_error(L, "not enough memory");
+    }
+    c->name = (char *)memcpy(cname, name, len);
+    c->next = namedchans;
+    namedchans = c;
+  }
+  chan_unlockall();
+  pushchannel(L, c);
+  return 1;
+}
+
+
+static const luaL_Reg chan_funcs[] = {
+  {"new", chan_new},
+  {"named", chan_named},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg ch_meths[] = {
+  {"send", ch_send},
+  {"trysend", ch_trysend},
+  {"recv", ch_recv},
+  {"tryrecv", ch_tryrecv},
+  {"__gc", ch_gc},
+  {"__tostring", ch_tostring},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_channel (lua_State *L) {
+  luaL_newmetatable(L, CHANNEL);  /* metatable for channels */
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_setfuncs(L, ch_meths, 0);  /* add channel methods */
+  lua_pop(L, 1);  /* pop metatable */
+  luaL_newlib(L, chan_funcs);
+  return 1;
+}
+
+/* }====================================================== */
+
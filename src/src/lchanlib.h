@@ -0,0 +1,30 @@
+/*
+** $Id: lchanlib.h $
+** Messages of the channel library, for other libraries
+** See Copyright Notice in lua.h
+*/
+
+#ifndef lchanlib_h
+#define lchanlib_h
+
+#include "lua.h"
+
+
+/*
+** A message is a sequence of values copied into plain memory, so that
+** it can be built by one state and unpacked by another, independent
+** one (see 'lchanlib.c').
+*/
+typedef struct Message Message;
+
+
+/* copy values from 'first' to 'last' into a new message */
+LUAI_FUNC Message *luaCH_pack (lua_State *L, int first, int last);
+
+/* push the values of a message; return their number */
+LUAI_FUNC int luaCH_unpack (lua_State *L, const Message *m);
+
+LUAI_FUNC void luaCH_free (Message *m);
+
+#endif
+
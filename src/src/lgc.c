@@ -193,6 +193,8 @@ void luaC_upvalbarrier_ (lua_State *L, UpVal *uv) {
 
 void luaC_fix (lua_State *L, GCObject *o) {
   global_State *g = G(L);
+  if (isfrozen(o))  /* object from a shared heap? */
+    return;  /* it is already immortal */
   lua_assert(g->allgc == o);  /* object must be 1st in 'allgc' list! */
   white2gray(o);  /* they will be gray forever */
   g->allgc = o->next;  /* remove object from 'allgc' list */
@@ -243,7 +245,9 @@ static void reallymarkobject (global_State *g, GCObject *o) {
     }
     case LUA_TLNGSTR: {
       gray2black(o);
-      g->GCmemtrav += sizelstring(gco2ts(o)->u.lnglen);
+      g->GCmemtrav += sizelngstr(gco2ts(o));
+      if (isbufstr(gco2ts(o)))  /* in a shared buffer? */
+        markobject(g, &strbuf(gco2ts(o))->ts);  /* mark the buffer */
       break;
     }
     case LUA_TUSERDATA: {
@@ -448,13 +452,25 @@ static void traversestrongtable (global_State *g, Table *h) {
 }
 
 
+/*
+** Check whether mode string 'mode' has the character 'c' (before any
+** '\0', like 'strchr'). The string may lack its final zero, if it is
+** in a shared buffer (see 'luaS_extend').
+*/
+static int hasmode (const TValue *mode, int c) {
+  const char *s = svalue(mode);
+  const char *p = cast(const char *, memchr(s, c, vslen(mode)));
+  return (p != NULL && memchr(s, '\0', p - s) == NULL);
+}
+
+
 static lu_mem traversetable (global_State *g, Table *h) {
-  const char *weakkey, *weakvalue;
+  int weakkey, weakvalue;
   const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
   markobjectN(g, h->metatable);
   if (mode && ttisstring(mode) &&  /* is there a weak mode? */
-      ((weakkey = strchr(svalue(mode), 'k')),
-       (weakvalue = strchr(svalue(mode), 'v')),
+      ((weakkey = hasmode(mode, 'k')),
+       (weakvalue = hasmode(mode, 'v')),
        (weakkey || weakvalue))) {  /* is really weak? */
     black2gray(h);  /* keep table gray */
     if (!weakkey)  /* strong keys? */
@@ -527,6 +543,20 @@ static lu_mem traverseLclosure (global_State *g, LClosure *cl) {
 }
 
 
+/*
+** With LUA_USE_THREADS, a thread running a C function or a hook does
+** not hold the lock, and it may be reading its stack through the API
+** while another system thread runs the collector; so, only stacks of
+** threads that are in Lua code (or not running at all) can move.
+*/
+#if defined(LUA_USE_THREADS)
+#define canshrink(th)  \
+	(isLua((th)->ci) && !((th)->ci->callstatus & CIST_HOOKED))
+#else
+#define canshrink(th)	1
+#endif
+
+
 static lu_mem traversethread (global_State *g, lua_State *th) {
   StkId o = th->stack;
   if (o == NULL)
@@ -545,7 +575,7 @@ static lu_mem traversethread (global_State *g, lua_State *th) {
       g->twups = th;
     }
   }
-  else if (g->gckind != KGC_EMERGENCY)
+  else if (g->gckind != KGC_EMERGENCY && canshrink(th))
     luaD_shrinkstack(th); /* do not change stack in emergency cycle */
   return (sizeof(lua_State) + sizeof(TValue) * th->stacksize +
           sizeof(CallInfo) * th->nci);
@@ -713,7 +743,7 @@ static void freeobj (lua_State *L, GCObject *o) {
       luaM_freemem(L, o, sizelstring(gco2ts(o)->shrlen));
       break;
     case LUA_TLNGSTR: {
-      luaM_freemem(L, o, sizelstring(gco2ts(o)->u.lnglen));
+      luaS_freelngstr(L, gco2ts(o));
       break;
     }
     default: lua_assert(0);
@@ -779,7 +809,7 @@ static void checkSizes (lua_State *L, global_State *g) {
   if (g->gckind != KGC_EMERGENCY) {
     l_mem olddebt = g->GCdebt;
     if (g->strt.nuse < g->strt.size / 4)  /* string table too big? */
-      luaS_resize(L, g->strt.size / 2);  /* shrink it a little */
+      luaS_resize(L, &g->strt, g->strt.size / 2);  /* shrink it a little */
     g->GCestimate += g->GCdebt - olddebt;  /* update estimate */
   }
 }
@@ -826,9 +856,11 @@ static void GCTM (lua_State *L, int propagateerrors) {
     g->gcrunning = running;  /* restore state */
     if (status != LUA_OK && propagateerrors) {  /* error while running __gc? */
       if (status == LUA_ERRRUN) {  /* is there an error object? */
-        const char *msg = (ttisstring(L->top - 1))
-                            ? svalue(L->top - 1)
-                            : "no message";
+        const char *msg = "no message";
+        if (ttisstring(L->top - 1)) {
+          luaS_seal(L, tsvalue(L->top - 1));
+          msg = svalue(L->top - 1);
+        }
         luaO_pushfstring(L, "error in __gc metamethod (%s)", msg);
         status = LUA_ERRGCMM;  /* error in __gc metamethod */
       }
@@ -975,7 +1007,8 @@ void luaC_freeallobjects (lua_State *L) {
   sweepwholelist(L, &g->finobj);
   sweepwholelist(L, &g->allgc);
   sweepwholelist(L, &g->fixedgc);  /* collect fixed objects */
-  lua_assert(g->strt.nuse == 0);
+  sweepwholelist(L, &g->frozengc);  /* collect frozen objects */
+  lua_assert(g->strt.nuse == 0 && g->frozenstrt.nuse == 0);
 }
 
 
@@ -1046,7 +1079,7 @@ static lu_mem singlestep (lua_State *L) {
   global_State *g = G(L);
   switch (g->gcstate) {
     case GCSpause: {
-      g->GCmemtrav = g->strt.size * sizeof(GCObject*);
+      g->GCmemtrav = (g->strt.size + g->strt.oldsize) * sizeof(GCObject*);
       restartcollection(g);
       g->gcstate = GCSpropagate;
       return g->GCmemtrav;
@@ -1177,3 +1210,196 @@ void luaC_fullgc (lua_State *L, int isemergency) {
 /* }====================================================== */
 
 
+
+
+/*
+** {======================================================
+** Frozen objects
+** =======================================================
+*/
+
+/*
+** Frozen objects are immutable and live until their owner state is
+** closed, in list 'frozengc'. They are kept black (and frozen) forever,
+** so that no collector, either from their owner or from any state
+** sharing its heap, ever marks, sweeps, or calls a barrier for them.
+** Freezing works like a small collection over a paused collector:
+** objects to be frozen are marked black (all other objects in 'allgc'
+** are white) and objects with references are traversed through list
+** 'gray', which has no other use while the collector is paused.
+*/
+
+#define frozenbits	cast_byte(bitmask(BLACKBIT) | bitmask(FROZENBIT))
+
+
+/* "type" of objects that cannot be frozen because of finalizers */
+#define FROZENFIN	LUA_NUMTAGS
+
+/* "type" of objects that cannot be frozen for lack of memory */
+#define FROZENMEM	(LUA_NUMTAGS + 1)
+
+
+/*
+** Mark an object to be frozen. Return 0 if it can be frozen; otherwise,
+** return its type (or FROZENFIN).
+*/
+static int freezeobject (global_State *g, GCObject *o) {
+  if (!iswhite(o))  /* already frozen, visited, or fixed? */
+    return 0;
+  switch (o->tt) {
+    case LUA_TSHRSTR: break;
+    case LUA_TLNGSTR: {
+      if (isbufstr(gco2ts(o)) && !luaS_detach(g, gco2ts(o)))
+        return FROZENMEM;  /* could not leave its shared buffer */
+      luaS_hashlongstr(gco2ts(o));  /* hash cannot change later */
+      break;
+    }
+    case LUA_TTABLE: {
+      if (tofinalize(o))  /* table has a finalizer? */
+        return FROZENFIN;
+      linkgclist(gco2t(o), g->gray);
+      break;
+    }
+    case LUA_TPROTO: {
+      linkgclist(gco2p(o), g->gray);
+      break;
+    }
+    default: return novariant(o->tt);  /* closures, userdata, threads */
+  }
+  white2gray(o);
+  gray2black(o);
+  return 0;
+}
+
+
+#define freezevalue(g,o)  \
+	(iscollectable(o) ? freezeobject(g, gcvalue(o)) : 0)
+
+#define freezeobjectN(g,t)	((t) ? freezeobject(g, obj2gco(t)) : 0)
+
+
+static int freezetable (global_State *g, Table *h) {
+  Node *n, *limit = gnodelast(h);
+  unsigned int i;
+  int bad = freezeobjectN(g, h->metatable);
+  for (i = 0; bad == 0 && i < h->sizearray; i++)
+    bad = freezevalue(g, &h->array[i]);
+  for (n = gnode(h, 0); bad == 0 && n < limit; n++) {
+    checkdeadkey(n);
+    if (ttisnil(gval(n)))  /* entry is empty? */
+      removeentry(n);  /* do not keep its key */
+    else if ((bad = freezevalue(g, gkey(n))) == 0)
+      bad = freezevalue(g, gval(n));
+  }
+  if (bad == 0) {  /* fill the metamethod cache, which cannot change later */
+    int e;
+    for (e = TM_INDEX; e <= TM_EQ; e++)
+      luaT_gettm(h, cast(TMS, e), g->tmname[e]);
+  }
+  return bad;
+}
+
+
+static int freezeproto (global_State *g, Proto *f) {
+  int i;
+  int bad = freezeobjectN(g, f->source);
+  f->cache = NULL;  /* closures are not shared */
+  for (i = 0; bad == 0 && i < f->sizek; i++)
+    bad = freezevalue(g, &f->k[i]);
+  for (i = 0; bad == 0 && i < f->sizeupvalues; i++)
+    bad = freezeobjectN(g, f->upvalues[i].name);
+  for (i = 0; bad == 0 && i < f->sizep; i++)
+    bad = freezeobjectN(g, f->p[i]);
+  for (i = 0; bad == 0 && i < f->sizelocvars; i++)
+    bad = freezeobjectN(g, f->locvars[i].varname);
+  return bad;
+}
+
+
+/*
+** Move a marked (or fixed) object to list 'frozengc'
+*/
+static void linkfrozen (lua_State *L, GCObject *o) {
+  global_State *g = G(L);
+  if (o->tt == LUA_TSHRSTR)
+    luaS_freeze(L, gco2ts(o));  /* move it to the frozen string table */
+  o->marked = frozenbits;
+  o->next = g->frozengc;
+  g->frozengc = o;
+}
+
+
+/*
+** Freeze value 'o' and everything reachable from it. A Lua function
+** is frozen by freezing its prototype (closures cannot be frozen). The
+** first freeze also freezes all fixed objects, as they are used by any
+** state sharing the heap (e.g., as metamethod names).
+*/
+void luaC_freeze (lua_State *L, const TValue *o) {
+  global_State *g = G(L);
+  TValue v;
+  GCObject **p;
+  int bad;
+  if (g->sharedg != NULL && g->sharedg != g)
+    luaG_runerror(L, "cannot freeze objects in a state sharing a heap");
+  if (g->heapsealed)
+    luaG_runerror(L, "cannot freeze objects after sharing the heap");
+  setobj(L, &v, o);  /* 'o' may move if a finalizer reallocates the stack */
+  if (keepinvariant(g))  /* black objects? */
+    entersweep(L);  /* sweep everything to turn them back to white */
+  luaC_runtilstate(L, bitmask(GCSpause));  /* finish current cycle */
+  /* an interrupted mark phase may have left objects in the gray lists */
+  g->gray = g->grayagain = NULL;
+  g->weak = g->allweak = g->ephemeron = NULL;
+  if (g->frozenstrt.size == 0)
+    luaS_resize(L, &g->frozenstrt, MINSTRTABSIZE);
+  bad = ttisLclosure(&v) ? freezeobject(g, obj2gco(clLvalue(&v)->p))
+                         : freezevalue(g, &v);
+  while (bad == 0 && g->gray != NULL) {
+    GCObject *w = g->gray;
+    if (w->tt == LUA_TTABLE) {
+      g->gray = gco2t(w)->gclist;
+      bad = freezetable(g, gco2t(w));
+    }
+    else {
+      g->gray = gco2p(w)->gclist;
+      bad = freezeproto(g, gco2p(w));
+    }
+  }
+  g->gray = NULL;
+  p = &g->allgc;
+  while (*p != NULL) {  /* move marked objects to 'frozengc' */
+    GCObject *curr = *p;
+    if (!isblack(curr))  /* not marked? */
+      p = &curr->next;  /* skip it */
+    else if (bad != 0) {  /* failed? */
+      makewhite(g, curr);  /* undo mark */
+      p = &curr->next;
+    }
+    else {
+      *p = curr->next;  /* remove 'curr' from 'allgc' */
+      linkfrozen(L, curr);
+    }
+  }
+  if (bad == FROZENFIN)
+    luaG_runerror(L, "cannot freeze an object with a finalizer");
+  else if (bad == FROZENMEM)
+    luaD_throw(L, LUA_ERRMEM);
+  else if (bad != 0)
+    luaG_runerror(L, "cannot freeze a %s value", ttypename(bad));
+  while (g->fixedgc != NULL) {  /* first freeze? */
+    GCObject *curr = g->fixedgc;
+    g->fixedgc = curr->next;
+    linkfrozen(L, curr);
+  }
+  g->sharedg = g;  /* state now owns a frozen heap */
+  if (g->frozenstrt.nuse >= g->frozenstrt.size &&
+      g->frozenstrt.size <= MAX_INT/2) {
+    int size = g->frozenstrt.size;
+    while (g->frozenstrt.nuse >= size && size <= MAX_INT/2) size *= 2;
+    luaS_resize(L, &g->frozenstrt, size);
+  }
+}
+
+/* }====================================================== */
+
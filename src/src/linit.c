@@ -49,6 +49,11 @@ static const luaL_Reg loadedlibs[] = {
   {LUA_STRLIBNAME, luaopen_string},
   {LUA_MATHLIBNAME, luaopen_math},
   {LUA_UTF8LIBNAME, luaopen_utf8},
+  {LUA_BUFLIBNAME, luaopen_buffer},
+  {LUA_ARRLIBNAME, luaopen_array},
+  {LUA_CHANLIBNAME, luaopen_channel},
+  {LUA_PARLIBNAME, luaopen_parallel},
+  {LUA_SCHEDLIBNAME, luaopen_sched},
   {LUA_DBLIBNAME, luaopen_debug},
 #if defined(LUA_COMPAT_BITLIB)
   {LUA_BITLIBNAME, luaopen_bit32},
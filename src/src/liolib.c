@@ -7,6 +7,10 @@
 #define liolib_c
 #define LUA_LIB
 
+#if defined(LUA_USE_LINUX) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE		/* for 'syscall' (see 'ring_open') */
+#endif
+
 #include "lprefix.h"
 
 
@@ -22,6 +26,8 @@
 #include "lauxlib.h"
 #include "lualib.h"
 
+#include "liolib.h"
+
 
 
 
@@ -95,6 +101,32 @@ static int l_checkmode (const char *mode) {
 #endif				/* } */
 
 
+/*
+** l_inbuffer(f,n) returns the unread data in the buffer of stream 'f'
+** and sets 'n' to its size; l_consume(f,n) skips 'n' bytes of that
+** data. Both need the stream locked. This fast path is optional:
+** without access to the buffer, 'l_inbuffer' always gives no data and
+** reads go byte by byte, with the same results. The default for glibc
+** reads private fields of 'FILE', which are not a stable interface;
+** define LUA_NOSTDIOPEEK to avoid them, or define both macros to use
+** other means.
+*/
+#if !defined(l_inbuffer)	/* { */
+
+#if defined(__GLIBC__) && !defined(LUA_NOSTDIOPEEK)
+#define l_inbuffer(f,n)  \
+	((n) = ((f)->_IO_read_ptr < (f)->_IO_read_end) \
+	     ? (size_t)((f)->_IO_read_end - (f)->_IO_read_ptr) : 0, \
+	 (const char *)(f)->_IO_read_ptr)
+#define l_consume(f,n)		((void)((f)->_IO_read_ptr += (n)))
+#else
+#define l_inbuffer(f,n)		((void)(f), (n) = 0, (const char *)NULL)
+#define l_consume(f,n)		((void)(n))
+#endif
+
+#endif				/* } */
+
+
 /*
 ** {======================================================
 ** l_fseek: configuration for longer offsets
@@ -373,6 +405,886 @@ static int io_lines (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Asynchronous mode
+** =======================================================
+*/
+
+/*
+** A file in asynchronous mode does not use its C stream: it keeps its
+** own offset and read-ahead buffer (in an 'AsyncFile', the user value
+** of the file handle) and reads and writes its descriptor directly.
+** When a coroutine must wait for a read or a write, it starts the
+** operation in the io_uring ring of the state and yields the file and
+** "io" (see 'liolib.h'); otherwise (or without a ring), the operation
+** is done synchronously. Each operation owns its data, so that it can
+** outlive the file and the coroutine that started it: whoever sees it
+** last (the file or the ring) frees it.
+*/
+
+#if !defined(l_uring)
+#if defined(LUA_USE_LINUX) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define l_uring
+#endif
+#endif
+#endif
+
+#if defined(l_uring)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+/*
+** With LUA_USE_THREADS, C functions run without the global lock (see
+** 'luaconf.h'), so system threads sharing a state would race on its
+** ring. Each ring then has its own lock, which covers the queues, the
+** list of completed operations, and the 'done', 'waiter', 'notified',
+** and 'orphan' fields of operations in the ring; and 'ringslock'
+** keeps two threads from both creating the ring of a state.
+*/
+#if defined(LUA_USE_THREADS)
+#include <pthread.h>
+static pthread_mutex_t ringslock = PTHREAD_MUTEX_INITIALIZER;
+#define lockrings()		pthread_mutex_lock(&ringslock)
+#define unlockrings()		pthread_mutex_unlock(&ringslock)
+#else
+#define lockrings()		((void)0)
+#define unlockrings()		((void)0)
+#endif
+
+#if defined(l_uring) && defined(LUA_USE_THREADS)
+#define ringlock_t		pthread_mutex_t
+#define initring(R)		pthread_mutex_init(&(R)->lock, NULL)
+#define freering(R)		pthread_mutex_destroy(&(R)->lock)
+#define lockring(R)		pthread_mutex_lock(&(R)->lock)
+#define unlockring(R)		pthread_mutex_unlock(&(R)->lock)
+#else
+#define ringlock_t		char
+#define initring(R)		((void)(R))
+#define freering(R)		((void)(R))
+#define lockring(R)		((void)(R))
+#define unlockring(R)		((void)(R))
+#endif
+
+
+/* size of each read from the descriptor */
+#if !defined(L_ASYNCREAD)
+#define L_ASYNCREAD	65536
+#endif
+
+/* number of entries in the submission queue of the ring */
+#if !defined(L_ASYNCENTRIES)
+#define L_ASYNCENTRIES	256
+#endif
+
+
+#define ASYNCFILE	"io.asyncfile"
+#define ASYNCRING	"io.ring"
+#define IO_RING		(IO_PREFIX "ring")
+
+
+/* kinds of operations */
+#define AREAD		0
+#define AWRITE		1
+
+
+typedef struct AsyncOp {
+  struct AsyncOp *nextdone;  /* list of completed operations with waiters */
+  void (*wake) (void *waiter);  /* how to tell its waiter */
+  void *waiter;  /* who waits for it (see 'luaIO_setwaiter') */
+  char *buf;  /* data still to be written, or space for data read */
+  size_t len;
+  int res;  /* result (number of bytes or a negated error code) */
+  char done;  /* true when complete */
+  char notified;  /* true when its waiter was told about it */
+  char orphan;  /* true when the file does not need it anymore */
+#if defined(l_uring)
+  struct iovec iov;
+#endif
+} AsyncOp;
+
+
+#if defined(l_uring)	/* { */
+
+typedef struct Ring {
+  int fd;  /* descriptor of the ring (-1 if there is no ring) */
+  unsigned int inflight;  /* number of operations in progress */
+  unsigned int maxinflight;  /* size of the completion queue */
+  int curpos;  /* true if offset -1 means the current position */
+  AsyncOp *done, *lastdone;  /* list of completed operations with waiters */
+  unsigned int *sqtail, *sqmask, *sqarray;
+  struct io_uring_sqe *sqes;
+  unsigned int *cqhead, *cqtail, *cqmask;
+  struct io_uring_cqe *cqes;
+  void *sqmem, *cqmem;  /* mapped memory of the queues */
+  size_t sqsize, cqsize, sqessize;
+  ringlock_t lock;
+} Ring;
+
+
+static void *ring_map (int fd, size_t size, unsigned long long off) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, (off_t)off);
+  return (p == MAP_FAILED) ? NULL : p;
+}
+
+
+/* create the ring; without one, all operations are synchronous */
+static void ring_open (Ring *R) {
+  struct io_uring_params p;
+  int fd;
+  memset(R, 0, sizeof(Ring));
+  memset(&p, 0, sizeof(p));
+  initring(R);
+  R->fd = -1;
+  fd = (int)syscall(__NR_io_uring_setup, L_ASYNCENTRIES, &p);
+  if (fd < 0)
+    return;  /* no ring (old kernel, no permission, etc.) */
+  R->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  R->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  R->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+  R->sqmem = ring_map(fd, R->sqsize, IORING_OFF_SQ_RING);
+  R->cqmem = ring_map(fd, R->cqsize, IORING_OFF_CQ_RING);
+  R->sqes = (struct io_uring_sqe *)ring_map(fd, R->sqessize, IORING_OFF_SQES);
+  if (R->sqmem == NULL || R->cqmem == NULL || R->sqes == NULL) {
+    if (R->sqmem) munmap(R->sqmem, R->sqsize);
+    if (R->cqmem) munmap(R->cqmem, R->cqsize);
+    if (R->sqes) munmap(R->sqes, R->sqessize);
+    close(fd);
+    return;
+  }
+  R->sqtail = (unsigned int *)((char *)R->sqmem + p.sq_off.tail);
+  R->sqmask = (unsigned int *)((char *)R->sqmem + p.sq_off.ring_mask);
+  R->sqarray = (unsigned int *)((char *)R->sqmem + p.sq_off.array);
+  R->cqhead = (unsigned int *)((char *)R->cqmem + p.cq_off.head);
+  R->cqtail = (unsigned int *)((char *)R->cqmem + p.cq_off.tail);
+  R->cqmask = (unsigned int *)((char *)R->cqmem + p.cq_off.ring_mask);
+  R->cqes = (struct io_uring_cqe *)((char *)R->cqmem + p.cq_off.cqes);
+  R->maxinflight = p.cq_entries;
+#if defined(IORING_FEAT_RW_CUR_POS)
+  R->curpos = (p.features & IORING_FEAT_RW_CUR_POS) != 0;
+#endif
+  R->fd = fd;
+}
+
+
+/*
+** Submit an operation on descriptor 'fd' at 'offset' (-1 for streams).
+** Return 0 if the operation cannot be submitted.
+*/
+static int ring_submit (Ring *R, int kind, int fd, AsyncOp *op,
+                        l_seeknum offset) {
+  unsigned int tail, idx;
+  struct io_uring_sqe *sqe;
+  lockring(R);
+  if (R->fd < 0 || R->inflight >= R->maxinflight ||
+      (offset < 0 && !R->curpos)) {
+    unlockring(R);
+    return 0;
+  }
+  op->iov.iov_base = op->buf;
+  op->iov.iov_len = op->len;
+  tail = *R->sqtail;
+  idx = tail & *R->sqmask;
+  sqe = &R->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = (kind == AREAD) ? IORING_OP_READV : IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->off = (unsigned long long)offset;  /* -1 becomes all ones */
+  sqe->addr = (unsigned long long)(size_t)&op->iov;
+  sqe->len = 1;
+  sqe->user_data = (unsigned long long)(size_t)op;
+  R->sqarray[idx] = idx;
+  __atomic_store_n(R->sqtail, tail + 1, __ATOMIC_RELEASE);
+  if (syscall(__NR_io_uring_enter, R->fd, 1, 0, 0, NULL, 0) != 1) {
+    __atomic_store_n(R->sqtail, tail, __ATOMIC_RELEASE);  /* withdraw it */
+    unlockring(R);
+    return 0;
+  }
+  R->inflight++;
+  unlockring(R);
+  return 1;
+}
+
+
+/* collect completed operations (with the ring locked) */
+static void ring_reap (Ring *R) {
+  unsigned int head, tail;
+  if (R->fd < 0)
+    return;
+  head = *R->cqhead;
+  tail = __atomic_load_n(R->cqtail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &R->cqes[head & *R->cqmask];
+    AsyncOp *op = (AsyncOp *)(size_t)cqe->user_data;
+    op->res = cqe->res;
+    op->done = 1;
+    R->inflight--;
+    if (op->waiter != NULL) {  /* somebody must be told? */
+      op->nextdone = NULL;
+      if (R->lastdone) R->lastdone->nextdone = op;
+      else R->done = op;
+      R->lastdone = op;
+    }
+    else if (op->orphan)
+      free(op);
+  }
+  __atomic_store_n(R->cqhead, head, __ATOMIC_RELEASE);
+}
+
+
+/* check whether 'op' is complete */
+static int ring_poll (Ring *R, AsyncOp *op) {
+  int done;
+  lockring(R);
+  ring_reap(R);
+  done = op->done;
+  unlockring(R);
+  return done;
+}
+
+
+/*
+** Block until 'op' completes. It keeps the ring locked while waiting,
+** as another thread could otherwise collect the completion that the
+** wait is for, leaving it blocked.
+*/
+static void ring_wait (Ring *R, AsyncOp *op) {
+  lockring(R);
+  for (ring_reap(R); !op->done; ring_reap(R))
+    syscall(__NR_io_uring_enter, R->fd, 0, 1, IORING_ENTER_GETEVENTS,
+            NULL, 0);
+  unlockring(R);
+}
+
+
+/* wait for all operations in progress and destroy the ring */
+static void ring_close (Ring *R) {
+  AsyncOp *op;
+  if (R->fd < 0) {
+    freering(R);
+    return;
+  }
+  for (ring_reap(R); R->inflight > 0; ring_reap(R))
+    syscall(__NR_io_uring_enter, R->fd, 0, 1, IORING_ENTER_GETEVENTS,
+            NULL, 0);
+  for (op = R->done; op != NULL; ) {  /* last chance to tell waiters */
+    AsyncOp *next = op->nextdone;
+    op->notified = 1;
+    (*op->wake)(op->waiter);
+    if (op->orphan) free(op);
+    op = next;
+  }
+  R->done = R->lastdone = NULL;
+  munmap(R->sqes, R->sqessize);
+  munmap(R->cqmem, R->cqsize);
+  munmap(R->sqmem, R->sqsize);
+  close(R->fd);
+  R->fd = -1;
+  freering(R);
+}
+
+#else				/* }{ */
+
+typedef struct Ring {
+  int fd;
+  unsigned int inflight;
+  AsyncOp *done, *lastdone;
+} Ring;
+
+#define ring_open(R)	((R)->fd = -1, (R)->inflight = 0, \
+			 (R)->done = (R)->lastdone = NULL)
+#define ring_submit(R,k,fd,op,o)	0
+#define ring_reap(R)	((void)(R))
+#define ring_poll(R,op)	((void)(R), (op)->done)
+#define ring_wait(R,op)	((void)(R), (void)(op))
+#define ring_close(R)	((void)(R))
+
+#endif				/* } */
+
+
+typedef struct AsyncFile {
+  Ring *ring;
+  AsyncOp *op;  /* operation in progress (or NULL) */
+  char *buff;  /* read-ahead buffer */
+  size_t size;  /* size of 'buff' */
+  size_t first, last;  /* unread data is in 'buff[first..last)' */
+  l_seeknum offset;  /* file offset of 'buff[last]' (-1 for streams) */
+  int fd;
+  int append;  /* true if writes go to the end of the file */
+  int eof;  /* true if a read found the end of the file */
+  int err;  /* error code of the last read (or 0) */
+} AsyncFile;
+
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* direct reads and writes; offset -1 uses the position of 'fd' */
+static long a_read (int fd, char *b, size_t n, l_seeknum off) {
+  long r;
+  do {
+    r = (off < 0) ? (long)read(fd, b, n) : (long)pread(fd, b, n, off);
+  } while (r < 0 && errno == EINTR);
+  return r;
+}
+
+static long a_write (int fd, const char *b, size_t n, l_seeknum off) {
+  long r;
+  do {
+    r = (off < 0) ? (long)write(fd, b, n) : (long)pwrite(fd, b, n, off);
+  } while (r < 0 && errno == EINTR);
+  return r;
+}
+
+#define a_seek(fd,o,w)		lseek(fd,o,w)
+
+
+/* start accessing directly the descriptor of 'f' */
+static int a_open (lua_State *L, FILE *f, AsyncFile *af) {
+  int flags;
+  (void)L;
+  if (fflush(f) != 0)
+    return 0;
+  af->fd = fileno(f);
+  af->offset = l_ftell(f);
+  if (af->offset < 0) af->offset = -1;  /* a stream */
+  flags = fcntl(af->fd, F_GETFL);
+  af->append = (flags != -1 && (flags & O_APPEND));
+  return 1;
+}
+
+#else				/* }{ */
+
+/* ISO C: there is no asynchronous mode */
+#define a_read(fd,b,n,o)	(-1L)
+#define a_write(fd,b,n,o)	(-1L)
+#define a_seek(fd,o,w)		((l_seeknum)-1)
+#define a_open(L,f,af)  \
+	  ((void)((void)f, af), \
+	  luaL_error(L, "asynchronous mode not supported"))
+
+#endif				/* } */
+
+
+/* get the state of the file at 'idx', if it is in asynchronous mode */
+static AsyncFile *toasync (lua_State *L, int idx) {
+  AsyncFile *af = NULL;
+  if (lua_getuservalue(L, idx) == LUA_TUSERDATA)
+    af = (AsyncFile *)luaL_testudata(L, -1, ASYNCFILE);
+  lua_pop(L, 1);
+  return af;
+}
+
+
+/*
+** Get the ring of the state, creating it if needed. The registry is
+** checked again after the new ring is created, as another thread may
+** have created one meanwhile; the ring left out is collected.
+*/
+static Ring *getring (lua_State *L) {
+  Ring *R;
+  if (lua_getfield(L, LUA_REGISTRYINDEX, IO_RING) == LUA_TNIL) {
+    lua_pop(L, 1);
+    R = (Ring *)lua_newuserdata(L, sizeof(Ring));
+    ring_open(R);
+    luaL_setmetatable(L, ASYNCRING);
+    lockrings();
+    if (lua_getfield(L, LUA_REGISTRYINDEX, IO_RING) == LUA_TNIL) {
+      lua_pop(L, 1);
+      lua_setfield(L, LUA_REGISTRYINDEX, IO_RING);
+      unlockrings();
+      return R;
+    }
+    unlockrings();
+    lua_remove(L, -2);  /* drop the new ring */
+  }
+  R = (Ring *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return R;
+}
+
+
+static AsyncOp *newop (lua_State *L, size_t len) {
+  AsyncOp *op = (AsyncOp *)malloc(sizeof(AsyncOp) + len);
+  if (op == NULL)
+    luaL_error(L, "not enough memory");
+  memset(op, 0, sizeof(AsyncOp));
+  op->buf = (char *)(op + 1);
+  op->len = len;
+  return op;
+}
+
+
+/* the file does not need 'op' anymore */
+static void releaseop (Ring *R, AsyncOp *op) {
+  int inring;
+  lockring(R);
+  inring = !(op->done && (op->waiter == NULL || op->notified));
+  if (inring)  /* ring still refers to it? */
+    op->orphan = 1;
+  unlockring(R);
+  if (!inring)
+    free(op);
+}
+
+
+static void checkidle (lua_State *L, AsyncFile *af) {
+  if (af->op != NULL)
+    luaL_error(L, "file is busy with another operation");
+}
+
+
+/*
+** Check whether the operation in progress on 'af' is complete. While
+** it is not, the caller should yield; but if it cannot yield, or if it
+** was resumed with the operation still in progress and no event loop
+** waiting for it, it waits here for the operation.
+*/
+static int opready (lua_State *L, AsyncFile *af, int resumed) {
+  AsyncOp *op = af->op;
+  if (ring_poll(af->ring, op))
+    return 1;
+  if (!lua_isyieldable(L) || (resumed && op->waiter == NULL)) {
+    ring_wait(af->ring, op);
+    return 1;
+  }
+  return 0;
+}
+
+
+/* yield to wait for the operation in progress on the file at index 1 */
+static int waitop (lua_State *L, lua_KContext ctx, lua_KFunction k) {
+  lua_pushvalue(L, 1);
+  lua_pushliteral(L, "io");
+  return lua_yieldk(L, 2, ctx, k);
+}
+
+
+/* make room for 'n' more bytes after the unread data */
+static char *prepbuff (lua_State *L, AsyncFile *af, size_t n) {
+  if (af->first > 0) {  /* move unread data to the beginning */
+    memmove(af->buff, af->buff + af->first, af->last - af->first);
+    af->last -= af->first;
+    af->first = 0;
+  }
+  if (af->size - af->last < n) {
+    size_t newsize = (af->size * 2 > af->last + n) ? af->size * 2
+                                                   : af->last + n;
+    char *newbuff = (char *)realloc(af->buff, newsize);
+    if (newbuff == NULL)
+      luaL_error(L, "not enough memory");
+    af->buff = newbuff;
+    af->size = newsize;
+  }
+  return af->buff + af->last;
+}
+
+
+/* account for the result of a read of 'n' bytes into the buffer */
+static void endread (AsyncFile *af, long n, int err) {
+  if (n > 0) {
+    af->last += (size_t)n;
+    if (af->offset >= 0) af->offset += n;
+  }
+  else if (n == 0)
+    af->eof = 1;
+  else
+    af->err = err;
+}
+
+
+/* read more data: start an asynchronous read if possible */
+static void startread (lua_State *L, AsyncFile *af) {
+  long n;
+  if (lua_isyieldable(L)) {
+    AsyncOp *op = newop(L, L_ASYNCREAD);
+    if (ring_submit(af->ring, AREAD, af->fd, op, af->offset)) {
+      af->op = op;
+      return;
+    }
+    free(op);
+  }
+  n = a_read(af->fd, prepbuff(L, af, L_ASYNCREAD), L_ASYNCREAD, af->offset);
+  endread(af, n, errno);
+}
+
+
+/* move the data of a complete read into the buffer */
+static void finishread (lua_State *L, AsyncFile *af) {
+  AsyncOp *op = af->op;
+  int res = op->res;
+  if (res > 0)
+    memcpy(prepbuff(L, af, (size_t)res), op->buf, (size_t)res);
+  af->op = NULL;
+  releaseop(af->ring, op);
+  endread(af, res, -res);
+}
+
+
+/*
+** Read the formats from index 2 on, without consuming the buffer until
+** all of them are available. Return the number of results, or -1 if
+** the buffer needs more data.
+*/
+static int aread (lua_State *L, AsyncFile *af) {
+  int top = lua_gettop(L);
+  int nargs = (top > 1) ? top - 1 : 1;  /* no format means "l" */
+  size_t pos = af->first;  /* position of unread data */
+  int success = 1;
+  int n;
+  luaL_checkstack(L, nargs + LUA_MINSTACK, "too many arguments");
+  for (n = 2; nargs-- && success; n++) {
+    const char *data = af->buff + pos;
+    size_t avail = af->last - pos;
+    size_t l = 0;
+    int fmt;
+    if (lua_type(L, n) == LUA_TNUMBER) {
+      l = (size_t)luaL_checkinteger(L, n);
+      fmt = (l == 0) ? '0' : 'c';
+    }
+    else {
+      const char *p = (n > top) ? "l" : luaL_checkstring(L, n);
+      if (*p == '*') p++;  /* skip optional '*' (for compatibility) */
+      fmt = *p;
+    }
+    switch (fmt) {
+      case '0':  /* test end of file */
+        if (avail == 0 && !af->eof) goto needmore;
+        lua_pushliteral(L, "");
+        success = (avail > 0);
+        break;
+      case 'c':  /* characters */
+        if (avail < l && !af->eof) goto needmore;
+        if (l > avail) l = avail;
+        lua_pushlstring(L, data, l);
+        pos += l;
+        success = (l > 0);
+        break;
+      case 'l': case 'L': {  /* line */
+        const char *nl = (avail == 0) ? NULL
+                       : (const char *)memchr(data, '\n', avail);
+        if (nl != NULL) {
+          l = (size_t)(nl - data);
+          lua_pushlstring(L, data, (fmt == 'L') ? l + 1 : l);
+          pos += l + 1;
+        }
+        else if (!af->eof) goto needmore;
+        else {  /* last line, without a newline */
+          lua_pushlstring(L, data, avail);
+          pos += avail;
+          success = (avail > 0);
+        }
+        break;
+      }
+      case 'b': {  /* block of lines */
+        size_t last = avail;
+        while (last > 0 && data[last - 1] != '\n') last--;
+        if (last == 0 && !af->eof) goto needmore;
+        l = (last > 0) ? last : avail;  /* complete lines or last line */
+        lua_pushlstring(L, data, l);
+        pos += l;
+        success = (l > 0);
+        break;
+      }
+      case 'a':  /* file */
+        if (!af->eof) goto needmore;
+        lua_pushlstring(L, data, avail);
+        pos += avail;
+        break;
+      case 'n':
+        return luaL_argerror(L, n, "format not supported in asynchronous mode");
+      default:
+        return luaL_argerror(L, n, "invalid format");
+    }
+  }
+  af->first = pos;  /* consume data */
+  if (!success) {
+    lua_pop(L, 1);  /* remove last result */
+    lua_pushnil(L);  /* push nil instead */
+  }
+  return n - 2;
+ needmore:
+  lua_settop(L, top);  /* remove partial results */
+  if (af->err != 0) {  /* previous read failed? */
+    errno = af->err;
+    af->err = 0;
+    return luaL_fileresult(L, 0, NULL);
+  }
+  return -1;
+}
+
+
+static int aux_readline (lua_State *L, int n);
+
+/*
+** Continuation for reads from an asynchronous file at index 1. 'ctx'
+** has the size of the stack (without results) and, in its lowest bit,
+** whether the read is from 'io_readline'.
+*/
+static int areadk (lua_State *L, int status, lua_KContext ctx) {
+  AsyncFile *af;
+  lua_settop(L, (int)(ctx >> 1));  /* remove values given to 'resume' */
+  tofile(L);  /* file may have been closed while waiting */
+  af = toasync(L, 1);
+  for (;;) {
+    int n;
+    if (af->op != NULL) {  /* waiting for a read? */
+      if (!opready(L, af, status == LUA_YIELD))
+        return waitop(L, ctx, areadk);
+      finishread(L, af);
+      status = LUA_OK;
+    }
+    n = aread(L, af);
+    if (n >= 0)  /* got all results? */
+      return (ctx & 1) ? aux_readline(L, n) : n;
+    startread(L, af);
+  }
+}
+
+
+/* read formats from index 2 on from the asynchronous file at index 1 */
+static int astartread (lua_State *L, AsyncFile *af, int lines) {
+  checkidle(L, af);
+  af->eof = 0;  /* try again to read past the end of the file */
+  return areadk(L, LUA_OK, ((lua_KContext)lua_gettop(L) << 1) | lines);
+}
+
+
+/* write synchronously what is left in 'op'; return an error code */
+static int syncwrite (AsyncFile *af, AsyncOp *op) {
+  op->done = 1;  /* not in the ring */
+  while (op->len > 0) {
+    long n = a_write(af->fd, op->buf, op->len, af->offset);
+    if (n <= 0)
+      return (n < 0) ? errno : EIO;
+    op->buf += n; op->len -= (size_t)n;
+    if (af->offset >= 0) af->offset += n;
+  }
+  return 0;
+}
+
+
+/* finish a write to the asynchronous file at index 1 */
+static int endwrite (lua_State *L, AsyncFile *af, AsyncOp *op, int err) {
+  af->op = NULL;
+  releaseop(af->ring, op);
+  if (af->append && err == 0)  /* data went to the end of the file */
+    af->offset = a_seek(af->fd, 0, SEEK_END);
+  if (err != 0) {
+    errno = err;
+    return luaL_fileresult(L, 0, NULL);
+  }
+  lua_settop(L, 1);
+  return 1;  /* return file */
+}
+
+
+/* continuation for writes to an asynchronous file at index 1 */
+static int awritek (lua_State *L, int status, lua_KContext ctx) {
+  AsyncFile *af;
+  lua_settop(L, (int)ctx);  /* remove values given to 'resume' */
+  tofile(L);  /* file may have been closed while waiting */
+  af = toasync(L, 1);
+  for (;;) {
+    AsyncOp *op = af->op;
+    if (!opready(L, af, status == LUA_YIELD))
+      return waitop(L, ctx, awritek);
+    status = LUA_OK;
+    if (op->res <= 0)  /* error? */
+      return endwrite(L, af, op, (op->res < 0) ? -op->res : EIO);
+    op->buf += op->res; op->len -= (size_t)op->res;
+    if (af->offset >= 0) af->offset += op->res;
+    if (op->len == 0)  /* wrote everything? */
+      return endwrite(L, af, op, 0);
+    /* write the rest */
+    op->done = op->notified = 0;
+    op->waiter = NULL;
+    if (!ring_submit(af->ring, AWRITE, af->fd, op, af->offset))
+      return endwrite(L, af, op, syncwrite(af, op));
+  }
+}
+
+
+/* write the values from index 2 on to the asynchronous file at index 1 */
+static int astartwrite (lua_State *L, AsyncFile *af) {
+  int top = lua_gettop(L);
+  size_t total = 0;
+  AsyncOp *op;
+  char *b;
+  int arg;
+  checkidle(L, af);
+  for (arg = 2; arg <= top; arg++) {
+    size_t l;
+    if (lua_type(L, arg) == LUA_TNUMBER) {  /* convert it as 'g_write' */
+      char nb[64];
+      int len = lua_isinteger(L, arg)
+                ? l_sprintf(nb, sizeof(nb), LUA_INTEGER_FMT,
+                            (LUAI_UACINT)lua_tointeger(L, arg))
+                : l_sprintf(nb, sizeof(nb), LUA_NUMBER_FMT,
+                            (LUAI_UACNUMBER)lua_tonumber(L, arg));
+      lua_pushlstring(L, nb, (size_t)len);
+      lua_replace(L, arg);
+    }
+    luaL_checklstring(L, arg, &l);
+    total += l;
+  }
+  op = newop(L, total);
+  for (b = op->buf, arg = 2; arg <= top; arg++) {
+    size_t l;
+    const char *s = lua_tolstring(L, arg, &l);
+    memcpy(b, s, l);
+    b += l;
+  }
+  lua_settop(L, 1);
+  if (af->offset >= 0) {  /* discard read-ahead data, going back to it */
+    af->offset -= (l_seeknum)(af->last - af->first);
+    af->first = af->last = 0;
+  }
+  af->op = op;
+  if (total > 0 && lua_isyieldable(L) &&
+      ring_submit(af->ring, AWRITE, af->fd, op, af->offset))
+    return awritek(L, LUA_OK, 1);
+  return endwrite(L, af, op, syncwrite(af, op));
+}
+
+
+static int aseek (lua_State *L, AsyncFile *af, int whence,
+                  l_seeknum offset) {
+  l_seeknum pos;
+  checkidle(L, af);
+  if (whence == SEEK_CUR && af->offset >= 0) {  /* relative to buffer */
+    offset += af->offset - (l_seeknum)(af->last - af->first);
+    whence = SEEK_SET;
+  }
+  pos = a_seek(af->fd, offset, whence);
+  if (pos < 0)
+    return luaL_fileresult(L, 0, NULL);
+  af->offset = pos;
+  af->first = af->last = 0;
+  af->eof = 0;
+  lua_pushinteger(L, (lua_Integer)pos);
+  return 1;
+}
+
+
+static int async_gc (lua_State *L) {
+  AsyncFile *af = (AsyncFile *)luaL_checkudata(L, 1, ASYNCFILE);
+  if (af->op != NULL) {
+    releaseop(af->ring, af->op);
+    af->op = NULL;
+  }
+  free(af->buff);
+  af->buff = NULL;
+  af->size = af->first = af->last = 0;
+  return 0;
+}
+
+
+static int ring_gc (lua_State *L) {
+  ring_close((Ring *)luaL_checkudata(L, 1, ASYNCRING));
+  return 0;
+}
+
+
+static int f_setasync (lua_State *L) {
+  FILE *f = tofile(L);
+  int on = lua_isnone(L, 2) || lua_toboolean(L, 2);
+  AsyncFile *af = toasync(L, 1);
+  if (on && af == NULL) {
+    Ring *R = getring(L);
+    af = (AsyncFile *)lua_newuserdata(L, sizeof(AsyncFile));
+    memset(af, 0, sizeof(AsyncFile));
+    luaL_setmetatable(L, ASYNCFILE);
+    af->ring = R;
+    if (!a_open(L, f, af))
+      return luaL_fileresult(L, 0, NULL);
+    lua_setuservalue(L, 1);
+  }
+  else if (!on && af != NULL) {
+    checkidle(L, af);
+    if (af->offset >= 0) {  /* move stream to the current position */
+      l_seeknum pos = af->offset - (l_seeknum)(af->last - af->first);
+      if (l_fseek(f, pos, SEEK_SET) != 0)
+        return luaL_fileresult(L, 0, NULL);
+    }
+    else if (af->last > af->first)
+      return luaL_error(L, "cannot leave asynchronous mode with unread data");
+    lua_pushnil(L);
+    lua_setuservalue(L, 1);
+  }
+  lua_settop(L, 1);
+  return 1;  /* return file */
+}
+
+
+int luaIO_asyncfd (lua_State *L) {
+  int fd = -1;
+  if (lua_getfield(L, LUA_REGISTRYINDEX, IO_RING) == LUA_TUSERDATA)
+    fd = ((Ring *)lua_touserdata(L, -1))->fd;
+  lua_pop(L, 1);
+  return fd;
+}
+
+
+int luaIO_setwaiter (lua_State *co, void (*wake) (void *waiter),
+                     void *waiter) {
+  AsyncFile *af;
+  int set = 0;
+  if (lua_gettop(co) != 2 || lua_type(co, 2) != LUA_TSTRING ||
+      strcmp(lua_tostring(co, 2), "io") != 0 ||
+      luaL_testudata(co, 1, LUA_FILEHANDLE) == NULL)
+    return 0;  /* not waiting for an operation */
+  af = toasync(co, 1);
+  if (af == NULL || af->op == NULL)
+    return 0;
+  lockring(af->ring);
+  if (!af->op->done) {
+    af->op->wake = wake;
+    af->op->waiter = waiter;
+    set = 1;
+  }
+  unlockring(af->ring);
+  return set;
+}
+
+
+int luaIO_complete (lua_State *L) {
+  Ring *R;
+  AsyncOp *op;
+  int inflight;
+  if (lua_getfield(L, LUA_REGISTRYINDEX, IO_RING) != LUA_TUSERDATA) {
+    lua_pop(L, 1);
+    return 0;  /* no ring */
+  }
+  R = (Ring *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  lockring(R);
+  ring_reap(R);
+  op = R->done;
+  R->done = R->lastdone = NULL;
+  while (op != NULL) {
+    AsyncOp *next = op->nextdone;
+    op->notified = 1;
+    (*op->wake)(op->waiter);
+    if (op->orphan) free(op);
+    op = next;
+  }
+  inflight = (int)R->inflight;
+  unlockring(R);
+  return inflight;
+}
+
+/* }====================================================== */
+
+
 /*
 ** {======================================================
 ** READ
@@ -479,19 +1391,51 @@ static int test_eof (lua_State *L, FILE *f) {
 }
 
 
-static int read_line (lua_State *L, FILE *f, int chop) {
-  luaL_Buffer b;
+/*
+** Add to buffer 'b' the rest of the current line of stream 'f', without
+** its newline; return the character that ended the line ('\n' or EOF).
+*/
+static int addline (luaL_Buffer *b, FILE *f) {
   int c = '\0';
-  luaL_buffinit(L, &b);
   while (c != EOF && c != '\n') {  /* repeat until end of line */
-    char *buff = luaL_prepbuffer(&b);  /* preallocate buffer */
-    int i = 0;
+    char *buff = luaL_prepbuffer(b);  /* preallocate buffer */
+    size_t i = 0;
     l_lockfile(f);  /* no memory errors can happen inside the lock */
-    while (i < LUAL_BUFFERSIZE && (c = l_getc(f)) != EOF && c != '\n')
-      buff[i++] = c;
+    while (i < LUAL_BUFFERSIZE) {
+      size_t n;
+      const char *p = l_inbuffer(f, n);
+      if (n == 0) {  /* nothing buffered? */
+        if ((c = l_getc(f)) == EOF || c == '\n')  /* (refills buffer) */
+          break;
+        buff[i++] = c;
+      }
+      else {  /* copy buffered data up to a newline */
+        const char *nl;
+        if (n > LUAL_BUFFERSIZE - i) n = LUAL_BUFFERSIZE - i;
+        nl = (const char *)memchr(p, '\n', n);
+        if (nl != NULL) n = (size_t)(nl - p);
+        memcpy(buff + i, p, n);
+        i += n;
+        if (nl != NULL) {
+          l_consume(f, n + 1);  /* skip the newline, too */
+          c = '\n';
+          break;
+        }
+        l_consume(f, n);
+      }
+    }
     l_unlockfile(f);
-    luaL_addsize(&b, i);
+    luaL_addsize(b, i);
   }
+  return c;
+}
+
+
+static int read_line (lua_State *L, FILE *f, int chop) {
+  luaL_Buffer b;
+  int c;
+  luaL_buffinit(L, &b);
+  c = addline(&b, f);
   if (!chop && c == '\n')  /* want a newline and have one? */
     luaL_addchar(&b, c);  /* add ending newline to result */
   luaL_pushresult(&b);  /* close buffer */
@@ -500,6 +1444,51 @@ static int read_line (lua_State *L, FILE *f, int chop) {
 }
 
 
+/*
+** Size of the complete lines among the first 'max' bytes buffered in
+** stream 'f' (which must be locked), or 0 if there are none.
+*/
+static size_t bufflines (FILE *f, size_t max, const char **p) {
+  size_t n;
+  *p = l_inbuffer(f, n);
+  if (n > max) n = max;
+  while (n > 0 && (*p)[n - 1] != '\n')  /* remove incomplete line */
+    n--;
+  return n;
+}
+
+
+/*
+** Read a block of lines: the current line plus all complete lines
+** already buffered in the stream, with their newlines.
+*/
+static int read_lines (lua_State *L, FILE *f) {
+  luaL_Buffer b;
+  int c;
+  luaL_buffinit(L, &b);
+  c = addline(&b, f);
+  if (c == '\n') {
+    const char *p;
+    size_t n;
+    luaL_addchar(&b, c);
+    l_lockfile(f);
+    n = bufflines(f, ~(size_t)0, &p);
+    l_unlockfile(f);
+    if (n > 0) {
+      char *buff = luaL_prepbuffsize(&b, n);
+      l_lockfile(f);
+      n = bufflines(f, n, &p);  /* another thread may have read it */
+      memcpy(buff, p, n);
+      l_consume(f, n);
+      l_unlockfile(f);
+      luaL_addsize(&b, n);
+    }
+  }
+  luaL_pushresult(&b);
+  return (c == '\n' || lua_rawlen(L, -1) > 0);
+}
+
+
 static void read_all (lua_State *L, FILE *f) {
   size_t nr;
   luaL_Buffer b;
@@ -556,6 +1545,9 @@ static int g_read (lua_State *L, FILE *f, int first) {
           case 'L':  /* line with end-of-line */
             success = read_line(L, f, 0);
             break;
+          case 'b':  /* block of lines */
+            success = read_lines(L, f);
+            break;
           case 'a':  /* file */
             read_all(L, f);  /* read entire file */
             success = 1; /* always success */
@@ -577,17 +1569,28 @@ static int g_read (lua_State *L, FILE *f, int first) {
 
 
 static int io_read (lua_State *L) {
-  return g_read(L, getiofile(L, IO_INPUT), 1);
+  FILE *f = getiofile(L, IO_INPUT);
+  AsyncFile *af = toasync(L, -1);
+  if (af != NULL) {
+    lua_rotate(L, 1, 1);  /* put file at index 1 */
+    return astartread(L, af, 0);
+  }
+  return g_read(L, f, 1);
 }
 
 
 static int f_read (lua_State *L) {
-  return g_read(L, tofile(L), 2);
+  FILE *f = tofile(L);
+  AsyncFile *af = toasync(L, 1);
+  if (af != NULL)
+    return astartread(L, af, 0);
+  return g_read(L, f, 2);
 }
 
 
 static int io_readline (lua_State *L) {
   LStream *p = (LStream *)lua_touserdata(L, lua_upvalueindex(1));
+  AsyncFile *af;
   int i;
   int n = (int)lua_tointeger(L, lua_upvalueindex(2));
   if (isclosed(p))  /* file is already closed? */
@@ -596,7 +1599,17 @@ static int io_readline (lua_State *L) {
   luaL_checkstack(L, n, "too many arguments");
   for (i = 1; i <= n; i++)  /* push arguments to 'g_read' */
     lua_pushvalue(L, lua_upvalueindex(3 + i));
+  if ((af = toasync(L, lua_upvalueindex(1))) != NULL) {
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_replace(L, 1);  /* put file at index 1 */
+    return astartread(L, af, 1);
+  }
   n = g_read(L, p->f, 2);  /* 'n' is number of results */
+  return aux_readline(L, n);
+}
+
+
+static int aux_readline (lua_State *L, int n) {
   lua_assert(n > 0);  /* should return at least a nil */
   if (lua_toboolean(L, -n))  /* read at least one value? */
     return n;  /* return them */
@@ -642,12 +1655,21 @@ static int g_write (lua_State *L, FILE *f, int arg) {
 
 
 static int io_write (lua_State *L) {
-  return g_write(L, getiofile(L, IO_OUTPUT), 1);
+  FILE *f = getiofile(L, IO_OUTPUT);
+  AsyncFile *af = toasync(L, -1);
+  if (af != NULL) {
+    lua_rotate(L, 1, 1);  /* put file at index 1 */
+    return astartwrite(L, af);
+  }
+  return g_write(L, f, 1);
 }
 
 
 static int f_write (lua_State *L) {
   FILE *f = tofile(L);
+  AsyncFile *af = toasync(L, 1);
+  if (af != NULL)
+    return astartwrite(L, af);
   lua_pushvalue(L, 1);  /* push file at the stack top (to be returned) */
   return g_write(L, f, 2);
 }
@@ -657,11 +1679,14 @@ static int f_seek (lua_State *L) {
   static const int mode[] = {SEEK_SET, SEEK_CUR, SEEK_END};
   static const char *const modenames[] = {"set", "cur", "end", NULL};
   FILE *f = tofile(L);
+  AsyncFile *af = toasync(L, 1);
   int op = luaL_checkoption(L, 2, "cur", modenames);
   lua_Integer p3 = luaL_optinteger(L, 3, 0);
   l_seeknum offset = (l_seeknum)p3;
   luaL_argcheck(L, (lua_Integer)offset == p3, 3,
                   "not an integer in proper range");
+  if (af != NULL)
+    return aseek(L, af, mode[op], offset);
   op = l_fseek(f, offset, mode[op]);
   if (op)
     return luaL_fileresult(L, 0, NULL);  /* error */
@@ -694,6 +1719,161 @@ static int f_flush (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Memory maps
+** =======================================================
+*/
+
+/*
+** A mapping is a view (see 'luaL_View') over the contents of a file,
+** which string functions can use without copying them.
+*/
+
+#define MAPPING		"io.mapping"
+
+
+/*
+** l_mapfile(fname,v) maps a file into view 'v' and l_unmapfile(v)
+** releases it. (Loading chunks uses 'l_mapchunk', in 'lauxlib.c'.)
+*/
+
+#if !defined(l_mapfile)		/* { */
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* map the regular file 'fname' into 'v'; return 0 (and errno) on errors */
+static int l_mapfile (const char *fname, luaL_View *v) {
+  struct stat st;
+  int err;
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &st) != 0)
+    err = errno;
+  else if (!S_ISREG(st.st_mode))
+    err = ENODEV;  /* same error of 'mmap' */
+  else if ((off_t)(size_t)st.st_size != st.st_size)
+    err = ENOMEM;  /* file too large */
+  else if (st.st_size == 0) {  /* empty file? (cannot be mapped) */
+    v->p = "";
+    err = 0;
+  }
+  else {
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = (p == MAP_FAILED) ? errno : 0;
+    if (err == 0) {
+      v->p = (const char *)p;
+      v->len = (size_t)st.st_size;
+    }
+  }
+  close(fd);
+  errno = err;
+  return (err == 0);
+}
+
+#define l_unmapfile(v)	munmap((void *)(v)->p, (v)->len)
+
+#else				/* }{ */
+
+/* ISO C: read the whole file into memory */
+static int l_mapfile (const char *fname, luaL_View *v) {
+  FILE *f = fopen(fname, "rb");
+  long size;
+  char *b = NULL;
+  if (f == NULL)
+    return 0;
+  if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 &&
+      fseek(f, 0, SEEK_SET) == 0) {
+    if (size == 0)
+      v->p = "";
+    else if ((b = (char *)malloc((size_t)size)) != NULL &&
+             fread(b, 1, (size_t)size, f) == (size_t)size) {
+      v->p = b;
+      v->len = (size_t)size;
+    }
+    else {
+      free(b);
+      if (errno == 0) errno = EIO;
+    }
+  }
+  fclose(f);
+  return (v->p != NULL);
+}
+
+#define l_unmapfile(v)	free((void *)(v)->p)
+
+#endif				/* } */
+
+#endif				/* } */
+
+
+#define tomapping(L)	((luaL_View *)luaL_checkudata(L, 1, MAPPING))
+
+
+static int io_mmap (lua_State *L) {
+  const char *fname = luaL_checkstring(L, 1);
+  luaL_View *v = (luaL_View *)lua_newuserdata(L, sizeof(luaL_View));
+  v->p = NULL;  /* mark mapping as closed until it is complete */
+  v->len = 0;
+  luaL_setmetatable(L, MAPPING);
+  errno = 0;
+  if (!l_mapfile(fname, v))
+    return luaL_fileresult(L, 0, fname);
+  return 1;
+}
+
+
+static void unmap (luaL_View *v) {
+  if (v->len > 0)  /* not empty? (empty files are not mapped) */
+    l_unmapfile(v);
+  v->p = NULL;
+  v->len = 0;
+}
+
+
+static int m_close (lua_State *L) {
+  luaL_View *v = tomapping(L);
+  luaL_argcheck(L, v->p != NULL, 1, "attempt to use a closed mapping");
+  unmap(v);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int m_gc (lua_State *L) {
+  luaL_View *v = tomapping(L);
+  if (v->p != NULL)
+    unmap(v);
+  return 0;
+}
+
+
+static int m_len (lua_State *L) {
+  luaL_View *v = tomapping(L);
+  luaL_argcheck(L, v->p != NULL, 1, "attempt to use a closed mapping");
+  lua_pushinteger(L, (lua_Integer)v->len);
+  return 1;
+}
+
+
+static int m_tostring (lua_State *L) {
+  luaL_View *v = tomapping(L);
+  if (v->p == NULL)
+    lua_pushliteral(L, "mapping (closed)");
+  else
+    lua_pushfstring(L, "mapping (%p)", v->p);
+  return 1;
+}
+
+/* }====================================================== */
+
+
 /*
 ** functions for 'io' library
 */
@@ -702,6 +1882,7 @@ static const luaL_Reg iolib[] = {
   {"flush", io_flush},
   {"input", io_input},
   {"lines", io_lines},
+  {"mmap", io_mmap},
   {"open", io_open},
   {"output", io_output},
   {"popen", io_popen},
@@ -722,6 +1903,7 @@ static const luaL_Reg flib[] = {
   {"lines", f_lines},
   {"read", f_read},
   {"seek", f_seek},
+  {"setasync", f_setasync},
   {"setvbuf", f_setvbuf},
   {"write", f_write},
   {"__gc", f_gc},
@@ -730,12 +1912,38 @@ static const luaL_Reg flib[] = {
 };
 
 
+/*
+** methods for mappings
+*/
+static const luaL_Reg mlib[] = {
+  {"close", m_close},
+  {"__gc", m_gc},
+  {"__len", m_len},
+  {"__tostring", m_tostring},
+  {NULL, NULL}
+};
+
+
 static void createmeta (lua_State *L) {
   luaL_newmetatable(L, LUA_FILEHANDLE);  /* create metatable for file handles */
   lua_pushvalue(L, -1);  /* push metatable */
   lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
   luaL_setfuncs(L, flib, 0);  /* add file methods to new metatable */
   lua_pop(L, 1);  /* pop new metatable */
+  luaL_newmetatable(L, MAPPING);  /* metatable for mappings */
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, mlib, 0);
+  lua_pushboolean(L, 1);
+  lua_setfield(L, -2, LUAL_VIEWFIELD);  /* mappings are views */
+  lua_pop(L, 1);
+  luaL_newmetatable(L, ASYNCFILE);  /* metatable for asynchronous files */
+  lua_pushcfunction(L, async_gc);
+  lua_setfield(L, -2, "__gc");
+  luaL_newmetatable(L, ASYNCRING);  /* metatable for the ring */
+  lua_pushcfunction(L, ring_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 2);  /* pop new metatables */
 }
 
 
@@ -0,0 +1,40 @@
+/*
+** $Id: liolib.h $
+** Asynchronous operations of the I/O library, for event loops
+** See Copyright Notice in lua.h
+*/
+
+#ifndef liolib_h
+#define liolib_h
+
+#include "lua.h"
+
+
+/*
+** A coroutine that starts an asynchronous operation on a file (see
+** 'file:setasync') yields the file and the string "io". An event loop
+** can then register a waiter for that operation, wait until the
+** descriptor given by 'luaIO_asyncfd' is readable, and call
+** 'luaIO_complete' to wake the waiters of completed operations. Each
+** waiter is woken exactly once, at the latest when the state closes.
+*/
+
+/* descriptor signaled by completed operations (or -1 if none) */
+LUAI_FUNC int luaIO_asyncfd (lua_State *L);
+
+/*
+** make the operation that suspended 'co' call 'wake(waiter)' when it
+** completes; return 0 if there is no such operation or if it is
+** already complete
+*/
+LUAI_FUNC int luaIO_setwaiter (lua_State *co, void (*wake) (void *waiter),
+                               void *waiter);
+
+/*
+** wake the waiters of completed operations; return the number of
+** operations still in progress
+*/
+LUAI_FUNC int luaIO_complete (lua_State *L);
+
+#endif
+
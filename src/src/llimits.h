@@ -211,8 +211,24 @@ typedef unsigned long Instruction;
 ** ('lua_lock') and leaves the core ('lua_unlock')
 */
 #if !defined(lua_lock)
+
+#if defined(LUA_USE_THREADS)	/* { */
+
+/* states shared by system threads use a global lock (see 'lstate.c') */
+#include <pthread.h>
+#define lua_lock(L)	luaE_lock(L)
+#define lua_unlock(L)	luaE_unlock(L)
+#define luai_threadyield(L)	luaE_threadyield(L)
+#define luai_userstateopen(L)	luaE_initlock(L)
+#define luai_userstateclose(L)	luaE_freelock(L)
+
+#else				/* }{ */
+
 #define lua_lock(L)	((void) 0)
 #define lua_unlock(L)	((void) 0)
+
+#endif				/* } */
+
 #endif
 
 /*
@@ -10,8 +10,12 @@
 #include "lprefix.h"
 
 
-#include <stdlib.h>
+#include <float.h>
+#include <limits.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "lua.h"
 
@@ -23,17 +27,6 @@
 #define PI	(l_mathop(3.141592653589793238462643383279502884))
 
 
-#if !defined(l_rand)		/* { */
-#if defined(LUA_USE_POSIX)
-#define l_rand()	random()
-#define l_srand(x)	srandom(x)
-#define L_RANDMAX	2147483647	/* (2^31 - 1), following POSIX */
-#else
-#define l_rand()	rand()
-#define l_srand(x)	srand(x)
-#define L_RANDMAX	RAND_MAX
-#endif
-#endif				/* } */
 
 
 static int math_abs (lua_State *L) {
@@ -239,63 +232,957 @@ static int math_max (lua_State *L) {
   return 1;
 }
 
+static int math_type (lua_State *L) {
+  if (lua_type(L, 1) == LUA_TNUMBER) {
+      if (lua_isinteger(L, 1))
+        lua_pushliteral(L, "integer");
+      else
+        lua_pushliteral(L, "float");
+  }
+  else {
+    luaL_checkany(L, 1);
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+
 /*
-** This function uses 'double' (instead of 'lua_Number') to ensure that
-** all bits from 'l_rand' can be represented, and that 'RANDMAX + 1.0'
-** will keep full precision (ensuring that 'r' is always less than 1.0.)
+** {==================================================================
+** Vector operations
+** ===================================================================
 */
-static int math_random (lua_State *L) {
-  lua_Integer low, up;
-  double r = (double)l_rand() * (1.0 / ((double)L_RANDMAX + 1.0));
-  switch (lua_gettop(L)) {  /* check number of arguments */
-    case 0: {  /* no arguments */
-      lua_pushnumber(L, (lua_Number)r);  /* Number between 0 and 1 */
-      return 1;
+
+/*
+** These functions work over whole arrays of numbers, tables (their
+** elements 1 to #t, read and written raw) or typed arrays, always in
+** floating-point arithmetic. The arrays are processed in blocks of
+** floats: the elements of float arrays are used in place, other arrays
+** are copied to a buffer.
+**
+** Each operation has kernels in plain C and, in x86-64 processors,
+** with SSE2 and AVX2 instructions, the latter chosen at run time if
+** the processor has them. Reductions keep VLANES partial results,
+** each one summing (or comparing) the elements at the same position
+** modulo VLANES, and combine them in a fixed order; so, all kernels
+** give exactly the same results. (Prefix sums have no vector kernels,
+** as a vector scan would round differently from a sequential sum.)
+*/
+
+/* number of partial results in reductions */
+#define VLANES		16
+
+/* size of blocks (must be a multiple of VLANES) */
+#define VBLOCK		(16 * VLANES)
+
+
+typedef struct VKernels {
+  void (*sum) (const lua_Number *x, size_t n, lua_Number *acc);
+  void (*dot) (const lua_Number *x, const lua_Number *y, size_t n,
+               lua_Number *acc);
+  void (*minmax) (const lua_Number *x, size_t n, lua_Number *mn,
+                  lua_Number *mx);
+  void (*scale) (lua_Number *y, const lua_Number *x, lua_Number s,
+                 size_t n);
+  void (*add) (lua_Number *z, const lua_Number *x, const lua_Number *y,
+               size_t n);
+  void (*clamp) (lua_Number *y, const lua_Number *x, lua_Number lo,
+                 lua_Number hi, size_t n);
+  void (*floor) (lua_Number *y, const lua_Number *x, size_t n);
+} VKernels;
+
+
+/*
+** Plain C kernels. They also finish the work of the vector kernels
+** over the last elements of a block.
+*/
+
+static void sum_c (const lua_Number *x, size_t n, lua_Number *acc) {
+  size_t j;
+  for (j = 0; j < n; j++)
+    acc[j % VLANES] += x[j];
+}
+
+
+static void dot_c (const lua_Number *x, const lua_Number *y, size_t n,
+                   lua_Number *acc) {
+  size_t j;
+  for (j = 0; j < n; j++)
+    acc[j % VLANES] += x[j] * y[j];
+}
+
+
+/* (same results as the 'min'/'max' instructions, which ignore NaNs) */
+static void minmax_c (const lua_Number *x, size_t n, lua_Number *mn,
+                      lua_Number *mx) {
+  size_t j;
+  for (j = 0; j < n; j++) {
+    lua_Number v = x[j];
+    size_t l = j % VLANES;
+    mn[l] = (v < mn[l]) ? v : mn[l];
+    mx[l] = (v > mx[l]) ? v : mx[l];
+  }
+}
+
+
+static void scale_c (lua_Number *y, const lua_Number *x, lua_Number s,
+                     size_t n) {
+  size_t j;
+  for (j = 0; j < n; j++)
+    y[j] = x[j] * s;
+}
+
+
+static void add_c (lua_Number *z, const lua_Number *x, const lua_Number *y,
+                   size_t n) {
+  size_t j;
+  for (j = 0; j < n; j++)
+    z[j] = x[j] + y[j];
+}
+
+
+static void clamp_c (lua_Number *y, const lua_Number *x, lua_Number lo,
+                     lua_Number hi, size_t n) {
+  size_t j;
+  for (j = 0; j < n; j++) {
+    lua_Number v = (x[j] > lo) ? x[j] : lo;
+    y[j] = (v < hi) ? v : hi;
+  }
+}
+
+
+static void floor_c (lua_Number *y, const lua_Number *x, size_t n) {
+  size_t j;
+  for (j = 0; j < n; j++)
+    y[j] = l_mathop(floor)(x[j]);
+}
+
+
+#if !defined(LUA_NOVECTOR) && defined(__GNUC__) && defined(__x86_64__) && \
+    LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE	/* { */
+
+#include <immintrin.h>
+
+/*
+** SSE2 kernels (SSE2 is part of x86-64); each vector holds 2 lanes.
+*/
+
+#define NV2	(VLANES / 2)
+
+static void sum_sse2 (const lua_Number *x, size_t n, lua_Number *acc) {
+  __m128d a[NV2];
+  size_t j, l;
+  for (l = 0; l < NV2; l++) a[l] = _mm_loadu_pd(acc + 2 * l);
+  for (j = 0; j + VLANES <= n; j += VLANES) {
+    for (l = 0; l < NV2; l++)
+      a[l] = _mm_add_pd(a[l], _mm_loadu_pd(x + j + 2 * l));
+  }
+  for (l = 0; l < NV2; l++) _mm_storeu_pd(acc + 2 * l, a[l]);
+  sum_c(x + j, n - j, acc);
+}
+
+
+static void dot_sse2 (const lua_Number *x, const lua_Number *y, size_t n,
+                      lua_Number *acc) {
+  __m128d a[NV2];
+  size_t j, l;
+  for (l = 0; l < NV2; l++) a[l] = _mm_loadu_pd(acc + 2 * l);
+  for (j = 0; j + VLANES <= n; j += VLANES) {
+    for (l = 0; l < NV2; l++) {
+      __m128d p = _mm_mul_pd(_mm_loadu_pd(x + j + 2 * l),
+                             _mm_loadu_pd(y + j + 2 * l));
+      a[l] = _mm_add_pd(a[l], p);
+    }
+  }
+  for (l = 0; l < NV2; l++) _mm_storeu_pd(acc + 2 * l, a[l]);
+  dot_c(x + j, y + j, n - j, acc);
+}
+
+
+static void minmax_sse2 (const lua_Number *x, size_t n, lua_Number *mn,
+                         lua_Number *mx) {
+  __m128d a[NV2], b[NV2];
+  size_t j, l;
+  for (l = 0; l < NV2; l++) {
+    a[l] = _mm_loadu_pd(mn + 2 * l);
+    b[l] = _mm_loadu_pd(mx + 2 * l);
+  }
+  for (j = 0; j + VLANES <= n; j += VLANES) {
+    for (l = 0; l < NV2; l++) {
+      __m128d v = _mm_loadu_pd(x + j + 2 * l);
+      a[l] = _mm_min_pd(v, a[l]);
+      b[l] = _mm_max_pd(v, b[l]);
     }
+  }
+  for (l = 0; l < NV2; l++) {
+    _mm_storeu_pd(mn + 2 * l, a[l]);
+    _mm_storeu_pd(mx + 2 * l, b[l]);
+  }
+  minmax_c(x + j, n - j, mn, mx);
+}
+
+
+static void scale_sse2 (lua_Number *y, const lua_Number *x, lua_Number s,
+                        size_t n) {
+  __m128d f = _mm_set1_pd(s);
+  size_t j;
+  for (j = 0; j + 2 <= n; j += 2)
+    _mm_storeu_pd(y + j, _mm_mul_pd(_mm_loadu_pd(x + j), f));
+  scale_c(y + j, x + j, s, n - j);
+}
+
+
+static void add_sse2 (lua_Number *z, const lua_Number *x,
+                      const lua_Number *y, size_t n) {
+  size_t j;
+  for (j = 0; j + 2 <= n; j += 2)
+    _mm_storeu_pd(z + j, _mm_add_pd(_mm_loadu_pd(x + j),
+                                    _mm_loadu_pd(y + j)));
+  add_c(z + j, x + j, y + j, n - j);
+}
+
+
+static void clamp_sse2 (lua_Number *y, const lua_Number *x, lua_Number lo,
+                        lua_Number hi, size_t n) {
+  __m128d l = _mm_set1_pd(lo);
+  __m128d h = _mm_set1_pd(hi);
+  size_t j;
+  for (j = 0; j + 2 <= n; j += 2)
+    _mm_storeu_pd(y + j, _mm_min_pd(_mm_max_pd(_mm_loadu_pd(x + j), l), h));
+  clamp_c(y + j, x + j, lo, hi, n - j);
+}
+
+
+static const VKernels kernels_sse2 = {
+  sum_sse2, dot_sse2, minmax_sse2, scale_sse2, add_sse2, clamp_sse2,
+  floor_c  /* rounding instructions came only with SSE4.1 */
+};
+
+
+/*
+** AVX2 kernels; each vector holds 4 lanes.
+*/
+
+#define l_avx2		__attribute__((target("avx2")))
+
+#define NV4	(VLANES / 4)
+
+l_avx2 static void sum_avx2 (const lua_Number *x, size_t n,
+                             lua_Number *acc) {
+  __m256d a[NV4];
+  size_t j, l;
+  for (l = 0; l < NV4; l++) a[l] = _mm256_loadu_pd(acc + 4 * l);
+  for (j = 0; j + VLANES <= n; j += VLANES) {
+    for (l = 0; l < NV4; l++)
+      a[l] = _mm256_add_pd(a[l], _mm256_loadu_pd(x + j + 4 * l));
+  }
+  for (l = 0; l < NV4; l++) _mm256_storeu_pd(acc + 4 * l, a[l]);
+  sum_c(x + j, n - j, acc);
+}
+
+
+l_avx2 static void dot_avx2 (const lua_Number *x, const lua_Number *y,
+                             size_t n, lua_Number *acc) {
+  __m256d a[NV4];
+  size_t j, l;
+  for (l = 0; l < NV4; l++) a[l] = _mm256_loadu_pd(acc + 4 * l);
+  for (j = 0; j + VLANES <= n; j += VLANES) {
+    for (l = 0; l < NV4; l++) {  /* (no FMA, which would round once) */
+      __m256d p = _mm256_mul_pd(_mm256_loadu_pd(x + j + 4 * l),
+                                _mm256_loadu_pd(y + j + 4 * l));
+      a[l] = _mm256_add_pd(a[l], p);
+    }
+  }
+  for (l = 0; l < NV4; l++) _mm256_storeu_pd(acc + 4 * l, a[l]);
+  dot_c(x + j, y + j, n - j, acc);
+}
+
+
+l_avx2 static void minmax_avx2 (const lua_Number *x, size_t n,
+                                lua_Number *mn, lua_Number *mx) {
+  __m256d a[NV4], b[NV4];
+  size_t j, l;
+  for (l = 0; l < NV4; l++) {
+    a[l] = _mm256_loadu_pd(mn + 4 * l);
+    b[l] = _mm256_loadu_pd(mx + 4 * l);
+  }
+  for (j = 0; j + VLANES <= n; j += VLANES) {
+    for (l = 0; l < NV4; l++) {
+      __m256d v = _mm256_loadu_pd(x + j + 4 * l);
+      a[l] = _mm256_min_pd(v, a[l]);
+      b[l] = _mm256_max_pd(v, b[l]);
+    }
+  }
+  for (l = 0; l < NV4; l++) {
+    _mm256_storeu_pd(mn + 4 * l, a[l]);
+    _mm256_storeu_pd(mx + 4 * l, b[l]);
+  }
+  minmax_c(x + j, n - j, mn, mx);
+}
+
+
+l_avx2 static void scale_avx2 (lua_Number *y, const lua_Number *x,
+                               lua_Number s, size_t n) {
+  __m256d f = _mm256_set1_pd(s);
+  size_t j;
+  for (j = 0; j + 4 <= n; j += 4)
+    _mm256_storeu_pd(y + j, _mm256_mul_pd(_mm256_loadu_pd(x + j), f));
+  scale_c(y + j, x + j, s, n - j);
+}
+
+
+l_avx2 static void add_avx2 (lua_Number *z, const lua_Number *x,
+                             const lua_Number *y, size_t n) {
+  size_t j;
+  for (j = 0; j + 4 <= n; j += 4)
+    _mm256_storeu_pd(z + j, _mm256_add_pd(_mm256_loadu_pd(x + j),
+                                          _mm256_loadu_pd(y + j)));
+  add_c(z + j, x + j, y + j, n - j);
+}
+
+
+l_avx2 static void clamp_avx2 (lua_Number *y, const lua_Number *x,
+                               lua_Number lo, lua_Number hi, size_t n) {
+  __m256d l = _mm256_set1_pd(lo);
+  __m256d h = _mm256_set1_pd(hi);
+  size_t j;
+  for (j = 0; j + 4 <= n; j += 4) {
+    __m256d v = _mm256_max_pd(_mm256_loadu_pd(x + j), l);
+    _mm256_storeu_pd(y + j, _mm256_min_pd(v, h));
+  }
+  clamp_c(y + j, x + j, lo, hi, n - j);
+}
+
+
+l_avx2 static void floor_avx2 (lua_Number *y, const lua_Number *x,
+                               size_t n) {
+  size_t j;
+  for (j = 0; j + 4 <= n; j += 4)
+    _mm256_storeu_pd(y + j, _mm256_floor_pd(_mm256_loadu_pd(x + j)));
+  floor_c(y + j, x + j, n - j);
+}
+
+
+static const VKernels kernels_avx2 = {
+  sum_avx2, dot_avx2, minmax_avx2, scale_avx2, add_avx2, clamp_avx2,
+  floor_avx2
+};
+
+
+static const VKernels *getkernels (void) {
+  if (__builtin_cpu_supports("avx2"))
+    return &kernels_avx2;
+  else
+    return &kernels_sse2;
+}
+
+#else				/* }{ */
+
+static const VKernels kernels_c = {
+  sum_c, dot_c, minmax_c, scale_c, add_c, clamp_c, floor_c
+};
+
+#define getkernels()	(&kernels_c)
+
+#endif				/* } */
+
+
+/*
+** An operand of a vector operation, which is a table or a typed array.
+*/
+typedef struct VArg {
+  int arg;  /* its stack index */
+  int kind;  /* kind of typed array, or 0 for a table */
+  size_t n;  /* number of elements */
+  void *mem;  /* elements of a typed array */
+  lua_Number buff[VBLOCK];  /* elements of a block (if not floats) */
+} VArg;
+
+
+static void checkvarg (lua_State *L, int arg, VArg *v) {
+  v->arg = arg;
+  v->mem = lua_toarray(L, arg, &v->kind, &v->n);
+  if (v->mem == NULL) {  /* not a typed array? */
+    luaL_checktype(L, arg, LUA_TTABLE);
+    v->kind = 0;
+    v->n = lua_rawlen(L, arg);
+  }
+}
+
+
+/*
+** Check the result operand, which must be a table or a float array
+** with at least 'n' elements; by default, it is operand 'v'.
+*/
+static void checkout (lua_State *L, int arg, VArg *out, const VArg *v) {
+  checkvarg(L, lua_isnoneornil(L, arg) ? v->arg : arg, out);
+  luaL_argcheck(L, out->kind == 0 || out->kind == LUA_ARRFLT, out->arg,
+                "table or float array expected");
+  luaL_argcheck(L, out->kind == 0 || out->n >= v->n, out->arg,
+                "array too short");
+}
+
+
+/* get elements 'i' up to 'i + m - 1' (0-based) of 'v' as floats */
+static const lua_Number *getblock (lua_State *L, VArg *v, size_t i,
+                                   size_t m) {
+  size_t k;
+  switch (v->kind) {
+    case LUA_ARRFLT:
+      return (const lua_Number *)v->mem + i;
+    case LUA_ARRINT: {
+      const lua_Integer *p = (const lua_Integer *)v->mem + i;
+      for (k = 0; k < m; k++) v->buff[k] = (lua_Number)p[k];
+      return v->buff;
+    }
+    case LUA_ARRBYTE: {
+      const unsigned char *p = (const unsigned char *)v->mem + i;
+      for (k = 0; k < m; k++) v->buff[k] = (lua_Number)p[k];
+      return v->buff;
+    }
+    default: {
+      k = (size_t)lua_rawgetnumbers(L, v->arg, (lua_Integer)i + 1,
+                                    (lua_Integer)m, v->buff);
+      if (k < m) {
+        const char *msg = lua_pushfstring(L, "number expected at index %I",
+                                          (lua_Integer)(i + k) + 1);
+        luaL_argerror(L, v->arg, msg);
+      }
+      return v->buff;
+    }
+  }
+}
+
+
+/* place for the results of a block starting at element 'i' */
+#define outblock(v,i)  \
+	((v)->kind == LUA_ARRFLT ? (lua_Number *)(v)->mem + (i) : (v)->buff)
+
+
+/* store the results of a block in a table */
+static void putblock (lua_State *L, VArg *v, size_t i, size_t m,
+                      int toint) {
+  if (v->kind == 0)
+    lua_rawsetnumbers(L, v->arg, (lua_Integer)i + 1, (lua_Integer)m,
+                      v->buff, toint);
+}
+
+
+/* combine partial results of a reduction */
+static lua_Number combine (lua_Number *acc) {
+  int w, l;
+  for (w = VLANES / 2; w > 0; w /= 2) {
+    for (l = 0; l < w; l++)
+      acc[l] += acc[l + w];
+  }
+  return acc[0];
+}
+
+
+#define blocksize(n,i)	(((n) - (i) < VBLOCK) ? (n) - (i) : VBLOCK)
+
+
+static int math_sum (lua_State *L) {
+  const VKernels *vk = getkernels();
+  lua_Number acc[VLANES] = {0};
+  VArg a;
+  size_t i, m;
+  checkvarg(L, 1, &a);
+  for (i = 0; i < a.n; i += m) {
+    m = blocksize(a.n, i);
+    vk->sum(getblock(L, &a, i, m), m, acc);
+  }
+  lua_pushnumber(L, combine(acc));
+  return 1;
+}
+
+
+static int math_dot (lua_State *L) {
+  const VKernels *vk = getkernels();
+  lua_Number acc[VLANES] = {0};
+  VArg a, b;
+  size_t i, m;
+  checkvarg(L, 1, &a);
+  checkvarg(L, 2, &b);
+  luaL_argcheck(L, a.n == b.n, 2, "arrays of different lengths");
+  for (i = 0; i < a.n; i += m) {
+    m = blocksize(a.n, i);
+    vk->dot(getblock(L, &a, i, m), getblock(L, &b, i, m), m, acc);
+  }
+  lua_pushnumber(L, combine(acc));
+  return 1;
+}
+
+
+static int math_minmax (lua_State *L) {
+  const VKernels *vk = getkernels();
+  lua_Number mn[VLANES], mx[VLANES];
+  lua_Number first = 0;
+  VArg a;
+  size_t i, m;
+  int l;
+  checkvarg(L, 1, &a);
+  luaL_argcheck(L, a.n > 0, 1, "empty array");
+  for (l = 0; l < VLANES; l++) {
+    mn[l] = (lua_Number)HUGE_VAL;
+    mx[l] = -(lua_Number)HUGE_VAL;
+  }
+  for (i = 0; i < a.n; i += m) {
+    const lua_Number *x;
+    m = blocksize(a.n, i);
+    x = getblock(L, &a, i, m);
+    if (i == 0) first = x[0];
+    vk->minmax(x, m, mn, mx);
+  }
+  for (l = 1; l < VLANES; l++) {  /* combine partial results */
+    mn[0] = (mn[l] < mn[0]) ? mn[l] : mn[0];
+    mx[0] = (mx[l] > mx[0]) ? mx[l] : mx[0];
+  }
+  if (mn[0] > mx[0])  /* all elements are NaN? */
+    mn[0] = mx[0] = first;
+  lua_pushnumber(L, mn[0]);
+  lua_pushnumber(L, mx[0]);
+  return 2;
+}
+
+
+static int math_scale (lua_State *L) {
+  const VKernels *vk = getkernels();
+  lua_Number s = luaL_checknumber(L, 2);
+  VArg a, out;
+  size_t i, m;
+  checkvarg(L, 1, &a);
+  checkout(L, 3, &out, &a);
+  for (i = 0; i < a.n; i += m) {
+    m = blocksize(a.n, i);
+    vk->scale(outblock(&out, i), getblock(L, &a, i, m), s, m);
+    putblock(L, &out, i, m, 0);
+  }
+  lua_pushvalue(L, out.arg);
+  return 1;
+}
+
+
+static int math_add (lua_State *L) {
+  const VKernels *vk = getkernels();
+  VArg a, b, out;
+  size_t i, m;
+  checkvarg(L, 1, &a);
+  checkvarg(L, 2, &b);
+  luaL_argcheck(L, a.n == b.n, 2, "arrays of different lengths");
+  checkout(L, 3, &out, &a);
+  for (i = 0; i < a.n; i += m) {
+    m = blocksize(a.n, i);
+    vk->add(outblock(&out, i), getblock(L, &a, i, m), getblock(L, &b, i, m),
+            m);
+    putblock(L, &out, i, m, 0);
+  }
+  lua_pushvalue(L, out.arg);
+  return 1;
+}
+
+
+static int math_clamp (lua_State *L) {
+  const VKernels *vk = getkernels();
+  lua_Number lo = luaL_checknumber(L, 2);
+  lua_Number hi = luaL_checknumber(L, 3);
+  VArg a, out;
+  size_t i, m;
+  checkvarg(L, 1, &a);
+  luaL_argcheck(L, lo <= hi, 3, "interval is empty");
+  checkout(L, 4, &out, &a);
+  for (i = 0; i < a.n; i += m) {
+    m = blocksize(a.n, i);
+    vk->clamp(outblock(&out, i), getblock(L, &a, i, m), lo, hi, m);
+    putblock(L, &out, i, m, 0);
+  }
+  lua_pushvalue(L, out.arg);
+  return 1;
+}
+
+
+static int math_floors (lua_State *L) {
+  const VKernels *vk = getkernels();
+  VArg a, out;
+  size_t i, m;
+  checkvarg(L, 1, &a);
+  checkout(L, 2, &out, &a);
+  for (i = 0; i < a.n; i += m) {
+    m = blocksize(a.n, i);
+    vk->floor(outblock(&out, i), getblock(L, &a, i, m), m);
+    putblock(L, &out, i, m, 1);  /* tables get integers, as 'math.floor' */
+  }
+  lua_pushvalue(L, out.arg);
+  return 1;
+}
+
+
+static int math_cumsum (lua_State *L) {
+  lua_Number s = 0;
+  VArg a, out;
+  size_t i, m, k;
+  checkvarg(L, 1, &a);
+  checkout(L, 2, &out, &a);
+  for (i = 0; i < a.n; i += m) {
+    const lua_Number *x;
+    lua_Number *y;
+    m = blocksize(a.n, i);
+    x = getblock(L, &a, i, m);
+    y = outblock(&out, i);
+    for (k = 0; k < m; k++) {
+      s += x[k];
+      y[k] = s;
+    }
+    putblock(L, &out, i, m, 0);
+  }
+  lua_pushvalue(L, out.arg);
+  return 1;
+}
+
+/* }================================================================== */
+
+
+/*
+** {==================================================================
+** Pseudo-Random Number Generator based on 'xoshiro256**'.
+** ===================================================================
+*/
+
+/*
+** Each system thread has its own generator for 'math.random', so that
+** threads sharing a state (see LUA_USE_THREADS) or running their own
+** states never race on it, and the functions need no upvalues (so that
+** channels can send them). Programs can create more generators with
+** 'math.newrandom', which are userdata. All of them keep the 256 bits
+** of a 'xoshiro256**' state.
+*/
+
+/* storage class of per-thread variables */
+#if !defined(l_threadlocal)
+#if defined(__GNUC__)
+#define l_threadlocal	__thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define l_threadlocal	_Thread_local
+#else
+#define l_threadlocal	/* empty: one generator for all threads */
+#endif
+#endif
+
+/* a 64-bit unsigned integer type (at least) */
+#if ((ULONG_MAX >> 31) >> 31) >= 3
+typedef unsigned long Rand64;
+#else
+typedef unsigned long long Rand64;
+#endif
+
+/* make sure a value has only 64 bits (if Rand64 has more) */
+#define trim64(x)	((x) & 0xffffffffffffffffu)
+
+/* rotate left 'x' by 'n' bits */
+#define rotl(x,n)	(trim64((x) << (n)) | (trim64(x) >> (64 - (n))))
+
+
+typedef struct RanState {
+  Rand64 s[4];
+} RanState;
+
+
+/* metatable of generators */
+#define RANDGEN		"RandomGenerator"
+
+
+static Rand64 nextrand (Rand64 *state) {
+  Rand64 state0 = state[0];
+  Rand64 state1 = state[1];
+  Rand64 state2 = state[2] ^ state0;
+  Rand64 state3 = state[3] ^ state1;
+  Rand64 res = rotl(state1 * 5, 7) * 9;
+  state1 <<= 17;
+  state[0] = state0 ^ state3;
+  state[1] = trim64(state0 ^ state2);
+  state[2] = state2 ^ state1;
+  state[3] = rotl(state3, 45);
+  return trim64(res);
+}
+
+
+/* number of significant bits in a float */
+#if LUA_FLOAT_TYPE == LUA_FLOAT_FLOAT
+#define FIGS	FLT_MANT_DIG
+#elif LUA_FLOAT_TYPE == LUA_FLOAT_LONGDOUBLE
+#define FIGS	((LDBL_MANT_DIG > 64) ? 64 : LDBL_MANT_DIG)
+#else
+#define FIGS	DBL_MANT_DIG
+#endif
+
+/* 2^(-FIGS) */
+#define twotomin	(l_mathop(0.5) / (Rand64)((Rand64)1 << (FIGS - 1)))
+
+/* convert the FIGS higher bits of a random value to a float in [0, 1) */
+#define I2d(x)		((lua_Number)((x) >> (64 - FIGS)) * twotomin)
+
+
+/*
+** Project a random integer 'ran' into the interval [0, n]. When 'n + 1'
+** is not a power of 2, computes the smallest 2^b - 1 not smaller than
+** 'n' and keeps the 'b' lower bits of random values until one of them
+** is not larger than 'n' (which takes less than two tries on average).
+*/
+static lua_Unsigned project (lua_Unsigned ran, lua_Unsigned n,
+                             RanState *g) {
+  if ((n & (n + 1)) == 0)  /* is 'n + 1' a power of 2? */
+    return ran & n;
+  else {
+    lua_Unsigned lim = n;
+    lim |= (lim >> 1);
+    lim |= (lim >> 2);
+    lim |= (lim >> 4);
+    lim |= (lim >> 8);
+    lim |= (lim >> 16);
+#if (LUA_MAXINTEGER >> 30) >= 3
+    lim |= (lim >> 32);  /* integer type has more than 32 bits */
+#endif
+    while ((ran &= lim) > n)  /* not inside [0, n]? */
+      ran = (lua_Unsigned)nextrand(g->s);  /* try again */
+    return ran;
+  }
+}
+
+
+static void setseed (RanState *g, lua_Unsigned n1, lua_Unsigned n2) {
+  int i;
+  g->s[0] = (Rand64)n1;
+  g->s[1] = (Rand64)0xff;  /* avoid a zero state */
+  g->s[2] = (Rand64)n2;
+  g->s[3] = (Rand64)0;
+  for (i = 0; i < 16; i++)
+    nextrand(g->s);  /* discard initial values to "spread" seed */
+}
+
+
+/* seed with the current time and the address of a fresh object */
+static void randseed (lua_State *L, RanState *g, lua_Unsigned *n1,
+                      lua_Unsigned *n2) {
+  *n1 = (lua_Unsigned)time(NULL);
+  *n2 = (lua_Unsigned)(size_t)lua_topointer(L, -1);
+  setseed(g, *n1, *n2);
+}
+
+
+/* a seed component; floats without an integer value give their bits */
+static lua_Unsigned seedarg (lua_State *L, int arg) {
+  int isnum;
+  lua_Integer n = lua_tointegerx(L, arg, &isnum);
+  if (isnum)
+    return (lua_Unsigned)n;
+  else {
+    lua_Number f = luaL_checknumber(L, arg);
+    lua_Unsigned u = 0;
+    memcpy(&u, &f, (sizeof(f) < sizeof(u)) ? sizeof(f) : sizeof(u));
+    return u;
+  }
+}
+
+
+/*
+** Get the interval [*low, *up] given by the arguments from 'a' on, as in
+** 'math.random'; returns 0 for no arguments (floats), 1 for an interval,
+** and 2 for a single 0 (all bits).
+*/
+static int getinterval (lua_State *L, int a, lua_Integer *low,
+                        lua_Integer *up) {
+  switch (lua_gettop(L) - a + 1) {  /* check number of arguments */
+    case 0:  /* no arguments */
+      return 0;
     case 1: {  /* only upper limit */
-      low = 1;
-      up = luaL_checkinteger(L, 1);
+      *low = 1;
+      *up = luaL_checkinteger(L, a);
+      if (*up == 0)  /* single 0 as argument? */
+        return 2;
       break;
     }
     case 2: {  /* lower and upper limits */
-      low = luaL_checkinteger(L, 1);
-      up = luaL_checkinteger(L, 2);
+      *low = luaL_checkinteger(L, a);
+      *up = luaL_checkinteger(L, a + 1);
       break;
     }
     default: return luaL_error(L, "wrong number of arguments");
   }
-  /* random integer in the interval [low, up] */
-  luaL_argcheck(L, low <= up, 1, "interval is empty");
-  luaL_argcheck(L, low >= 0 || up <= LUA_MAXINTEGER + low, 1,
-                   "interval too large");
-  r *= (double)(up - low) + 1.0;
-  lua_pushinteger(L, (lua_Integer)r + low);
+  luaL_argcheck(L, *low <= *up, a, "interval is empty");
   return 1;
 }
 
 
-static int math_randomseed (lua_State *L) {
-  l_srand((unsigned int)(lua_Integer)luaL_checknumber(L, 1));
-  (void)l_rand(); /* discard first value to avoid undesirable correlations */
-  return 0;
+/* a random integer in the interval [low, up] */
+#define randint(g,low,up)  \
+	(project((lua_Unsigned)nextrand((g)->s), \
+	         (lua_Unsigned)(up) - (lua_Unsigned)(low), g) + \
+	 (lua_Unsigned)(low))
+
+
+static int dorandom (lua_State *L, RanState *g, int a) {
+  lua_Integer low, up;
+  switch (getinterval(L, a, &low, &up)) {
+    case 0:  /* float between 0 and 1 */
+      lua_pushnumber(L, I2d(nextrand(g->s)));
+      break;
+    case 1:  /* integer in the interval */
+      lua_pushinteger(L, (lua_Integer)randint(g, low, up));
+      break;
+    default:  /* integer with all bits random */
+      lua_pushinteger(L, (lua_Integer)(lua_Unsigned)nextrand(g->s));
+      break;
+  }
+  return 1;
 }
 
 
-static int math_type (lua_State *L) {
-  if (lua_type(L, 1) == LUA_TNUMBER) {
-      if (lua_isinteger(L, 1))
-        lua_pushliteral(L, "integer");
-      else
-        lua_pushliteral(L, "float");
+static int doseed (lua_State *L, RanState *g, int a) {
+  lua_Unsigned n1, n2;
+  if (lua_isnone(L, a)) {
+    lua_newtable(L);  /* a fresh object, for its address */
+    randseed(L, g, &n1, &n2);
   }
   else {
-    luaL_checkany(L, 1);
-    lua_pushnil(L);
+    n1 = seedarg(L, a);
+    n2 = lua_isnoneornil(L, a + 1) ? 0 : seedarg(L, a + 1);
+    setseed(g, n1, n2);
+  }
+  lua_pushinteger(L, (lua_Integer)n1);
+  lua_pushinteger(L, (lua_Integer)n2);
+  return 2;
+}
+
+
+/*
+** Fill an array with the values that 'math.random' would return for the
+** arguments from 'a + 1' on. Arrays of integers and of bytes need an
+** interval (within [0, 255] for bytes).
+*/
+static int dofill (lua_State *L, RanState *g, int a) {
+  lua_Integer low = 0, up = 0;
+  VArg v;
+  size_t i, m, k;
+  int what;
+  checkvarg(L, a, &v);
+  what = getinterval(L, a + 1, &low, &up);
+  luaL_argcheck(L, what != 0 || v.kind == 0 || v.kind == LUA_ARRFLT, a + 1,
+                "interval expected");
+  luaL_argcheck(L, v.kind != LUA_ARRBYTE || (what == 1 && low >= 0 &&
+                   up <= UCHAR_MAX), a + 1, "interval out of range");
+  if (v.kind == LUA_ARRINT || v.kind == LUA_ARRBYTE) {
+    for (k = 0; k < v.n; k++) {
+      lua_Integer r = (what == 1) ? (lua_Integer)randint(g, low, up)
+                                  : (lua_Integer)(lua_Unsigned)nextrand(g->s);
+      if (v.kind == LUA_ARRINT)
+        ((lua_Integer *)v.mem)[k] = r;
+      else
+        ((unsigned char *)v.mem)[k] = (unsigned char)r;
+    }
+  }
+  else if (what != 0 && v.kind == 0) {  /* integers into a table */
+    for (k = 0; k < v.n; k++) {
+      lua_Integer r = (what == 1) ? (lua_Integer)randint(g, low, up)
+                                  : (lua_Integer)(lua_Unsigned)nextrand(g->s);
+      lua_pushinteger(L, r);
+      lua_rawseti(L, a, (lua_Integer)k + 1);
+    }
+  }
+  else {  /* floats (maybe with integral values) into a float operand */
+    for (i = 0; i < v.n; i += m) {
+      lua_Number *y = outblock(&v, i);
+      m = blocksize(v.n, i);
+      for (k = 0; k < m; k++) {
+        if (what == 0)
+          y[k] = I2d(nextrand(g->s));
+        else if (what == 1)
+          y[k] = (lua_Number)(lua_Integer)randint(g, low, up);
+        else
+          y[k] = (lua_Number)(lua_Integer)(lua_Unsigned)nextrand(g->s);
+      }
+      putblock(L, &v, i, m, 0);
+    }
   }
+  lua_pushvalue(L, a);
+  return 1;
+}
+
+
+/* generator of the current system thread (all zeros until seeded) */
+static l_threadlocal RanState mathstate;
+
+
+/* get the generator of the current thread, seeding it at first use */
+static RanState *mathgen (lua_State *L) {
+  RanState *g = &mathstate;
+  if ((g->s[0] | g->s[1] | g->s[2] | g->s[3]) == 0)  /* not seeded? */
+    setseed(g, (lua_Unsigned)time(NULL),
+               (lua_Unsigned)(size_t)g ^ (lua_Unsigned)(size_t)L);
+  return g;
+}
+
+
+static int math_random (lua_State *L) {
+  return dorandom(L, mathgen(L), 1);
+}
+
+
+static int math_randomseed (lua_State *L) {
+  return doseed(L, mathgen(L), 1);
+}
+
+
+static int math_randomfill (lua_State *L) {
+  return dofill(L, mathgen(L), 1);
+}
+
+
+static int math_newrandom (lua_State *L) {
+  RanState *g = (RanState *)lua_newuserdata(L, sizeof(RanState));
+  luaL_setmetatable(L, RANDGEN);
+  lua_insert(L, 1);  /* generator below the seed */
+  doseed(L, g, 2);
+  lua_settop(L, 1);
   return 1;
 }
 
 
+#define checkgen(L)	((RanState *)luaL_checkudata(L, 1, RANDGEN))
+
+static int gen_random (lua_State *L) {
+  return dorandom(L, checkgen(L), 2);
+}
+
+
+static int gen_randomseed (lua_State *L) {
+  return doseed(L, checkgen(L), 2);
+}
+
+
+static int gen_randomfill (lua_State *L) {
+  return dofill(L, checkgen(L), 2);
+}
+
+
+static const luaL_Reg genmeth[] = {
+  {"random", gen_random},
+  {"randomseed", gen_randomseed},
+  {"randomfill", gen_randomfill},
+  {NULL, NULL}
+};
+
+
+/* create the metatable of generators */
+static void createrandmeta (lua_State *L) {
+  luaL_newmetatable(L, RANDGEN);
+  luaL_newlib(L, genmeth);
+  lua_setfield(L, -2, "__index");  /* metatable.__index = methods */
+  lua_pop(L, 1);  /* pop metatable */
+}
+
+/* }================================================================== */
+
+
 /*
 ** {==================================================================
 ** Deprecated functions (for compatibility only)
@@ -369,10 +1256,20 @@ static const luaL_Reg mathlib[] = {
   {"rad",   math_rad},
   {"random",     math_random},
   {"randomseed", math_randomseed},
+  {"randomfill", math_randomfill},
   {"sin",   math_sin},
   {"sqrt",  math_sqrt},
   {"tan",   math_tan},
   {"type", math_type},
+  {"add",   math_add},
+  {"clamp", math_clamp},
+  {"cumsum", math_cumsum},
+  {"dot",   math_dot},
+  {"floors", math_floors},
+  {"minmax", math_minmax},
+  {"scale", math_scale},
+  {"sum",   math_sum},
+  {"newrandom", math_newrandom},
 #if defined(LUA_COMPAT_MATHLIB)
   {"atan2", math_atan},
   {"cosh",   math_cosh},
@@ -405,6 +1302,7 @@ LUAMOD_API int luaopen_math (lua_State *L) {
   lua_setfield(L, -2, "maxinteger");
   lua_pushinteger(L, LUA_MININTEGER);
   lua_setfield(L, -2, "mininteger");
+  createrandmeta(L);
   return 1;
 }
 
@@ -361,21 +361,18 @@ int luaO_utf8esc (char *buff, unsigned long x) {
 }
 
 
-/* maximum length of the conversion of a number to a string */
-#define MAXNUMBER2STR	50
-
-
 /*
-** Convert a number object to a string
+** Convert a number object to a string in 'buff', which must have room
+** for MAXNUMBER2STR chars. Returns the length of the result (which is
+** not zero-terminated).
 */
-void luaO_tostring (lua_State *L, StkId obj) {
-  char buff[MAXNUMBER2STR];
+size_t luaO_tostr (const TValue *obj, char *buff) {
   size_t len;
   lua_assert(ttisnumber(obj));
   if (ttisinteger(obj))
-    len = lua_integer2str(buff, sizeof(buff), ivalue(obj));
+    len = lua_integer2str(buff, MAXNUMBER2STR, ivalue(obj));
   else {
-    len = lua_number2str(buff, sizeof(buff), fltvalue(obj));
+    len = lua_number2str(buff, MAXNUMBER2STR, fltvalue(obj));
 #if !defined(LUA_COMPAT_FLOATSTRING)
     if (buff[strspn(buff, "-0123456789")] == '\0') {  /* looks like an int? */
       buff[len++] = lua_getlocaledecpoint();
@@ -383,6 +380,16 @@ void luaO_tostring (lua_State *L, StkId obj) {
     }
 #endif
   }
+  return len;
+}
+
+
+/*
+** Convert a number object to a string
+*/
+void luaO_tostring (lua_State *L, StkId obj) {
+  char buff[MAXNUMBER2STR];
+  size_t len = luaO_tostr(obj, buff);
   setsvalue2s(L, obj, luaS_newlstr(L, buff, len));
 }
 
@@ -321,12 +321,57 @@ typedef union UTString {
 } UTString;
 
 
+/*
+** Header for an external string: a long string whose bytes are in
+** memory owned by someone else (see 'lua_pushexternalstring'). Its
+** field 'shrlen', not used by other long strings, is EXTSTR.
+*/
+typedef struct TExtString {
+  TString ts;
+  const char *contents;
+  lua_Alloc falloc;  /* to release 'contents' (NULL if not needed) */
+  void *ud;
+} TExtString;
+
+
+/*
+** Long strings made by repeated concatenation ('s = s .. x') share a
+** growing buffer (see 'luaS_extend'). Each of them is an external
+** string whose 'shrlen' is BUFSTR, whose 'contents' are the start of
+** the buffer, and whose 'ud' is the buffer. The buffer is a collectable
+** object that Lua never sees, tagged LUA_TLNGSTR with 'shrlen' STRBUF;
+** its 'extra' is 1 when no string can grow over its end anymore.
+*/
+typedef struct TStrBuf {
+  TString ts;
+  size_t size;  /* size of the buffer (not counting its final zero) */
+  size_t used;  /* length of the longest string in the buffer */
+} TStrBuf;
+
+
+#define EXTSTR		cast_byte(~0)
+#define BUFSTR		cast_byte(~1)	/* string in a shared buffer */
+#define STRBUF		cast_byte(~2)	/* shared buffer */
+#define CATSTR		cast_byte(~3)	/* long result of a concatenation */
+
+#define isextstr(ts)	((ts)->shrlen == EXTSTR || (ts)->shrlen == BUFSTR)
+#define isbufstr(ts)	((ts)->shrlen == BUFSTR)
+
+/* buffer of a string in a shared buffer */
+#define strbuf(ts)	cast(TStrBuf *, cast(TExtString *, (ts))->ud)
+
+/* bytes of a shared buffer */
+#define getbuff(b)	(cast(char *, (b)) + sizeof(TStrBuf))
+
+
 /*
 ** Get the actual string (array of bytes) from a 'TString'.
 ** (Access to 'extra' ensures that value is really a 'TString'.)
 */
 #define getstr(ts)  \
-  check_exp(sizeof((ts)->extra), cast(char *, (ts)) + sizeof(UTString))
+  check_exp(sizeof((ts)->extra), \
+    isextstr(ts) ? cast(char *, cast(TExtString *, (ts))->contents) \
+                 : cast(char *, (ts)) + sizeof(UTString))
 
 
 /* get the actual string (array of bytes) from a Lua value */
@@ -346,6 +391,7 @@ typedef union UTString {
 typedef struct Udata {
   CommonHeader;
   lu_byte ttuv_;  /* user value's tag */
+  lu_byte arrkind;  /* kind of a typed array (0 if not one) */
   struct Table *metatable;
   size_t len;  /* number of bytes */
   union Value user_;  /* user value */
@@ -368,6 +414,19 @@ typedef union UUdata {
 #define getudatamem(u)  \
   check_exp(sizeof((u)->ttuv_), (cast(char*, (u)) + sizeof(UUdata)))
 
+/*
+** A typed array (see 'lua_newarray') is a full userdata whose memory
+** is a vector of numbers of kind 'arrkind', all of the same size.
+*/
+#define isarray(o)	(ttisfulluserdata(o) && uvalue(o)->arrkind != 0)
+
+#define arrelemsize(k)  \
+	((k) == LUA_ARRBYTE ? 1 : \
+	 (k) == LUA_ARRINT ? sizeof(lua_Integer) : sizeof(lua_Number))
+
+/* number of elements in typed array 'u' */
+#define arraylen(u)	((u)->len / arrelemsize((u)->arrkind))
+
 #define setuservalue(L,u,o) \
 	{ const TValue *io=(o); Udata *iu = (u); \
 	  iu->user_ = io->value_; iu->ttuv_ = rttype(io); \
@@ -499,6 +558,7 @@ typedef struct Table {
   lu_byte flags;  /* 1<<p means tagmethod(p) is not present */
   lu_byte lsizenode;  /* log2 of size of 'node' array */
   unsigned int sizearray;  /* size of 'array' array */
+  unsigned int lenhint;  /* last border found in the array part */
   TValue *array;  /* array part */
   Node *node;
   Node *lastfree;  /* any free position is before this position */
@@ -530,6 +590,9 @@ LUAI_DDEC const TValue luaO_nilobject_;
 /* size of buffer for 'luaO_utf8esc' function */
 #define UTF8BUFFSZ	8
 
+/* size of buffer for 'luaO_tostr' (maximum length of a number as text) */
+#define MAXNUMBER2STR	50
+
 LUAI_FUNC int luaO_int2fb (unsigned int x);
 LUAI_FUNC int luaO_fb2int (int x);
 LUAI_FUNC int luaO_utf8esc (char *buff, unsigned long x);
@@ -538,6 +601,7 @@ LUAI_FUNC void luaO_arith (lua_State *L, int op, const TValue *p1,
                            const TValue *p2, TValue *res);
 LUAI_FUNC size_t luaO_str2num (const char *s, TValue *o);
 LUAI_FUNC int luaO_hexavalue (int c);
+LUAI_FUNC size_t luaO_tostr (const TValue *obj, char *buff);
 LUAI_FUNC void luaO_tostring (lua_State *L, StkId obj);
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
                                                        va_list argp);
@@ -0,0 +1,546 @@
+/*
+** $Id: lparlib.c $
+** Parallel map and reduce over a pool of worker states
+** See Copyright Notice in lua.h
+*/
+
+#define lparlib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "lchanlib.h"
+
+
+/*
+** A job applies a function to all elements of an array. The array is
+** split into tasks (slices of consecutive elements), which are copied
+** into messages (see 'lchanlib.h') and run by a pool of worker states,
+** each one in its own system thread. The function goes to the workers
+** as a binary chunk. Each worker starts with a range of tasks and,
+** when it runs out of them, steals half of the tasks left to another
+** worker, so that all workers keep busy until the end of the job.
+*/
+
+
+/* maximum number of elements in a task */
+#if !defined(PAR_MAXTASK)
+#define PAR_MAXTASK	1024
+#endif
+
+/* number of tasks for each worker, for a better load balance */
+#if !defined(PAR_TASKSPERWORKER)
+#define PAR_TASKSPERWORKER	8
+#endif
+
+/* maximum number of workers in a pool */
+#if !defined(PAR_MAXWORKERS)
+#define PAR_MAXWORKERS	256
+#endif
+
+
+#define POOL		"parallel.pool"
+#define POOLKEY		"_PARPOOL"	/* key for the pool in the registry */
+#define JOB		"parallel.job"
+
+
+/* kinds of jobs */
+#define PMAP		0
+#define PREDUCE		1
+
+
+typedef struct Job {
+  Message *func;  /* function to be applied */
+  Message **tasks;  /* input values of each task */
+  Message **results;  /* output values of each task */
+  int ntasks;
+  int kind;
+  int abort;  /* true if some task raised an error */
+  char *errmsg;  /* message of that error */
+  int active;  /* number of workers still running the job */
+} Job;
+
+
+static int job_gc (lua_State *L) {
+  Job *job = (Job *)luaL_checkudata(L, 1, JOB);
+  int i;
+  for (i = 0; i < job->ntasks; i++) {
+    if (job->tasks[i] != NULL) luaCH_free(job->tasks[i]);
+    if (job->results[i] != NULL) luaCH_free(job->results[i]);
+  }
+  if (job->func != NULL) luaCH_free(job->func);
+  free(job->tasks);
+  free(job->results);
+  free(job->errmsg);
+  job->ntasks = 0;
+  job->func = NULL;
+  job->tasks = job->results = NULL;
+  job->errmsg = NULL;
+  return 0;
+}
+
+
+static Job *newjob (lua_State *L, int kind, int ntasks) {
+  Job *job = (Job *)lua_newuserdata(L, sizeof(Job));
+  memset(job, 0, sizeof(Job));
+  job->kind = kind;
+  if (luaL_newmetatable(L, JOB)) {  /* creating metatable? */
+    lua_pushcfunction(L, job_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  job->tasks = (Message **)calloc(ntasks, sizeof(Message *));
+  job->results = (Message **)calloc(ntasks, sizeof(Message *));
+  if (ntasks > 0 && (job->tasks == NULL || job->results == NULL))
+    luaL_error(L, "not enough memory");
+  return job;
+}
+
+
+/*
+** Run task 'k' of 'job' with function at index 'f', leaving its
+** results in a new message.
+*/
+static void runtask (lua_State *L, Job *job, int f, int k) {
+  int top = lua_gettop(L);
+  int n = luaCH_unpack(L, job->tasks[k]);
+  int i;
+  luaL_checkstack(L, 3, "too many values in a task");
+  if (job->kind == PMAP) {
+    for (i = top + 1; i <= top + n; i++) {
+      lua_pushvalue(L, f);
+      lua_pushvalue(L, i);
+      lua_call(L, 1, 1);
+      lua_replace(L, i);
+    }
+  }
+  else {  /* PREDUCE: fold the values of the task */
+    for (i = top + 2; i <= top + n; i++) {
+      lua_pushvalue(L, f);
+      lua_pushvalue(L, top + 1);  /* accumulator */
+      lua_pushvalue(L, i);
+      lua_call(L, 2, 1);
+      lua_replace(L, top + 1);
+    }
+    lua_settop(L, top + 1);
+  }
+  job->results[k] = luaCH_pack(L, top + 1, lua_gettop(L));
+  lua_settop(L, top);
+}
+
+
+#if defined(LUA_USE_POSIX) && defined(__GNUC__)	/* { */
+
+#include <pthread.h>
+#include <unistd.h>
+
+
+typedef struct Worker {
+  unsigned long long range;  /* tasks left to this worker (see 'mkrange') */
+  char pad[64 - sizeof(unsigned long long)];  /* one cache line each */
+  struct Pool *pool;
+  lua_State *L;  /* worker state */
+  pthread_t thread;
+  int id;
+} Worker;
+
+
+typedef struct Pool {
+  pthread_mutex_t mutex;
+  pthread_cond_t wakeup;  /* workers wait here for a new job */
+  pthread_cond_t done;  /* callers wait here for the end of a job */
+  Job *job;  /* current job (or NULL) */
+  unsigned int round;  /* number of jobs started */
+  int shutdown;  /* true when workers must stop */
+  int nworkers;
+  Worker *workers;
+} Pool;
+
+
+/*
+** A range of tasks [lo, hi) is kept in a single word, so that both its
+** owner (taking tasks from the front) and thieves (taking them from the
+** back) can change it with a single compare-and-swap.
+*/
+#define mkrange(lo,hi)	(((unsigned long long)(hi) << 32) | (unsigned)(lo))
+#define rangelo(r)	((int)((r) & 0xffffffffu))
+#define rangehi(r)	((int)((r) >> 32))
+
+#define casrange(p,e,d)  \
+	__atomic_compare_exchange_n(p, e, d, 1, __ATOMIC_ACQ_REL, \
+	                            __ATOMIC_ACQUIRE)
+
+
+/* take the first task of worker 'w' (or -1 if it has none) */
+static int poptask (Worker *w) {
+  unsigned long long r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+  for (;;) {
+    int lo = rangelo(r), hi = rangehi(r);
+    if (lo >= hi)
+      return -1;
+    if (casrange(&w->range, &r, mkrange(lo + 1, hi)))
+      return lo;
+  }
+}
+
+
+/* move the last half of the tasks of 'victim' to (empty) worker 'w' */
+static int steal (Worker *w, Worker *victim) {
+  unsigned long long r = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+  for (;;) {
+    int lo = rangelo(r), hi = rangehi(r);
+    int n = (hi - lo + 1) / 2;
+    if (lo >= hi)
+      return 0;
+    if (casrange(&victim->range, &r, mkrange(lo, hi - n))) {
+      __atomic_store_n(&w->range, mkrange(hi - n, hi), __ATOMIC_RELEASE);
+      return 1;
+    }
+  }
+}
+
+
+static int nexttask (Pool *p, Worker *w) {
+  int k;
+  while ((k = poptask(w)) < 0) {
+    int i;
+    for (i = 1; i < p->nworkers; i++) {
+      if (steal(w, &p->workers[(w->id + i) % p->nworkers]))
+        break;
+    }
+    if (i >= p->nworkers)  /* nothing to steal? */
+      return -1;
+  }
+  return k;
+}
+
+
+static int workjob (lua_State *L) {
+  Worker *w = (Worker *)lua_touserdata(L, 1);
+  Job *job = (Job *)lua_touserdata(L, 2);
+  int k;
+  lua_settop(L, 2);
+  luaCH_unpack(L, job->func);  /* function goes to index 3 */
+  while (!__atomic_load_n(&job->abort, __ATOMIC_RELAXED) &&
+         (k = nexttask(w->pool, w)) >= 0)
+    runtask(L, job, 3, k);
+  return 0;
+}
+
+
+static void seterror (Pool *p, Job *job, lua_State *L) {
+  const char *msg = lua_tostring(L, -1);
+  if (msg == NULL) msg = "(error object is not a string)";
+  pthread_mutex_lock(&p->mutex);
+  if (job->errmsg == NULL) {  /* first error? */
+    size_t len = strlen(msg) + 1;
+    job->errmsg = (char *)malloc(len);
+    if (job->errmsg != NULL)
+      memcpy(job->errmsg, msg, len);
+  }
+  __atomic_store_n(&job->abort, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+
+static void *workermain (void *ud) {
+  Worker *w = (Worker *)ud;
+  Pool *p = w->pool;
+  lua_State *L = w->L;
+  unsigned int round = 0;
+  pthread_mutex_lock(&p->mutex);
+  for (;;) {
+    Job *job;
+    while (!p->shutdown && p->round == round)
+      pthread_cond_wait(&p->wakeup, &p->mutex);
+    if (p->shutdown)
+      break;
+    round = p->round;
+    job = p->job;
+    pthread_mutex_unlock(&p->mutex);
+    lua_pushcfunction(L, workjob);
+    lua_pushlightuserdata(L, w);
+    lua_pushlightuserdata(L, job);
+    if (lua_pcall(L, 2, 0, 0) != LUA_OK)
+      seterror(p, job, L);
+    lua_settop(L, 0);
+    pthread_mutex_lock(&p->mutex);
+    if (--job->active == 0)  /* last worker leaving the job? */
+      pthread_cond_broadcast(&p->done);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  return NULL;
+}
+
+
+static void stoppool (Pool *p, int nthreads) {
+  int i;
+  pthread_mutex_lock(&p->mutex);
+  p->shutdown = 1;
+  pthread_cond_broadcast(&p->wakeup);
+  pthread_mutex_unlock(&p->mutex);
+  for (i = 0; i < nthreads; i++)
+    pthread_join(p->workers[i].thread, NULL);
+  for (i = 0; i < p->nworkers; i++) {
+    if (p->workers[i].L != NULL)
+      lua_close(p->workers[i].L);
+  }
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->wakeup);
+  pthread_mutex_destroy(&p->mutex);
+  free(p->workers);
+  free(p);
+}
+
+
+static int pool_gc (lua_State *L) {
+  Pool **pp = (Pool **)luaL_checkudata(L, 1, POOL);
+  if (*pp != NULL) {
+    stoppool(*pp, (*pp)->nworkers);
+    *pp = NULL;
+  }
+  return 0;
+}
+
+
+/* create a pool with 'n' workers, kept in the registry */
+static Pool *newpool (lua_State *L, int n) {
+  Pool **pp = (Pool **)lua_newuserdata(L, sizeof(Pool *));
+  Pool *p;
+  int i;
+  *pp = NULL;
+  if (luaL_newmetatable(L, POOL)) {  /* creating metatable? */
+    lua_pushcfunction(L, pool_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  p = (Pool *)malloc(sizeof(Pool));
+  if (p == NULL ||
+      (p->workers = (Worker *)calloc(n, sizeof(Worker))) == NULL) {
+    free(p);
+    luaL_error(L, "not enough memory");
+    return NULL;  /* not reached */
+  }
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->wakeup, NULL);
+  pthread_cond_init(&p->done, NULL);
+  p->job = NULL;
+  p->round = 0;
+  p->shutdown = 0;
+  p->nworkers = n;
+  for (i = 0; i < n; i++) {
+    Worker *w = &p->workers[i];
+    w->pool = p;
+    w->id = i;
+    w->range = mkrange(0, 0);
+    if ((w->L = luaL_newstate()) == NULL) {
+      stoppool(p, 0);
+      luaL_error(L, "cannot create worker state");
+    }
+    luaL_openlibs(w->L);
+  }
+  for (i = 0; i < n; i++) {
+    if (pthread_create(&p->workers[i].thread, NULL, workermain,
+                       &p->workers[i]) != 0) {
+      stoppool(p, i);
+      luaL_error(L, "cannot create worker thread");
+    }
+  }
+  *pp = p;
+  lua_setfield(L, LUA_REGISTRYINDEX, POOLKEY);
+  return p;
+}
+
+
+static int defaultworkers (void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n < 1) ? 1 : (n > PAR_MAXWORKERS) ? PAR_MAXWORKERS : (int)n;
+}
+
+
+static Pool *getpool (lua_State *L) {
+  Pool *p;
+  if (lua_getfield(L, LUA_REGISTRYINDEX, POOLKEY) == LUA_TUSERDATA &&
+      (p = *(Pool **)lua_touserdata(L, -1)) != NULL) {
+    lua_pop(L, 1);
+    return p;
+  }
+  lua_pop(L, 1);
+  return newpool(L, defaultworkers());
+}
+
+
+/* run 'job' in the pool, waiting for its end */
+static void runjob (lua_State *L, Job *job) {
+  Pool *p = getpool(L);
+  int i;
+  pthread_mutex_lock(&p->mutex);
+  while (p->job != NULL)  /* pool busy with another job? */
+    pthread_cond_wait(&p->done, &p->mutex);
+  for (i = 0; i < p->nworkers; i++) {  /* give each worker a range */
+    int lo = (int)((long long)job->ntasks * i / p->nworkers);
+    int hi = (int)((long long)job->ntasks * (i + 1) / p->nworkers);
+    __atomic_store_n(&p->workers[i].range, mkrange(lo, hi),
+                     __ATOMIC_RELAXED);
+  }
+  p->job = job;
+  job->active = p->nworkers;
+  p->round++;
+  pthread_cond_broadcast(&p->wakeup);
+  while (job->active > 0)
+    pthread_cond_wait(&p->done, &p->mutex);
+  p->job = NULL;
+  pthread_cond_broadcast(&p->done);  /* pool is free for other callers */
+  pthread_mutex_unlock(&p->mutex);
+}
+
+
+#define numworkers(L)	(getpool(L)->nworkers)
+
+
+static int par_workers (lua_State *L) {
+  if (!lua_isnoneornil(L, 1)) {
+    lua_Integer n = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, 1 <= n && n <= PAR_MAXWORKERS, 1,
+                     "invalid number of workers");
+    if (lua_getfield(L, LUA_REGISTRYINDEX, POOLKEY) == LUA_TUSERDATA) {
+      Pool **pp = (Pool **)lua_touserdata(L, -1);
+      if (*pp != NULL) {
+        if ((*pp)->job != NULL)
+          return luaL_error(L, "pool is busy");
+        stoppool(*pp, (*pp)->nworkers);  /* stop old pool */
+        *pp = NULL;
+      }
+    }
+    lua_pop(L, 1);
+    newpool(L, (int)n);
+  }
+  lua_pushinteger(L, numworkers(L));
+  return 1;
+}
+
+#else				/* }{ */
+
+/* no system threads: run all tasks in the calling state */
+
+static void runjob (lua_State *L, Job *job) {
+  int k;
+  lua_pushvalue(L, 1);  /* function */
+  for (k = 0; k < job->ntasks; k++)
+    runtask(L, job, lua_gettop(L), k);
+  lua_pop(L, 1);
+}
+
+
+#define numworkers(L)	1
+
+
+static int par_workers (lua_State *L) {
+  lua_pushinteger(L, 1);
+  return 1;
+}
+
+#endif				/* } */
+
+
+/*
+** Create and run a job over array at index 2 with function at index 1,
+** leaving the job on the stack.
+*/
+static Job *dojob (lua_State *L, int kind) {
+  lua_Integer n, size, i;
+  int k, ntasks;
+  Job *job;
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  n = luaL_len(L, 2);
+  size = n / ((lua_Integer)numworkers(L) * PAR_TASKSPERWORKER);
+  if (size < 1) size = 1;
+  else if (size > PAR_MAXTASK) size = PAR_MAXTASK;
+  luaL_argcheck(L, n / size < INT_MAX, 2, "array too large");
+  ntasks = (int)((n + size - 1) / size);
+  job = newjob(L, kind, ntasks);
+  job->func = luaCH_pack(L, 1, 1);
+  luaL_checkstack(L, (int)size, "too many values in a task");
+  for (k = 0, i = 1; k < ntasks; k++) {  /* create tasks */
+    int top = lua_gettop(L);
+    for (; i <= n && i <= (lua_Integer)(k + 1) * size; i++)
+      lua_geti(L, 2, i);
+    job->tasks[k] = luaCH_pack(L, top + 1, lua_gettop(L));
+    job->ntasks = k + 1;
+    lua_settop(L, top);
+  }
+  if (ntasks > 0)
+    runjob(L, job);
+  if (job->errmsg != NULL) {
+    lua_pushstring(L, job->errmsg);
+    lua_error(L);
+  }
+  return job;
+}
+
+
+static int par_map (lua_State *L) {
+  Job *job = dojob(L, PMAP);
+  lua_Integer i = 1;
+  int k;
+  lua_createtable(L, (int)luaL_len(L, 2), 0);
+  for (k = 0; k < job->ntasks; k++) {
+    int top = lua_gettop(L);
+    int n = luaCH_unpack(L, job->results[k]);
+    int j;
+    for (j = n; j >= 1; j--)  /* set results, from last to first */
+      lua_seti(L, top, i + j - 1);
+    i += n;
+  }
+  return 1;
+}
+
+
+/*
+** Each task folds its own elements, and then the results of the tasks
+** are folded in order; so, the function must be associative.
+*/
+static int par_reduce (lua_State *L) {
+  Job *job;
+  int hasinit = !lua_isnone(L, 3);
+  int k;
+  lua_settop(L, 3);
+  job = dojob(L, PREDUCE);
+  lua_pushvalue(L, 3);  /* accumulator (initial value, if any) */
+  for (k = 0; k < job->ntasks; k++) {
+    luaCH_unpack(L, job->results[k]);
+    if (!hasinit && k == 0)
+      lua_replace(L, -2);  /* first result is the first accumulator */
+    else {
+      lua_pushvalue(L, 1);
+      lua_insert(L, -3);
+      lua_call(L, 2, 1);
+    }
+  }
+  return 1;
+}
+
+
+static const luaL_Reg par_funcs[] = {
+  {"map", par_map},
+  {"reduce", par_reduce},
+  {"workers", par_workers},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_parallel (lua_State *L) {
+  luaL_newlib(L, par_funcs);
+  return 1;
+}
+
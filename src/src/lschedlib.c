@@ -0,0 +1,791 @@
+/*
+** $Id: lschedlib.c $
+** Coroutine scheduler over an event loop
+** See Copyright Notice in lua.h
+*/
+
+#define lschedlib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "liolib.h"
+
+
+/*
+** The scheduler runs coroutines ("tasks") created by 'sched.spawn'
+** until all of them finish. A task runs until it yields: if it called
+** 'sched.sleep' or 'sched.wait', it waits for a timer or for a file
+** descriptor (in a heap of timers and in a table of descriptors
+** watched by the event loop); if it started an asynchronous file
+** operation (see 'file:setasync'), it waits for that operation to
+** complete; otherwise, it goes back to the end of the ready queue.
+** Each round of the loop resumes, in order, only the tasks that were
+** ready at its start, and checks timers and events only once per
+** round.
+*/
+
+
+/* time (in seconds) to wait when all ready tasks wait for channels */
+#if !defined(SCHED_RETRYTIME)
+#define SCHED_RETRYTIME		0.001
+#endif
+
+/* maximum number of events handled per call to the event loop */
+#if !defined(SCHED_MAXEVENTS)
+#define SCHED_MAXEVENTS		256
+#endif
+
+
+#define SCHED		"sched.scheduler"
+
+/* metatable of channels (see 'lchanlib.c') */
+#define CHANNEL		"channel"
+
+
+/* what a task waits for in a descriptor */
+#define WREAD		1
+#define WWRITE		2
+
+
+/* task status */
+#define TREADY		0	/* in the ready queue (or running) */
+#define TBLOCKED	1	/* waiting for a timer or a descriptor */
+#define TDEAD		2	/* finished, but still referenced */
+
+
+typedef struct Task {
+  lua_State *co;
+  struct Sched *sched;  /* its scheduler (NULL if already collected) */
+  struct Task *prev, *next;  /* list of all tasks */
+  unsigned int waitid;  /* identifies the current wait */
+  int pins;  /* number of timers and descriptors referring to the task */
+  int nargs;  /* number of values for the next resume */
+  int result;  /* result of the last wait (-1 if none) */
+  int waitfd;  /* descriptor being waited for (or -1) */
+  int status;
+  int retry;  /* true if it yielded waiting for a channel */
+  int iowait;  /* true if it waits for a file operation */
+} Task;
+
+
+typedef struct Timer {
+  double when;
+  Task *task;
+  unsigned int waitid;  /* wait that set this timer */
+} Timer;
+
+
+typedef struct FdWait {
+  Task *reader;
+  Task *writer;
+  unsigned int rid, wid;  /* waits of 'reader' and 'writer' */
+  int registered;  /* true if descriptor is known by the event loop */
+} FdWait;
+
+
+typedef struct Sched {
+  Task *tasks;  /* list of all tasks */
+  int ntasks;  /* number of tasks not finished */
+  Task **ready;  /* circular queue of ready tasks */
+  int rfirst, rcount, rsize;
+  int nretry;  /* number of ready tasks waiting for channels */
+  Timer *timers;  /* binary heap of timers */
+  int ntimers, stimers;
+  FdWait *fds;  /* descriptors, indexed by number */
+  int sfds;
+  int nwaits;  /* number of tasks waiting for descriptors */
+  int niowaits;  /* number of tasks waiting for file operations */
+  int evfd;  /* descriptor of the event loop (or -1) */
+  Task *current;  /* task running now (or NULL) */
+  int running;
+} Sched;
+
+
+/* grow vector 'v' with elements of size 'e' to at least 'n' elements */
+static void *growvector (lua_State *L, void *v, int *size, size_t e,
+                         int n) {
+  int newsize = (*size < 8) ? 8 : *size;
+  void *nv;
+  while (newsize < n) {
+    if (newsize > INT_MAX / 2)
+      luaL_error(L, "too many tasks");
+    newsize *= 2;
+  }
+  nv = realloc(v, newsize * e);
+  if (nv == NULL)
+    luaL_error(L, "not enough memory");
+  *size = newsize;
+  return nv;
+}
+
+
+/*
+** {======================================================
+** Time and event loop
+** =======================================================
+*/
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+static double gettime (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+#else				/* }{ */
+
+static double gettime (void) {
+  return (double)clock() / (double)CLOCKS_PER_SEC;
+}
+
+#endif				/* } */
+
+
+static void fdready (Sched *S, int fd, int what);
+
+
+#if defined(LUA_USE_LINUX)	/* { */
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define ev_open(S)	((S)->evfd = epoll_create1(EPOLL_CLOEXEC))
+#define ev_close(S)	((S)->evfd >= 0 ? close((S)->evfd) : 0)
+
+
+/*
+** Descriptors use "one-shot" events, so each wait needs a call to
+** 'ev_arm'; the event loop does not report descriptors that nobody is
+** waiting for. Return 0 if ok, or an error code. Regular files cannot
+** be watched (EPERM), but they are always ready.
+*/
+static int ev_arm (Sched *S, int fd, int what) {
+  FdWait *w = &S->fds[fd];
+  struct epoll_event ev;
+  ev.events = EPOLLONESHOT | ((what & WREAD) ? EPOLLIN : 0)
+                           | ((what & WWRITE) ? EPOLLOUT : 0);
+  ev.data.fd = fd;
+  if (w->registered && epoll_ctl(S->evfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+    return 0;
+  /* not registered (or closed and then reused) */
+  if (epoll_ctl(S->evfd, EPOLL_CTL_ADD, fd, &ev) == 0 ||
+      (errno == EEXIST && epoll_ctl(S->evfd, EPOLL_CTL_MOD, fd, &ev) == 0)) {
+    w->registered = 1;
+    return 0;
+  }
+  return errno;
+}
+
+
+static void ev_poll (Sched *S, double timeout) {
+  struct epoll_event evs[SCHED_MAXEVENTS];
+  int ms = (timeout < 0) ? -1 : (int)(timeout * 1000 + 0.999);
+  int n = epoll_wait(S->evfd, evs, SCHED_MAXEVENTS, ms);
+  int i;
+  for (i = 0; i < n; i++) {
+    unsigned int e = evs[i].events;
+    int what = 0;
+    if (e & (EPOLLIN | EPOLLHUP | EPOLLERR)) what |= WREAD;
+    if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) what |= WWRITE;
+    fdready(S, evs[i].data.fd, what);
+  }
+}
+
+#elif defined(LUA_USE_POSIX)	/* }{ */
+
+#include <poll.h>
+
+#define ev_open(S)	((S)->evfd = 0)
+#define ev_close(S)	((void)0)
+
+
+/* 'poll' gets all descriptors in each call */
+static int ev_arm (Sched *S, int fd, int what) {
+  (void)S; (void)fd; (void)what;
+  return 0;
+}
+
+
+static void ev_poll (Sched *S, double timeout) {
+  struct pollfd pfds[SCHED_MAXEVENTS];
+  int ms = (timeout < 0) ? -1 : (int)(timeout * 1000 + 0.999);
+  int fd, n = 0, i;
+  for (fd = 0; fd < S->sfds && n < SCHED_MAXEVENTS; fd++) {
+    FdWait *w = &S->fds[fd];
+    if (w->reader != NULL || w->writer != NULL) {
+      pfds[n].fd = fd;
+      pfds[n].events = (w->reader ? POLLIN : 0) | (w->writer ? POLLOUT : 0);
+      n++;
+    }
+  }
+  if (poll(pfds, n, ms) <= 0)
+    return;
+  for (i = 0; i < n; i++) {
+    short e = pfds[i].revents;
+    int what = 0;
+    if (e & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) what |= WREAD;
+    if (e & (POLLOUT | POLLHUP | POLLERR | POLLNVAL)) what |= WWRITE;
+    if (what)
+      fdready(S, pfds[i].fd, what);
+  }
+}
+
+#else				/* }{ */
+
+/* no event loop: only timers, waiting by busy loops */
+
+#define ev_open(S)	((S)->evfd = 0)
+#define ev_close(S)	((void)0)
+
+
+static int ev_arm (Sched *S, int fd, int what) {
+  (void)S; (void)fd; (void)what;
+  return EINVAL;
+}
+
+
+static void ev_poll (Sched *S, double timeout) {
+  double limit = gettime() + timeout;
+  (void)S; (void)fdready;  /* no descriptors to report */
+  while (gettime() < limit) { /* wait */ }
+}
+
+#endif				/* } */
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Tasks, timers, and descriptors
+** =======================================================
+*/
+
+/* ensure the ready queue has space for all tasks plus a new one */
+static void checkready (lua_State *L, Sched *S) {
+  if (S->ntasks >= S->rsize) {
+    int oldsize = S->rsize;
+    int i;
+    S->ready = (Task **)growvector(L, S->ready, &S->rsize, sizeof(Task *),
+                                   S->ntasks + 1);
+    /* move elements that wrapped around to the new space */
+    for (i = 0; i < S->rfirst; i++)
+      S->ready[(oldsize + i) % S->rsize] = S->ready[i];
+  }
+}
+
+
+/* queue 'task' as ready; there must be space for it */
+static void enqueue (Sched *S, Task *task, int retry) {
+  task->status = TREADY;
+  task->retry = retry;
+  S->nretry += retry;
+  S->ready[(S->rfirst + S->rcount) % S->rsize] = task;
+  S->rcount++;
+}
+
+
+static Task *dequeue (Sched *S) {
+  Task *task = S->ready[S->rfirst];
+  S->rfirst = (S->rfirst + 1) % S->rsize;
+  S->rcount--;
+  S->nretry -= task->retry;
+  return task;
+}
+
+
+static void freetask (Sched *S, Task *task) {
+  if (task->prev) task->prev->next = task->next;
+  else S->tasks = task->next;
+  if (task->next) task->next->prev = task->prev;
+  free(task);
+}
+
+
+static void unpin (Sched *S, Task *task) {
+  if (--task->pins == 0 && task->status == TDEAD)
+    freetask(S, task);
+}
+
+
+/*
+** Make a blocked task ready again, with 'result' for the 'sched.wait'
+** it is blocked in. The ready queue always has space for all tasks.
+*/
+static void wakeup (Sched *S, Task *task, int result) {
+  task->waitid++;  /* other timers and descriptors are now stale */
+  task->result = result;
+  task->waitfd = -1;
+  enqueue(S, task, 0);
+}
+
+
+static void timerswap (Timer *t, int i, int j) {
+  Timer temp = t[i];
+  t[i] = t[j];
+  t[j] = temp;
+}
+
+
+static void addtimer (lua_State *L, Sched *S, Task *task, double when) {
+  Timer *t;
+  int i;
+  if (S->ntimers >= S->stimers)
+    S->timers = (Timer *)growvector(L, S->timers, &S->stimers,
+                                    sizeof(Timer), S->ntimers + 1);
+  t = S->timers;
+  i = S->ntimers++;
+  t[i].when = when;
+  t[i].task = task;
+  t[i].waitid = task->waitid;
+  task->pins++;
+  while (i > 0 && t[(i - 1) / 2].when > t[i].when) {  /* sift up */
+    timerswap(t, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+
+static Timer poptimer (Sched *S) {
+  Timer *t = S->timers;
+  Timer top = t[0];
+  int i = 0;
+  t[0] = t[--S->ntimers];
+  for (;;) {  /* sift down */
+    int c = 2 * i + 1;
+    if (c >= S->ntimers)
+      break;
+    if (c + 1 < S->ntimers && t[c + 1].when < t[c].when)
+      c++;
+    if (t[i].when <= t[c].when)
+      break;
+    timerswap(t, i, c);
+    i = c;
+  }
+  return top;
+}
+
+
+/* stop waiting for descriptor 'fd' on behalf of 'task' */
+static void clearwait (Sched *S, Task *task, int fd) {
+  FdWait *w = &S->fds[fd];
+  if (w->reader == task && w->rid == task->waitid) {
+    w->reader = NULL;
+    S->nwaits--;
+    unpin(S, task);
+  }
+  if (w->writer == task && w->wid == task->waitid) {
+    w->writer = NULL;
+    S->nwaits--;
+    unpin(S, task);
+  }
+  if (w->reader != NULL || w->writer != NULL)  /* others still waiting? */
+    ev_arm(S, fd, (w->reader ? WREAD : 0) | (w->writer ? WWRITE : 0));
+}
+
+
+static void firetimers (Sched *S) {
+  double now = gettime();
+  while (S->ntimers > 0 && S->timers[0].when <= now) {
+    Timer t = poptimer(S);
+    Task *task = t.task;
+    if (task->status == TBLOCKED && task->waitid == t.waitid) {
+      int timedout = (task->waitfd >= 0);
+      if (timedout)
+        clearwait(S, task, task->waitfd);
+      wakeup(S, task, timedout ? 0 : -1);
+    }
+    unpin(S, task);
+  }
+}
+
+
+/* get the waits for descriptor 'fd', making room for it if needed */
+static FdWait *getfdwait (lua_State *L, Sched *S, int fd) {
+  if (fd >= S->sfds) {
+    int oldsize = S->sfds;
+    S->fds = (FdWait *)growvector(L, S->fds, &S->sfds, sizeof(FdWait),
+                                  fd + 1);
+    memset(S->fds + oldsize, 0, (S->sfds - oldsize) * sizeof(FdWait));
+  }
+  return &S->fds[fd];
+}
+
+
+/* descriptor 'fd' is ready for 'what' */
+static void fdready (Sched *S, int fd, int what) {
+  FdWait *w;
+  if (fd < 0 || fd >= S->sfds)
+    return;
+  w = &S->fds[fd];
+  if ((what & WREAD) && w->reader != NULL) {
+    Task *task = w->reader;
+    w->reader = NULL;
+    S->nwaits--;
+    if (task->status == TBLOCKED && task->waitid == w->rid)
+      wakeup(S, task, 1);
+    unpin(S, task);
+  }
+  if ((what & WWRITE) && w->writer != NULL) {
+    Task *task = w->writer;
+    w->writer = NULL;
+    S->nwaits--;
+    if (task->status == TBLOCKED && task->waitid == w->wid)
+      wakeup(S, task, 1);
+    unpin(S, task);
+  }
+  if (w->reader != NULL || w->writer != NULL)  /* others still waiting? */
+    ev_arm(S, fd, (w->reader ? WREAD : 0) | (w->writer ? WWRITE : 0));
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Library functions
+** =======================================================
+*/
+
+#define tosched(L)	((Sched *)lua_touserdata(L, lua_upvalueindex(1)))
+
+
+/* check that the caller is the running task, and return it */
+static Task *checktask (lua_State *L, Sched *S) {
+  if (S->current == NULL || S->current->co != L)
+    luaL_error(L, "not inside a task of the scheduler");
+  return S->current;
+}
+
+
+/* check that the caller is the running task, and start a new wait */
+static Task *newwait (lua_State *L, Sched *S) {
+  Task *task = checktask(L, S);
+  task->waitid++;  /* timers and descriptors from old waits are stale */
+  return task;
+}
+
+
+/* block the running task in its current wait */
+static int block (lua_State *L, Task *task) {
+  task->status = TBLOCKED;
+  return lua_yield(L, 0);
+}
+
+
+static int sch_spawn (lua_State *L) {
+  Sched *S = tosched(L);
+  int n = lua_gettop(L);
+  lua_State *co;
+  Task *task;
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  checkready(L, S);  /* ensure space for the new task */
+  task = (Task *)malloc(sizeof(Task));
+  if (task == NULL)
+    return luaL_error(L, "not enough memory");
+  memset(task, 0, sizeof(Task));
+  task->status = TDEAD;  /* until it is complete */
+  task->next = S->tasks;  /* link it in the list of tasks */
+  if (S->tasks) S->tasks->prev = task;
+  S->tasks = task;
+  co = lua_newthread(L);
+  lua_insert(L, 1);  /* put thread below function and arguments */
+  lua_xmove(L, co, n);  /* move function and arguments to new thread */
+  lua_getuservalue(L, lua_upvalueindex(1));  /* table of live tasks */
+  lua_pushvalue(L, 1);
+  lua_rawsetp(L, -2, task);  /* anchor thread */
+  lua_pop(L, 1);
+  task->co = co;
+  task->sched = S;
+  task->nargs = n - 1;
+  task->result = -1;
+  task->waitfd = -1;
+  S->ntasks++;
+  enqueue(S, task, 0);
+  return 1;  /* return the thread */
+}
+
+
+static int sch_sleep (lua_State *L) {
+  Sched *S = tosched(L);
+  lua_Number t = luaL_checknumber(L, 1);
+  Task *task = newwait(L, S);
+  addtimer(L, S, task, gettime() + t);
+  return block(L, task);
+}
+
+
+static int sch_yield (lua_State *L) {
+  checktask(L, tosched(L));
+  return lua_yield(L, 0);
+}
+
+
+static int getfd (lua_State *L, int arg) {
+  luaL_Stream *p = (luaL_Stream *)luaL_testudata(L, arg, LUA_FILEHANDLE);
+  if (p != NULL) {
+    luaL_argcheck(L, p->closef != NULL, arg, "attempt to use a closed file");
+#if defined(LUA_USE_POSIX)
+    return fileno(p->f);
+#else
+    return luaL_argerror(L, arg, "files cannot be waited for");
+#endif
+  }
+  else {
+    lua_Integer fd = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, 0 <= fd && fd < INT_MAX, arg, "invalid descriptor");
+    return (int)fd;
+  }
+}
+
+
+static int sch_wait (lua_State *L) {
+  static const char *const modes[] = {"r", "w", NULL};
+  Sched *S = tosched(L);
+  int fd = getfd(L, 1);
+  int what = (luaL_checkoption(L, 2, "r", modes) == 0) ? WREAD : WWRITE;
+  lua_Number timeout = luaL_optnumber(L, 3, -1);
+  Task *task = newwait(L, S);
+  FdWait *w = getfdwait(L, S, fd);
+  int err;
+  if ((what == WREAD) ? w->reader != NULL : w->writer != NULL)
+    return luaL_error(L, "another task is waiting for this descriptor");
+  if (timeout >= 0)
+    addtimer(L, S, task, gettime() + timeout);
+  if (what == WREAD) { w->reader = task; w->rid = task->waitid; }
+  else { w->writer = task; w->wid = task->waitid; }
+  task->pins++;
+  task->waitfd = fd;
+  S->nwaits++;
+  err = ev_arm(S, fd, (w->reader ? WREAD : 0) | (w->writer ? WWRITE : 0));
+  if (err != 0) {
+    clearwait(S, task, fd);
+    task->waitid++;  /* cancel timer */
+    task->waitfd = -1;  /* not waiting */
+    if (err == EPERM) {  /* regular file? */
+      lua_pushboolean(L, 1);  /* always ready */
+      return 1;
+    }
+    return luaL_error(L, "cannot wait for descriptor %d (%s)", fd,
+                         strerror(err));
+  }
+  return block(L, task);
+}
+
+
+static int sch_now (lua_State *L) {
+  lua_pushnumber(L, (lua_Number)gettime());
+  return 1;
+}
+
+
+static int sch_count (lua_State *L) {
+  lua_pushinteger(L, tosched(L)->ntasks);
+  return 1;
+}
+
+
+/* the file operation that 'waiter' (a task) waits for is complete */
+static void iowake (void *waiter) {
+  Task *task = (Task *)waiter;
+  Sched *S = task->sched;
+  task->iowait = 0;
+  if (S == NULL) {  /* scheduler already collected? */
+    free(task);
+    return;
+  }
+  S->niowaits--;
+  wakeup(S, task, -1);
+  unpin(S, task);
+}
+
+
+/* does the task (just yielded) wait for a channel operation? */
+static int chanyield (lua_State *co) {
+  return (lua_gettop(co) == 2 && lua_type(co, 2) == LUA_TSTRING &&
+          luaL_testudata(co, 1, CHANNEL) != NULL);
+}
+
+
+static void killtask (lua_State *L, Sched *S, Task *task, int anchors) {
+  task->status = TDEAD;
+  S->ntasks--;
+  lua_pushnil(L);
+  lua_rawsetp(L, anchors, task);  /* release its thread */
+  if (task->pins == 0)
+    freetask(S, task);
+}
+
+
+static void resumetask (lua_State *L, Sched *S, Task *task, int anchors) {
+  lua_State *co = task->co;
+  int nargs = task->nargs;
+  int status;
+  if (task->result >= 0) {  /* returning from 'sched.wait'? */
+    lua_pushboolean(co, task->result);
+    nargs = 1;
+    task->result = -1;
+  }
+  task->nargs = 0;
+  S->current = task;
+  status = lua_resume(co, L, nargs);
+  S->current = NULL;
+  if (status == LUA_YIELD) {
+    if (task->status == TREADY) {  /* not blocked? */
+      if (luaIO_setwaiter(co, iowake, task)) {  /* waits for a file? */
+        task->status = TBLOCKED;
+        task->iowait = 1;
+        task->pins++;
+        S->niowaits++;
+      }
+      else {
+        int retry = chanyield(co);
+        enqueue(S, task, retry);  /* go back to the queue */
+      }
+    }
+    lua_settop(co, 0);  /* ignore yielded values */
+  }
+  else {
+    if (status != LUA_OK)
+      lua_xmove(co, L, 1);  /* move error message */
+    killtask(L, S, task, anchors);
+    if (status != LUA_OK)
+      lua_error(L);  /* propagate error */
+  }
+}
+
+
+/* watch the descriptor signaled by completed file operations */
+static void armio (lua_State *L, Sched *S) {
+  int fd = luaIO_asyncfd(L);
+  if (fd >= 0) {
+    getfdwait(L, S, fd);
+    ev_arm(S, fd, WREAD);
+  }
+}
+
+
+static int runloop (lua_State *L) {
+  Sched *S = (Sched *)lua_touserdata(L, 1);
+  lua_getuservalue(L, 1);  /* table of live tasks at index 2 */
+  while (S->ntasks > 0) {
+    int n;
+    double timeout;
+    firetimers(S);
+    if (S->niowaits > 0)
+      luaIO_complete(L);
+    if (S->rcount > S->nretry)  /* some task ready to run? */
+      timeout = 0;
+    else if (S->ntimers > 0) {
+      timeout = S->timers[0].when - gettime();
+      if (timeout < 0) timeout = 0;
+      if (S->rcount > 0 && timeout > SCHED_RETRYTIME)
+        timeout = SCHED_RETRYTIME;
+    }
+    else if (S->rcount > 0)  /* only tasks waiting for channels */
+      timeout = SCHED_RETRYTIME;
+    else if (S->nwaits > 0 || S->niowaits > 0)
+      timeout = -1;  /* wait for descriptors or file operations */
+    else
+      break;  /* nothing else can happen */
+    if (S->nwaits > 0 || S->niowaits > 0 || timeout != 0) {
+      if (S->niowaits > 0)
+        armio(L, S);
+      ev_poll(S, timeout);
+      firetimers(S);
+      if (S->niowaits > 0)
+        luaIO_complete(L);
+    }
+    for (n = S->rcount; n > 0; n--)  /* tasks ready at this point */
+      resumetask(L, S, dequeue(S), 2);
+  }
+  return 0;
+}
+
+
+static int sch_run (lua_State *L) {
+  Sched *S = tosched(L);
+  int status;
+  if (S->running)
+    return luaL_error(L, "scheduler is already running");
+  lua_settop(L, 0);
+  lua_pushcfunction(L, runloop);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  S->running = 1;
+  status = lua_pcall(L, 1, 0, 0);
+  S->running = 0;
+  if (status != LUA_OK)
+    return lua_error(L);
+  return 0;
+}
+
+
+static int sch_gc (lua_State *L) {
+  Sched *S = (Sched *)luaL_checkudata(L, 1, SCHED);
+  while (S->tasks != NULL) {
+    Task *task = S->tasks;
+    if (task->iowait) {  /* a file operation still refers to it? */
+      S->tasks = task->next;
+      if (S->tasks) S->tasks->prev = NULL;
+      task->sched = NULL;  /* 'iowake' will free it */
+    }
+    else
+      freetask(S, task);
+  }
+  free(S->ready);
+  free(S->timers);
+  free(S->fds);
+  ev_close(S);
+  S->ready = NULL; S->timers = NULL; S->fds = NULL;
+  return 0;
+}
+
+
+static const luaL_Reg sch_funcs[] = {
+  {"count", sch_count},
+  {"now", sch_now},
+  {"run", sch_run},
+  {"sleep", sch_sleep},
+  {"spawn", sch_spawn},
+  {"wait", sch_wait},
+  {"yield", sch_yield},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_sched (lua_State *L) {
+  Sched *S;
+  luaL_newlibtable(L, sch_funcs);
+  S = (Sched *)lua_newuserdata(L, sizeof(Sched));
+  memset(S, 0, sizeof(Sched));
+  S->evfd = -1;
+  luaL_newmetatable(L, SCHED);
+  lua_pushcfunction(L, sch_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  lua_newtable(L);  /* table of live tasks */
+  lua_setuservalue(L, -2);
+  if (ev_open(S) < 0)
+    return luaL_error(L, "cannot create event loop (%s)", strerror(errno));
+  luaL_setfuncs(L, sch_funcs, 1);  /* scheduler is an upvalue */
+  return 1;
+}
+
+/* }====================================================== */
+
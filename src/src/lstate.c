@@ -148,13 +148,77 @@ void luaE_shrinkCI (lua_State *L) {
 }
 
 
-static void stack_init (lua_State *L1, lua_State *L) {
+#if defined(LUA_USE_THREADS)
+/*
+** {==================================================================
+** Global lock, used when several system threads share a state.
+** Threads waiting for the lock are counted, so that a thread running
+** Lua code can give way to them at the points where the VM calls
+** 'luai_threadyield' (and only when there is someone waiting).
+** ===================================================================
+*/
+
+#include <sched.h>
+
+void luaE_initlock (lua_State *L) {
+  global_State *g = G(L);
+  pthread_mutex_init(&g->lock, NULL);
+  g->lockwaiters = 0;
+  g->lockturn = 0;
+}
+
+
+/* called by 'lua_close', with the lock held */
+void luaE_freelock (lua_State *L) {
+  pthread_mutex_unlock(&G(L)->lock);
+  pthread_mutex_destroy(&G(L)->lock);
+}
+
+
+void luaE_lock (lua_State *L) {
+  global_State *g = G(L);
+  if (pthread_mutex_trylock(&g->lock) != 0) {  /* lock is busy? */
+    __atomic_add_fetch(&g->lockwaiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&g->lock);
+    __atomic_sub_fetch(&g->lockwaiters, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&g->lockturn, g->lockturn + 1, __ATOMIC_RELAXED);
+}
+
+
+void luaE_unlock (lua_State *L) {
+  pthread_mutex_unlock(&G(L)->lock);
+}
+
+
+/*
+** If there are threads waiting for the lock, release it and wait until
+** one of them gets it; otherwise, a thread running a long loop would
+** get the lock again before any waiting thread could wake up.
+*/
+void luaE_threadyield (lua_State *L) {
+  global_State *g = G(L);
+  if (__atomic_load_n(&g->lockwaiters, __ATOMIC_RELAXED) > 0) {
+    unsigned int turn = g->lockturn;
+    pthread_mutex_unlock(&g->lock);
+    while (__atomic_load_n(&g->lockturn, __ATOMIC_RELAXED) == turn &&
+           __atomic_load_n(&g->lockwaiters, __ATOMIC_RELAXED) > 0)
+      sched_yield();
+    luaE_lock(L);
+  }
+}
+
+/* }================================================================== */
+#endif
+
+
+/*
+** erase the stack of a thread and build its first CallInfo
+*/
+static void resetstack (lua_State *L1) {
   int i; CallInfo *ci;
-  /* initialize stack array */
-  L1->stack = luaM_newvector(L, BASIC_STACK_SIZE, TValue);
-  L1->stacksize = BASIC_STACK_SIZE;
-  for (i = 0; i < BASIC_STACK_SIZE; i++)
-    setnilvalue(L1->stack + i);  /* erase new stack */
+  for (i = 0; i < L1->stacksize; i++)
+    setnilvalue(L1->stack + i);  /* erase stack */
   L1->top = L1->stack;
   L1->stack_last = L1->stack + L1->stacksize - EXTRA_STACK;
   /* initialize first ci */
@@ -168,6 +232,14 @@ static void stack_init (lua_State *L1, lua_State *L) {
 }
 
 
+static void stack_init (lua_State *L1, lua_State *L) {
+  /* initialize stack array */
+  L1->stack = luaM_newvector(L, BASIC_STACK_SIZE, TValue);
+  L1->stacksize = BASIC_STACK_SIZE;
+  resetstack(L1);
+}
+
+
 static void freestack (lua_State *L) {
   if (L->stack == NULL)
     return;  /* stack not completely built yet */
@@ -239,13 +311,31 @@ static void preinit_thread (lua_State *L, global_State *g) {
 }
 
 
+/*
+** free the dead threads kept for reuse
+*/
+static void freethreadpool (lua_State *L) {
+  global_State *g = G(L);
+  while (g->threadpool != NULL) {
+    lua_State *L1 = gco2th(g->threadpool);
+    g->threadpool = L1->next;
+    freestack(L1);
+    luaM_free(L, fromstate(L1));
+  }
+  g->nthreadpool = 0;
+}
+
+
 static void close_state (lua_State *L) {
   global_State *g = G(L);
   luaF_close(L, L->stack);  /* close all upvalues for this thread */
   luaC_freeallobjects(L);  /* collect all objects */
+  freethreadpool(L);  /* ...including threads freed by the collection */
   if (g->version)  /* closing a fully built state? */
     luai_userstateclose(L);
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
+  luaM_freearray(L, G(L)->strt.old, G(L)->strt.oldsize);
+  luaM_freearray(L, G(L)->frozenstrt.hash, G(L)->frozenstrt.size);
   freestack(L);
   lua_assert(gettotalbytes(g) == sizeof(LG));
   (*g->frealloc)(g->ud, fromstate(L), sizeof(LG), 0);  /* free main block */
@@ -255,10 +345,19 @@ static void close_state (lua_State *L) {
 LUA_API lua_State *lua_newthread (lua_State *L) {
   global_State *g = G(L);
   lua_State *L1;
+  StkId stack = NULL;  /* stack of a reused thread */
+  int stacksize = 0;
   lua_lock(L);
   luaC_checkGC(L);
-  /* create new thread */
-  L1 = &cast(LX *, luaM_newobject(L, LUA_TTHREAD, sizeof(LX)))->l;
+  if (g->threadpool != NULL) {  /* reuse a dead thread? */
+    L1 = gco2th(g->threadpool);
+    g->threadpool = L1->next;
+    g->nthreadpool--;
+    stack = L1->stack;
+    stacksize = L1->stacksize;
+  }
+  else  /* create new thread */
+    L1 = &cast(LX *, luaM_newobject(L, LUA_TTHREAD, sizeof(LX)))->l;
   L1->marked = luaC_white(g);
   L1->tt = LUA_TTHREAD;
   /* link it on list 'allgc' */
@@ -276,23 +375,50 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
   memcpy(lua_getextraspace(L1), lua_getextraspace(g->mainthread),
          LUA_EXTRASPACE);
   luai_userstatethread(L, L1);
-  stack_init(L1, L);  /* init stack */
+  if (stack != NULL) {  /* reused thread? */
+    L1->stack = stack;
+    L1->stacksize = stacksize;
+    resetstack(L1);
+  }
+  else
+    stack_init(L1, L);  /* init stack */
   lua_unlock(L);
   return L1;
 }
 
 
+/*
+** Free a thread or, if its stack is small enough and the pool is not
+** full, keep it in 'g->threadpool' to be reused by 'lua_newthread'.
+** A kept thread keeps only its stack array; 'lua_newthread' erases it.
+*/
 void luaE_freethread (lua_State *L, lua_State *L1) {
+  global_State *g = G(L);
   LX *l = fromstate(L1);
   luaF_close(L1, L1->stack);  /* close all upvalues for this thread */
   lua_assert(L1->openupval == NULL);
   luai_userstatefree(L, L1);
-  freestack(L1);
-  luaM_free(L, l);
+  if (g->nthreadpool < LUAI_MAXTHREADPOOL && L1->stack != NULL &&
+      L1->stacksize <= POOL_STACK_SIZE) {
+    L1->ci = &L1->base_ci;  /* free the entire 'ci' list */
+    luaE_freeCI(L1);
+    L1->next = g->threadpool;
+    g->threadpool = obj2gco(L1);
+    g->nthreadpool++;
+  }
+  else {
+    freestack(L1);
+    luaM_free(L, l);
+  }
 }
 
 
-LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
+/*
+** Create a new state. If 'sg' is not NULL, the new state shares the
+** frozen heap owned by 'sg'; as frozen strings are already hashed, it
+** must use the same seed as the owner.
+*/
+static lua_State *newstate (lua_Alloc f, void *ud, global_State *sg) {
   int i;
   lua_State *L;
   global_State *g;
@@ -308,17 +434,25 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->frealloc = f;
   g->ud = ud;
   g->mainthread = L;
-  g->seed = makeseed(L);
+  g->seed = (sg != NULL) ? sg->seed : makeseed(L);
+  g->sharedg = sg;
+  g->heapsealed = 0;
   g->gcrunning = 0;  /* no GC while building state */
   g->GCestimate = 0;
   g->strt.size = g->strt.nuse = 0;
-  g->strt.hash = NULL;
+  g->strt.oldsize = g->strt.nmoved = 0;
+  g->strt.hash = g->strt.old = NULL;
+  g->frozenstrt.size = g->frozenstrt.nuse = 0;
+  g->frozenstrt.oldsize = g->frozenstrt.nmoved = 0;
+  g->frozenstrt.hash = g->frozenstrt.old = NULL;
   setnilvalue(&g->l_registry);
   g->panic = NULL;
   g->version = NULL;
   g->gcstate = GCSpause;
   g->gckind = KGC_NORMAL;
-  g->allgc = g->finobj = g->tobefnz = g->fixedgc = NULL;
+  g->allgc = g->finobj = g->tobefnz = g->fixedgc = g->frozengc = NULL;
+  g->threadpool = NULL;
+  g->nthreadpool = 0;
   g->sweepgc = NULL;
   g->gray = g->grayagain = NULL;
   g->weak = g->ephemeron = g->allweak = NULL;
@@ -338,6 +472,24 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
 }
 
 
+LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
+  return newstate(f, ud, NULL);
+}
+
+
+/*
+** Create a new state that shares the frozen heap used by 'L'. After
+** that, the heap cannot get new objects; its owner must be closed only
+** after all states sharing it.
+*/
+LUA_API lua_State *lua_newsharedstate (lua_Alloc f, void *ud, lua_State *L) {
+  global_State *sg = G(L)->sharedg;
+  api_check(L, sg != NULL, "state has no frozen heap");
+  sg->heapsealed = 1;
+  return newstate(f, ud, sg);
+}
+
+
 LUA_API void lua_close (lua_State *L) {
   L = G(L)->mainthread;  /* only the main thread can be closed */
   lua_lock(L);
@@ -25,7 +25,9 @@
 ** 'finobj': all objects marked for finalization;
 ** 'tobefnz': all objects ready to be finalized;
 ** 'fixedgc': all objects that are not to be collected (currently
-** only small strings, such as reserved words).
+** only small strings, such as reserved words);
+** 'frozengc': all frozen objects, which are immutable, never collected,
+** and may be shared with other states (see 'lua_freeze').
 **
 ** Moreover, there is another set of lists that control gray objects.
 ** These lists are linked by fields 'gclist'. (All objects that
@@ -65,7 +67,26 @@ struct lua_longjmp;  /* defined in ldo.c */
 #define EXTRA_STACK   5
 
 
+/*
+** initial size of the stack of a thread; it must be at least
+** LUA_MINSTACK + EXTRA_STACK + 1, as the first CallInfo of a thread
+** needs LUA_MINSTACK free slots
+*/
+#if !defined(BASIC_STACK_SIZE)
 #define BASIC_STACK_SIZE        (2*LUA_MINSTACK)
+#endif
+
+
+/*
+** maximum number of dead threads kept for reuse by 'lua_newthread'
+** (0 disables the pool); only threads whose stacks did not grow beyond
+** POOL_STACK_SIZE are kept
+*/
+#if !defined(LUAI_MAXTHREADPOOL)
+#define LUAI_MAXTHREADPOOL	64
+#endif
+
+#define POOL_STACK_SIZE		(4*BASIC_STACK_SIZE)
 
 
 /* kinds of Garbage Collection */
@@ -75,8 +96,11 @@ struct lua_longjmp;  /* defined in ldo.c */
 
 typedef struct stringtable {
   TString **hash;
+  TString **old;  /* buckets not yet moved to 'hash' during a resize */
   int nuse;  /* number of elements */
   int size;
+  int oldsize;  /* size of 'old' (0 when not resizing) */
+  int nmoved;  /* number of buckets of 'old' already moved */
 } stringtable;
 
 
@@ -142,12 +166,14 @@ typedef struct global_State {
   lu_mem GCmemtrav;  /* memory traversed by the GC */
   lu_mem GCestimate;  /* an estimate of the non-garbage memory in use */
   stringtable strt;  /* hash table for strings */
+  stringtable frozenstrt;  /* hash table for frozen short strings */
   TValue l_registry;
   unsigned int seed;  /* randomized seed for hashes */
   lu_byte currentwhite;
   lu_byte gcstate;  /* state of garbage collector */
   lu_byte gckind;  /* kind of GC running */
   lu_byte gcrunning;  /* true if GC is running */
+  lu_byte heapsealed;  /* true if frozen heap is shared with other states */
   GCObject *allgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* current position of sweep in list */
   GCObject *finobj;  /* list of collectable objects with finalizers */
@@ -158,6 +184,10 @@ typedef struct global_State {
   GCObject *allweak;  /* list of all-weak tables */
   GCObject *tobefnz;  /* list of userdata to be GC */
   GCObject *fixedgc;  /* list of objects not to be collected */
+  GCObject *frozengc;  /* list of frozen objects */
+  GCObject *threadpool;  /* list of dead threads kept for reuse */
+  int nthreadpool;  /* number of threads in 'threadpool' */
+  struct global_State *sharedg;  /* owner of the frozen heap in use */
   struct lua_State *twups;  /* list of threads with open upvalues */
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
@@ -169,6 +199,11 @@ typedef struct global_State {
   TString *tmname[TM_N];  /* array with tag-method names */
   struct Table *mt[LUA_NUMTAGS];  /* metatables for basic types */
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
+#if defined(LUA_USE_THREADS)
+  pthread_mutex_t lock;  /* global lock (see 'lua_lock') */
+  int lockwaiters;  /* number of threads waiting for the lock */
+  unsigned int lockturn;  /* number of times the lock was acquired */
+#endif
 } global_State;
 
 
@@ -248,6 +283,14 @@ LUAI_FUNC CallInfo *luaE_extendCI (lua_State *L);
 LUAI_FUNC void luaE_freeCI (lua_State *L);
 LUAI_FUNC void luaE_shrinkCI (lua_State *L);
 
+#if defined(LUA_USE_THREADS)
+LUAI_FUNC void luaE_initlock (lua_State *L);
+LUAI_FUNC void luaE_freelock (lua_State *L);
+LUAI_FUNC void luaE_lock (lua_State *L);
+LUAI_FUNC void luaE_unlock (lua_State *L);
+LUAI_FUNC void luaE_threadyield (lua_State *L);
+#endif
+
 
 #endif
 
@@ -26,11 +26,11 @@
 
 
 /*
-** Lua will use at most ~(2^LUAI_HASHLIMIT) bytes from a string to
-** compute its hash
+** Strings are hashed a word (4 bytes) at a time; define LUAI_BYTEHASH
+** to use the original hash, one byte at a time.
 */
-#if !defined(LUAI_HASHLIMIT)
-#define LUAI_HASHLIMIT		5
+#if !defined(LUAI_BYTEHASH) && LUAI_BITSINT != 32
+#define LUAI_BYTEHASH	/* word hash needs 32-bit 'int's */
 #endif
 
 
@@ -46,19 +46,102 @@ int luaS_eqlngstr (TString *a, TString *b) {
 }
 
 
+#if defined(LUAI_BYTEHASH)	/* { */
+
 unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
   unsigned int h = seed ^ cast(unsigned int, l);
-  size_t step = (l >> LUAI_HASHLIMIT) + 1;
-  for (; l >= step; l -= step)
+  for (; l > 0; l--)
     h ^= ((h<<5) + (h>>2) + cast_byte(str[l - 1]));
   return h;
 }
 
+#define hashlong(str,l,seed)	luaS_hash(str, l, seed)
+
+#else				/* }{ */
+
+/*
+** MurmurHash3 (x86, 32 bits). Words are read with 'memcpy', which
+** compilers turn into single (possibly unaligned) loads.
+*/
+
+#define rotl32(x,n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+#define mixword(k)  \
+	((k) *= 0xcc9e2d51u, (k) = rotl32(k, 15), (k) *= 0x1b873593u)
+
+
+unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
+  unsigned int h = seed ^ cast(unsigned int, l);
+  unsigned int k;
+  size_t n = l;
+  for (; n >= 4; n -= 4, str += 4) {
+    memcpy(&k, str, 4);
+    mixword(k);
+    h ^= k;
+    h = rotl32(h, 13);
+    h = h * 5 + 0xe6546b64u;
+  }
+  if (n > 0) {  /* remaining bytes */
+    k = 0;
+    switch (n) {
+      case 3:
+        k ^= cast(unsigned int, cast_byte(str[2])) << 16;
+        /* FALLTHROUGH */
+      case 2:
+        k ^= cast(unsigned int, cast_byte(str[1])) << 8;
+        /* FALLTHROUGH */
+      default:
+        k ^= cast_byte(str[0]);
+    }
+    mixword(k);
+    h ^= k;
+  }
+  /* final avalanche */
+  h ^= cast(unsigned int, l);
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+
+/*
+** Long strings are hashed over their whole contents, as keys that
+** differ only in a few bytes (URLs, paths, ...) are common. Blocks of
+** 16 bytes feed four independent lanes, so that the multiplications
+** of consecutive words overlap (or vectorize); the lanes are then
+** merged into the seed of the hash of the remaining bytes.
+*/
+static unsigned int hashlong (const char *str, size_t l, unsigned int seed) {
+  unsigned int h[4];
+  int i;
+  for (i = 0; i < 4; i++)
+    h[i] = seed + cast(unsigned int, i) * 0x9e3779b9u;
+  for (; l >= 16; l -= 16, str += 16) {
+    unsigned int k[4];
+    memcpy(k, str, 16);
+    for (i = 0; i < 4; i++) {
+      mixword(k[i]);
+      h[i] ^= k[i];
+      h[i] = rotl32(h[i], 13);
+      h[i] = h[i] * 5 + 0xe6546b64u;
+    }
+  }
+  seed = rotl32(h[0], 1) + rotl32(h[1], 7) + rotl32(h[2], 12) +
+         rotl32(h[3], 18);
+  return luaS_hash(str, l, seed);
+}
+
+#endif				/* } */
+
 
 unsigned int luaS_hashlongstr (TString *ts) {
   lua_assert(ts->tt == LUA_TLNGSTR);
   if (ts->extra == 0) {  /* no hash? */
-    ts->hash = luaS_hash(getstr(ts), ts->u.lnglen, ts->hash);
+    size_t l = ts->u.lnglen;
+    ts->hash = hashlong(getstr(ts), l, ts->hash ^ cast(unsigned int, l));
     ts->extra = 1;  /* now it has its hash */
   }
   return ts->hash;
@@ -66,11 +149,80 @@ unsigned int luaS_hashlongstr (TString *ts) {
 
 
 /*
-** resizes the string table
+** Number of buckets moved by each access to a string table that is
+** being resized. It must be at least 1, so that a resize ends before
+** the table fills up again.
+*/
+#if !defined(STRTSTEP)
+#define STRTSTEP	4
+#endif
+
+
+/*
+** list where a string with hash 'h' is (or should be) in table 'tb'
+*/
+static TString **strtlist (stringtable *tb, unsigned int h) {
+  if (tb->old != NULL) {  /* resizing? */
+    int i = lmod(h, tb->oldsize);
+    if (i >= tb->nmoved)  /* bucket not moved yet? */
+      return &tb->old[i];
+  }
+  return &tb->hash[lmod(h, tb->size)];
+}
+
+
+/*
+** moves up to 'n' buckets of a table being resized to its new array;
+** frees the old array after moving its last bucket. Old bucket 'i'
+** splits into new buckets 'i' and 'i + oldsize', which are only used
+** after the move and so are cleared only then.
+*/
+static void movebuckets (lua_State *L, stringtable *tb, int n) {
+  lua_assert(tb->old != NULL && tb->size == tb->oldsize * 2);
+  for (; n > 0 && tb->nmoved < tb->oldsize; n--) {
+    TString *p = tb->old[tb->nmoved];
+    tb->hash[tb->nmoved] = tb->hash[tb->nmoved + tb->oldsize] = NULL;
+    tb->nmoved++;
+    while (p) {  /* for each node in the list */
+      TString *hnext = p->u.hnext;  /* save next */
+      unsigned int h = lmod(p->hash, tb->size);  /* new position */
+      p->u.hnext = tb->hash[h];  /* chain it */
+      tb->hash[h] = p;
+      p = hnext;
+    }
+  }
+  if (tb->nmoved == tb->oldsize) {  /* all buckets moved? */
+    luaM_freearray(L, tb->old, tb->oldsize);
+    tb->old = NULL;
+    tb->oldsize = tb->nmoved = 0;
+  }
+}
+
+
+/*
+** doubles the size of a string table without rehashing it: its
+** buckets move to the new array a few at a time, in each later access
+** to the table (see 'internshrstr')
 */
-void luaS_resize (lua_State *L, int newsize) {
+static void growstrt (lua_State *L, stringtable *tb) {
+  TString **newhash = luaM_newvector(L, tb->size * 2, TString *);
+  if (tb->old != NULL)  /* previous resize still going? */
+    movebuckets(L, tb, tb->oldsize);  /* finish it */
+  tb->old = tb->hash;
+  tb->oldsize = tb->size;
+  tb->nmoved = 0;
+  tb->hash = newhash;
+  tb->size *= 2;
+}
+
+
+/*
+** resizes a string table at once
+*/
+void luaS_resize (lua_State *L, stringtable *tb, int newsize) {
   int i;
-  stringtable *tb = &G(L)->strt;
+  if (tb->old != NULL)  /* incremental resize going? */
+    movebuckets(L, tb, tb->oldsize);  /* finish it */
   if (newsize > tb->size) {  /* grow table if needed */
     luaM_reallocvector(L, tb->hash, tb->size, newsize, TString *);
     for (i = tb->size; i < newsize; i++)
@@ -116,7 +268,7 @@ void luaS_clearcache (global_State *g) {
 void luaS_init (lua_State *L) {
   global_State *g = G(L);
   int i, j;
-  luaS_resize(L, MINSTRTABSIZE);  /* initial size of string table */
+  luaS_resize(L, &g->strt, MINSTRTABSIZE);  /* initial size of string table */
   /* pre-create memory-error message */
   g->memerrmsg = luaS_newliteral(L, MEMERRMSG);
   luaC_fix(L, obj2gco(g->memerrmsg));  /* it should never be collected */
@@ -139,6 +291,7 @@ static TString *createstrobj (lua_State *L, size_t l, int tag, unsigned int h) {
   ts = gco2ts(o);
   ts->hash = h;
   ts->extra = 0;
+  ts->shrlen = 0;  /* not external (for 'getstr') */
   getstr(ts)[l] = '\0';  /* ending 0 */
   return ts;
 }
@@ -151,9 +304,191 @@ TString *luaS_createlngstrobj (lua_State *L, size_t l) {
 }
 
 
+/*
+** Creates a string with the contents 's', which must be followed by
+** a zero. Long strings keep using 's' until they are collected; short
+** strings are internalized as usual, so 's' is released right away.
+*/
+TString *luaS_newextstr (lua_State *L, const char *s, size_t l,
+                         lua_Alloc falloc, void *ud) {
+  if (l <= LUAI_MAXSHORTLEN) {  /* short string? */
+    TString *ts = luaS_newlstr(L, s, l);
+    if (falloc != NULL)
+      (*falloc)(ud, cast(void *, s), l + 1, 0);  /* release contents */
+    return ts;
+  }
+  else {
+    GCObject *o = luaC_newobj(L, LUA_TLNGSTR, sizeof(TExtString));
+    TExtString *ets = cast(TExtString *, gco2ts(o));
+    ets->ts.hash = G(L)->seed;
+    ets->ts.extra = 0;
+    ets->ts.shrlen = EXTSTR;
+    ets->ts.u.lnglen = l;
+    ets->contents = s;
+    ets->falloc = falloc;
+    ets->ud = ud;
+    return &ets->ts;
+  }
+}
+
+
+/*
+** Frees a long string, releasing the contents of an external one.
+*/
+void luaS_freelngstr (lua_State *L, TString *ts) {
+  if (isextstr(ts)) {
+    TExtString *ets = cast(TExtString *, ts);
+    if (ets->falloc != NULL)
+      (*ets->falloc)(ets->ud, cast(void *, ets->contents),
+                     ts->u.lnglen + 1, 0);
+    luaM_free(L, ets);
+  }
+  else
+    luaM_freemem(L, ts, sizelngstr(ts));
+}
+
+
+/*
+** {======================================================
+** Shared buffers
+** =======================================================
+*/
+
+static TStrBuf *newstrbuf (lua_State *L, size_t size) {
+  GCObject *o = luaC_newobj(L, LUA_TLNGSTR, sizestrbuf(size));
+  TStrBuf *b = cast(TStrBuf *, gco2ts(o));
+  b->ts.extra = 0;  /* strings can grow in it */
+  b->ts.shrlen = STRBUF;
+  b->ts.u.lnglen = 0;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+
+/*
+** Creates a string with the first 'l' bytes of buffer 'b', which
+** becomes the longest string in it.
+*/
+static TString *newbufstr (lua_State *L, TStrBuf *b, size_t l) {
+  GCObject *o = luaC_newobj(L, LUA_TLNGSTR, sizeof(TExtString));
+  TExtString *ets = cast(TExtString *, gco2ts(o));
+  lua_assert(l <= b->size);
+  ets->ts.hash = G(L)->seed;
+  ets->ts.extra = 0;
+  ets->ts.shrlen = BUFSTR;
+  ets->ts.u.lnglen = l;
+  ets->contents = getbuff(b);
+  ets->falloc = NULL;
+  ets->ud = b;
+  b->used = l;
+  getbuff(b)[l] = '\0';
+  return &ets->ts;
+}
+
+
+/*
+** Creates a long string with length 'l' (larger than that of 'ts')
+** whose first bytes are those of string 'ts'; the caller fills in the
+** rest. This is how concatenation creates long strings. When 'ts' is
+** the longest string in a buffer with enough room, the new string
+** takes the rest of that buffer and nothing is copied. When 'ts' is
+** itself the long result of a concatenation, the bytes go to a new
+** buffer with twice the needed size, so that a string that keeps
+** growing ('s = s .. x') is copied only a logarithmic number of times.
+** Other strings get a plain copy, so that a single concatenation
+** wastes no memory.
+** The bytes after the end of 'ts' in its buffer then belong to the new
+** string, so 'ts' loses its terminating zero. Internal uses of strings
+** respect their lengths, the C API gets a zero through 'luaS_seal', and
+** conversions to numbers add a zero temporarily (see 'l_strton').
+*/
+TString *luaS_extend (lua_State *L, TString *ts, size_t l) {
+  size_t len = tsslen(ts);
+  TString *res;
+  lua_assert(len < l && l > LUAI_MAXSHORTLEN);
+  if (isbufstr(ts) && len == strbuf(ts)->used && !strbuf(ts)->ts.extra) {
+    TStrBuf *b = strbuf(ts);  /* 'ts' can grow in its buffer */
+    if (l <= b->size)  /* enough room? */
+      return newbufstr(L, b, l);  /* buffer stays alive through 'ts' */
+  }
+  else if (ts->shrlen != CATSTR) {  /* not a growing string? */
+    res = luaS_createlngstrobj(L, l);
+    res->shrlen = CATSTR;
+    memcpy(getstr(res), getstr(ts), len * sizeof(char));
+    return res;
+  }
+  {  /* move the bytes to a new buffer */
+    size_t size = (l < (MAX_SIZE - sizeof(TStrBuf)) / 2) ? l * 2 : l;
+    TStrBuf *b = newstrbuf(L, size);
+    memcpy(getbuff(b), getstr(ts), len * sizeof(char));
+    setsvalue2s(L, L->top, &b->ts);  /* anchor buffer */
+    L->top++;  /* (concatenation leaves some space over its operands) */
+    res = newbufstr(L, b, l);
+    L->top--;
+    return res;
+  }
+}
+
+
+/*
+** Makes sure that string 'ts', in a shared buffer, stays followed by a
+** zero. If the next byte belongs to a longer string, 'ts' moves to a
+** buffer of its own; otherwise, that buffer stops strings from growing
+** over the zero.
+*/
+void luaS_sealbufstr (lua_State *L, TString *ts) {
+  TStrBuf *b = strbuf(ts);
+  size_t len = ts->u.lnglen;
+  lua_assert(isbufstr(ts));
+  if (getstr(ts)[len] == '\0') {  /* still has its zero? */
+    if (len == b->used)  /* can grow over it? */
+      b->ts.extra = 1;  /* not anymore */
+  }
+  else {
+    TExtString *ets = cast(TExtString *, ts);
+    TStrBuf *nb = newstrbuf(L, len);
+    memcpy(getbuff(nb), getstr(ts), len * sizeof(char));
+    getbuff(nb)[len] = '\0';
+    nb->used = len;
+    nb->ts.extra = 1;
+    ets->contents = getbuff(nb);
+    ets->ud = nb;
+    luaC_objbarrier(L, ts, &nb->ts);
+  }
+}
+
+
+/*
+** Gives string 'ts', in a shared buffer, contents of its own, allocated
+** directly with the allocation function of the state (so that it can
+** be called while the collector is busy). 'ts' becomes an ordinary
+** external string, which never changes. Returns 0 if the allocation
+** fails.
+*/
+int luaS_detach (global_State *g, TString *ts) {
+  TExtString *ets = cast(TExtString *, ts);
+  size_t len = ts->u.lnglen;
+  char *s = cast(char *, (*g->frealloc)(g->ud, NULL, LUA_TSTRING, len + 1));
+  lua_assert(isbufstr(ts));
+  if (s == NULL)
+    return 0;
+  memcpy(s, getstr(ts), len * sizeof(char));
+  s[len] = '\0';
+  ets->contents = s;
+  ets->falloc = g->frealloc;
+  ets->ud = g->ud;
+  ts->shrlen = EXTSTR;
+  return 1;
+}
+
+/* }====================================================== */
+
+
 void luaS_remove (lua_State *L, TString *ts) {
-  stringtable *tb = &G(L)->strt;
-  TString **p = &tb->hash[lmod(ts->hash, tb->size)];
+  global_State *g = G(L);
+  stringtable *tb = isfrozen(ts) ? &g->frozenstrt : &g->strt;
+  TString **p = strtlist(tb, ts->hash);
   while (*p != ts)  /* find previous element */
     p = &(*p)->u.hnext;
   *p = (*p)->u.hnext;  /* remove element from its list */
@@ -161,15 +496,54 @@ void luaS_remove (lua_State *L, TString *ts) {
 }
 
 
+/*
+** Move a short string from the string table to the table of frozen
+** strings (which must have been already allocated).
+*/
+void luaS_freeze (lua_State *L, TString *ts) {
+  stringtable *tb = &G(L)->frozenstrt;
+  TString **list = strtlist(tb, ts->hash);
+  lua_assert(ts->tt == LUA_TSHRSTR && !isfrozen(ts));
+  luaS_remove(L, ts);
+  ts->u.hnext = *list;
+  *list = ts;
+  tb->nuse++;
+}
+
+
+/*
+** Look for a short string among the frozen strings of the heap shared
+** by this state, if any. These strings have precedence over the ones
+** in the state's own table, so that keys coming from the shared heap
+** keep being equal to the same strings created by this state.
+*/
+static TString *getfrozenstr (global_State *g, const char *str, size_t l,
+                              unsigned int h) {
+  TString *ts;
+  stringtable *tb = &g->sharedg->frozenstrt;
+  for (ts = tb->hash[lmod(h, tb->size)]; ts != NULL; ts = ts->u.hnext) {
+    if (l == ts->shrlen && (memcmp(str, getstr(ts), l * sizeof(char)) == 0))
+      return ts;
+  }
+  return NULL;
+}
+
+
 /*
 ** checks whether short string exists and reuses it or creates a new one
 */
 static TString *internshrstr (lua_State *L, const char *str, size_t l) {
   TString *ts;
   global_State *g = G(L);
+  stringtable *tb = &g->strt;
   unsigned int h = luaS_hash(str, l, g->seed);
-  TString **list = &g->strt.hash[lmod(h, g->strt.size)];
+  TString **list;
   lua_assert(str != NULL);  /* otherwise 'memcmp'/'memcpy' are undefined */
+  if (g->sharedg != NULL && (ts = getfrozenstr(g, str, l, h)) != NULL)
+    return ts;
+  if (tb->old != NULL)  /* resizing? */
+    movebuckets(L, tb, STRTSTEP);  /* do some more work */
+  list = strtlist(tb, h);
   for (ts = *list; ts != NULL; ts = ts->u.hnext) {
     if (l == ts->shrlen &&
         (memcmp(str, getstr(ts), l * sizeof(char)) == 0)) {
@@ -179,16 +553,16 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
       return ts;
     }
   }
-  if (g->strt.nuse >= g->strt.size && g->strt.size <= MAX_INT/2) {
-    luaS_resize(L, g->strt.size * 2);
-    list = &g->strt.hash[lmod(h, g->strt.size)];  /* recompute with new size */
+  if (tb->nuse >= tb->size && tb->size <= MAX_INT/2) {
+    growstrt(L, tb);
+    list = strtlist(tb, h);  /* recompute with new size */
   }
   ts = createstrobj(L, l, LUA_TSHRSTR, h);
   memcpy(getstr(ts), str, l * sizeof(char));
   ts->shrlen = cast_byte(l);
   ts->u.hnext = *list;
   *list = ts;
-  g->strt.nuse++;
+  tb->nuse++;
   return ts;
 }
 
@@ -241,6 +615,7 @@ Udata *luaS_newudata (lua_State *L, size_t s) {
   o = luaC_newobj(L, LUA_TUSERDATA, sizeludata(s));
   u = gco2u(o);
   u->len = s;
+  u->arrkind = 0;
   u->metatable = NULL;
   setuservalue(L, u, luaO_nilobject);
   return u;
@@ -14,6 +14,14 @@
 
 #define sizelstring(l)  (sizeof(union UTString) + ((l) + 1) * sizeof(char))
 
+#define sizestrbuf(l)	(sizeof(TStrBuf) + ((l) + 1) * sizeof(char))
+
+/* size of a long string object (not counting external contents) */
+#define sizelngstr(ts)  \
+	(isextstr(ts) ? sizeof(TExtString) : \
+	 (ts)->shrlen == STRBUF ? sizestrbuf(cast(TStrBuf *, (ts))->size) : \
+	 sizelstring((ts)->u.lnglen))
+
 #define sizeludata(l)	(sizeof(union UUdata) + (l))
 #define sizeudata(u)	sizeludata((u)->len)
 
@@ -33,17 +41,30 @@
 #define eqshrstr(a,b)	check_exp((a)->tt == LUA_TSHRSTR, (a) == (b))
 
 
+/*
+** make sure that string 'ts' stays followed by a zero (see 'luaS_extend')
+*/
+#define luaS_seal(L,ts)	(isbufstr(ts) ? luaS_sealbufstr(L, ts) : (void)0)
+
+
 LUAI_FUNC unsigned int luaS_hash (const char *str, size_t l, unsigned int seed);
 LUAI_FUNC unsigned int luaS_hashlongstr (TString *ts);
 LUAI_FUNC int luaS_eqlngstr (TString *a, TString *b);
-LUAI_FUNC void luaS_resize (lua_State *L, int newsize);
+LUAI_FUNC void luaS_resize (lua_State *L, stringtable *tb, int newsize);
 LUAI_FUNC void luaS_clearcache (global_State *g);
 LUAI_FUNC void luaS_init (lua_State *L);
 LUAI_FUNC void luaS_remove (lua_State *L, TString *ts);
+LUAI_FUNC void luaS_freeze (lua_State *L, TString *ts);
 LUAI_FUNC Udata *luaS_newudata (lua_State *L, size_t s);
 LUAI_FUNC TString *luaS_newlstr (lua_State *L, const char *str, size_t l);
 LUAI_FUNC TString *luaS_new (lua_State *L, const char *str);
 LUAI_FUNC TString *luaS_createlngstrobj (lua_State *L, size_t l);
+LUAI_FUNC TString *luaS_newextstr (lua_State *L, const char *s, size_t l,
+                                   lua_Alloc falloc, void *ud);
+LUAI_FUNC void luaS_freelngstr (lua_State *L, TString *ts);
+LUAI_FUNC TString *luaS_extend (lua_State *L, TString *ts, size_t l);
+LUAI_FUNC void luaS_sealbufstr (lua_State *L, TString *ts);
+LUAI_FUNC int luaS_detach (global_State *g, TString *ts);
 
 
 #endif
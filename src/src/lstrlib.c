@@ -53,7 +53,7 @@
 
 static int str_len (lua_State *L) {
   size_t l;
-  luaL_checklstring(L, 1, &l);
+  luaL_checkview(L, 1, &l);
   lua_pushinteger(L, (lua_Integer)l);
   return 1;
 }
@@ -69,7 +69,7 @@ static lua_Integer posrelat (lua_Integer pos, size_t len) {
 
 static int str_sub (lua_State *L) {
   size_t l;
-  const char *s = luaL_checklstring(L, 1, &l);
+  const char *s = luaL_checkview(L, 1, &l);
   lua_Integer start = posrelat(luaL_checkinteger(L, 2), l);
   lua_Integer end = posrelat(luaL_optinteger(L, 3, -1), l);
   if (start < 1) start = 1;
@@ -147,7 +147,7 @@ static int str_rep (lua_State *L) {
 
 static int str_byte (lua_State *L) {
   size_t l;
-  const char *s = luaL_checklstring(L, 1, &l);
+  const char *s = luaL_checkview(L, 1, &l);
   lua_Integer posi = posrelat(luaL_optinteger(L, 2, 1), l);
   lua_Integer pose = posrelat(luaL_optinteger(L, 3, posi), l);
   int n, i;
@@ -255,19 +255,20 @@ static int capture_to_close (MatchState *ms) {
 }
 
 
-static const char *classend (MatchState *ms, const char *p) {
+/* end of the single-character class at 'p', or NULL if it is malformed */
+static const char *rawclassend (const char *p, const char *p_end) {
   switch (*p++) {
     case L_ESC: {
-      if (p == ms->p_end)
-        luaL_error(ms->L, "malformed pattern (ends with '%%')");
+      if (p == p_end)
+        return NULL;
       return p+1;
     }
     case '[': {
       if (*p == '^') p++;
       do {  /* look for a ']' */
-        if (p == ms->p_end)
-          luaL_error(ms->L, "malformed pattern (missing ']')");
-        if (*(p++) == L_ESC && p < ms->p_end)
+        if (p == p_end)
+          return NULL;
+        if (*(p++) == L_ESC && p < p_end)
           p++;  /* skip escapes (e.g. '%]') */
       } while (*p != ']');
       return p+1;
@@ -279,6 +280,18 @@ static const char *classend (MatchState *ms, const char *p) {
 }
 
 
+static const char *classend (MatchState *ms, const char *p) {
+  const char *ep = rawclassend(p, ms->p_end);
+  if (ep == NULL) {
+    if (*p == L_ESC)
+      luaL_error(ms->L, "malformed pattern (ends with '%%')");
+    else
+      luaL_error(ms->L, "malformed pattern (missing ']')");
+  }
+  return ep;
+}
+
+
 static int match_class (int c, int cl) {
   int res;
   switch (tolower(cl)) {
@@ -322,19 +335,23 @@ static int matchbracketclass (int c, const char *p, const char *ec) {
 }
 
 
+/* check whether character 'c' matches the class from 'p' to 'ep' */
+static int classmatch (int c, const char *p, const char *ep) {
+  switch (*p) {
+    case '.': return 1;  /* matches any char */
+    case L_ESC: return match_class(c, uchar(*(p+1)));
+    case '[': return matchbracketclass(c, p, ep-1);
+    default:  return (uchar(*p) == c);
+  }
+}
+
+
 static int singlematch (MatchState *ms, const char *s, const char *p,
                         const char *ep) {
   if (s >= ms->src_end)
     return 0;
-  else {
-    int c = uchar(*s);
-    switch (*p) {
-      case '.': return 1;  /* matches any char */
-      case L_ESC: return match_class(c, uchar(*(p+1)));
-      case '[': return matchbracketclass(c, p, ep-1);
-      default:  return (uchar(*p) == c);
-    }
-  }
+  else
+    return classmatch(uchar(*s), p, ep);
 }
 
 
@@ -342,7 +359,7 @@ static const char *matchbalance (MatchState *ms, const char *s,
                                    const char *p) {
   if (p >= ms->p_end - 1)
     luaL_error(ms->L, "malformed pattern (missing arguments to '%%b')");
-  if (*s != *p) return NULL;
+  if (s >= ms->src_end || *s != *p) return NULL;
   else {
     int b = *p;
     int e = *(p+1);
@@ -455,14 +472,15 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
             break;
           }
           case 'f': {  /* frontier? */
-            const char *ep; char previous;
+            const char *ep; char previous, current;
             p += 2;
             if (*p != '[')
               luaL_error(ms->L, "missing '[' after '%%f' in pattern");
             ep = classend(ms, p);  /* points to what is next */
             previous = (s == ms->src_init) ? '\0' : *(s - 1);
+            current = (s < ms->src_end) ? *s : '\0';
             if (!matchbracketclass(uchar(previous), p, ep - 1) &&
-               matchbracketclass(uchar(*s), p, ep - 1)) {
+               matchbracketclass(uchar(current), p, ep - 1)) {
               p = ep; goto init;  /* return match(ms, s, ep); */
             }
             s = NULL;  /* match failed */
@@ -525,22 +543,548 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 
 
 
+
+/*
+** {======================================================
+** Compiled patterns
+** =======================================================
+*/
+
+/*
+** A pattern without errors can be compiled into an array of items,
+** which 'cmatch' runs with the same steps (and the same recursion) as
+** 'match', but without parsing the pattern again: classes become
+** bitmaps and runs of single characters become literals. A pattern
+** with errors is not compiled, so that 'match' raises them only when it
+** reaches them.
+*/
+
+/* kinds of items */
+#define PI_END		0	/* end of pattern */
+#define PI_SET		1	/* single-character class, maybe repeated */
+#define PI_LIT		2	/* sequence of characters */
+#define PI_OPEN		3	/* start of capture */
+#define PI_POSITION	4	/* position capture */
+#define PI_CLOSE	5	/* end of capture */
+#define PI_DOLLAR	6	/* end of subject */
+#define PI_BALANCE	7	/* %bxy */
+#define PI_FRONTIER	8	/* %f[set] */
+#define PI_BACKREF	9	/* %1-%9 */
+
+
+/* size of a bitmap for all characters */
+#define SETSIZE		((UCHAR_MAX + 1) / CHAR_BIT)
+
+#define testset(set,c)	((set)[(c) / CHAR_BIT] & (1 << ((c) % CHAR_BIT)))
+
+
+typedef struct PItem {
+  unsigned char kind;
+  char rep;  /* repetition ('?', '*', '+', '-') of a set, or 0 */
+  unsigned char c1, c2;  /* delimiters of a balance; capture of a backref */
+  size_t len;  /* length of a literal */
+  const unsigned char *set;  /* bitmap of a set or of a frontier */
+  const char *lit;  /* contents of a literal */
+  const unsigned char *first;  /* bitmap of first char, if item needs one */
+} PItem;
+
+
+static const char *cmatch (MatchState *ms, const char *s, const PItem *it);
+
+
+static int csinglematch (MatchState *ms, const char *s, const PItem *it) {
+  return (s < ms->src_end && testset(it->set, uchar(*s)));
+}
+
+
+/*
+** Check whether the item after 'it' can fail at 's' without further
+** work: the call for it can then be skipped, unless it would raise
+** an error for being too deep.
+*/
+static int cskip (MatchState *ms, const char *s, const PItem *it) {
+  const unsigned char *first = (it + 1)->first;
+  return (first != NULL && ms->matchdepth > 0 &&
+          (s >= ms->src_end || !testset(first, uchar(*s))));
+}
+
+
+static const char *cmax_expand (MatchState *ms, const char *s,
+                                const PItem *it) {
+  ptrdiff_t i = 0;  /* counts maximum expand for item */
+  while (csinglematch(ms, s + i, it))
+    i++;
+  /* keeps trying to match with the maximum repetitions */
+  while (i>=0) {
+    if (!cskip(ms, s + i, it)) {
+      const char *res = cmatch(ms, (s+i), it + 1);
+      if (res) return res;
+    }
+    i--;  /* else didn't match; reduce 1 repetition to try again */
+  }
+  return NULL;
+}
+
+
+static const char *cmin_expand (MatchState *ms, const char *s,
+                                const PItem *it) {
+  for (;;) {
+    const char *res;
+    if (!cskip(ms, s, it) && (res = cmatch(ms, s, it + 1)) != NULL)
+      return res;
+    else if (csinglematch(ms, s, it))
+      s++;  /* try with one more repetition */
+    else return NULL;
+  }
+}
+
+
+static const char *cstart_capture (MatchState *ms, const char *s,
+                                   const PItem *it, int what) {
+  const char *res;
+  int level = ms->level;
+  ms->capture[level].init = s;
+  ms->capture[level].len = what;
+  ms->level = level+1;
+  if ((res=cmatch(ms, s, it)) == NULL)  /* match failed? */
+    ms->level--;  /* undo capture */
+  return res;
+}
+
+
+static const char *cend_capture (MatchState *ms, const char *s,
+                                 const PItem *it) {
+  int l = capture_to_close(ms);
+  const char *res;
+  ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
+  if ((res = cmatch(ms, s, it)) == NULL)  /* match failed? */
+    ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
+  return res;
+}
+
+
+static const char *cmatch (MatchState *ms, const char *s, const PItem *it) {
+  if (ms->matchdepth-- == 0)
+    luaL_error(ms->L, "pattern too complex");
+  init: /* using goto's to optimize tail recursion */
+  switch (it->kind) {
+    case PI_END: break;
+    case PI_OPEN: {
+      s = cstart_capture(ms, s, it + 1, CAP_UNFINISHED);
+      break;
+    }
+    case PI_POSITION: {
+      s = cstart_capture(ms, s, it + 1, CAP_POSITION);
+      break;
+    }
+    case PI_CLOSE: {
+      s = cend_capture(ms, s, it + 1);
+      break;
+    }
+    case PI_DOLLAR: {
+      s = (s == ms->src_end) ? s : NULL;  /* check end of string */
+      break;
+    }
+    case PI_BALANCE: {
+      if (s < ms->src_end && uchar(*s) == it->c1) {
+        int cont = 1;
+        while (++s < ms->src_end) {
+          if (uchar(*s) == it->c2) {
+            if (--cont == 0) {
+              s++; it++; goto init;
+            }
+          }
+          else if (uchar(*s) == it->c1) cont++;
+        }
+      }
+      s = NULL;  /* string ends out of balance */
+      break;
+    }
+    case PI_FRONTIER: {
+      int previous = (s == ms->src_init) ? '\0' : uchar(*(s - 1));
+      int current = (s < ms->src_end) ? uchar(*s) : '\0';
+      if (!testset(it->set, previous) && testset(it->set, current)) {
+        it++; goto init;
+      }
+      s = NULL;  /* match failed */
+      break;
+    }
+    case PI_BACKREF: {
+      s = match_capture(ms, s, '1' + it->c1);
+      if (s != NULL) {
+        it++; goto init;
+      }
+      break;
+    }
+    case PI_LIT: {
+      if ((size_t)(ms->src_end - s) >= it->len &&
+          memcmp(s, it->lit, it->len) == 0) {
+        s += it->len; it++; goto init;
+      }
+      s = NULL;  /* fail */
+      break;
+    }
+    default: {  /* PI_SET */
+      if (!csinglematch(ms, s, it)) {
+        if (it->rep == '*' || it->rep == '?' || it->rep == '-') {
+          it++; goto init;  /* accept empty */
+        }
+        else  /* '+' or no suffix */
+          s = NULL;  /* fail */
+      }
+      else {  /* matched once */
+        switch (it->rep) {  /* handle optional suffix */
+          case '?': {  /* optional */
+            const char *res;
+            if ((res = cmatch(ms, s + 1, it + 1)) != NULL)
+              s = res;
+            else {
+              it++; goto init;
+            }
+            break;
+          }
+          case '+':  /* 1 or more repetitions */
+            s++;  /* 1 match already done */
+            /* FALLTHROUGH */
+          case '*':  /* 0 or more repetitions */
+            s = cmax_expand(ms, s, it);
+            break;
+          case '-':  /* 0 or more repetitions (minimum) */
+            s = cmin_expand(ms, s, it);
+            break;
+          default:  /* no suffix */
+            s++; it++; goto init;
+        }
+      }
+      break;
+    }
+  }
+  ms->matchdepth++;
+  return s;
+}
+
+
+/*
+** State of the compiler. It runs twice over a pattern: first only to
+** count items, bitmaps, and characters ('items' == NULL), then to fill
+** the arrays.
+*/
+typedef struct CompileState {
+  PItem *items;
+  unsigned char *sets;
+  char *lits;
+  int nitems;
+  int nsets;
+  size_t nlits;
+  PItem dummyitem;  /* item written while counting */
+  unsigned char dummyset[SETSIZE];  /* bitmap written while counting */
+} CompileState;
+
+
+static PItem *newitem (CompileState *cs, int kind) {
+  PItem *it = (cs->items != NULL) ? &cs->items[cs->nitems] : &cs->dummyitem;
+  cs->nitems++;
+  it->kind = uchar(kind);
+  it->rep = 0;
+  it->set = it->first = NULL;
+  it->lit = NULL;
+  it->len = 0;
+  return it;
+}
+
+
+static unsigned char *newset (CompileState *cs) {
+  unsigned char *set = (cs->items != NULL)
+                     ? cs->sets + (size_t)cs->nsets * SETSIZE : cs->dummyset;
+  cs->nsets++;
+  memset(set, 0, SETSIZE);
+  return set;
+}
+
+
+/*
+** Fill 'set' with the characters matched by the class from 'p' to
+** 'ep'; return how many they are, and one of them in 'c'.
+*/
+static int makeset (unsigned char *set, const char *p, const char *ep,
+                    int *c) {
+  int n = 0;
+  int i;
+  for (i = 0; i <= UCHAR_MAX; i++) {
+    if (classmatch(i, p, ep)) {
+      set[i / CHAR_BIT] |= 1 << (i % CHAR_BIT);
+      *c = i;
+      n++;
+    }
+  }
+  return n;
+}
+
+
+/* add character 'c' to the literal item 'it' (maybe a new one) */
+static void addlitchar (CompileState *cs, PItem *it, int c) {
+  if (cs->items != NULL) {
+    char *lit = cs->lits + cs->nlits;
+    *lit = (char)c;
+    if (it->len == 0) {  /* new literal? */
+      unsigned char *first = newset(cs);
+      first[c / CHAR_BIT] |= 1 << (c % CHAR_BIT);
+      it->first = first;
+      it->lit = lit;
+    }
+  }
+  else if (it->len == 0)
+    cs->nsets++;  /* count bitmap for first character */
+  it->len++;
+  cs->nlits++;
+}
+
+
+/*
+** Compile pattern 'p'. Return 0 if the pattern has an error that
+** 'match' could raise.
+*/
+static int compile (CompileState *cs, const char *p, const char *p_end) {
+  int level = 0;  /* number of captures */
+  char closed[LUA_MAXCAPTURES];  /* which captures are closed */
+  PItem *lit = NULL;  /* literal being built */
+  cs->nitems = cs->nsets = 0;
+  cs->nlits = 0;
+  while (p < p_end) {
+    PItem *it;
+    switch (*p) {
+      case '(': {  /* start capture */
+        if (level >= LUA_MAXCAPTURES)
+          return 0;  /* too many captures */
+        closed[level] = (*(p + 1) == ')');  /* position capture? */
+        newitem(cs, closed[level] ? PI_POSITION : PI_OPEN);
+        p += closed[level++] ? 2 : 1;
+        lit = NULL;
+        continue;
+      }
+      case ')': {  /* end capture */
+        int l = level - 1;
+        while (l >= 0 && closed[l]) l--;
+        if (l < 0)
+          return 0;  /* invalid pattern capture */
+        closed[l] = 1;
+        newitem(cs, PI_CLOSE);
+        p++;
+        lit = NULL;
+        continue;
+      }
+      case '$': {
+        if ((p + 1) != p_end)  /* is the '$' the last char in pattern? */
+          goto dflt;  /* no; go to default */
+        newitem(cs, PI_DOLLAR);
+        p++;
+        lit = NULL;
+        continue;
+      }
+      case L_ESC: {  /* escaped sequences not in the format class[*+?-]? */
+        switch (*(p + 1)) {
+          case 'b': {  /* balanced string? */
+            if (p + 2 >= p_end - 1)
+              return 0;  /* missing arguments to '%b' */
+            it = newitem(cs, PI_BALANCE);
+            it->c1 = uchar(*(p + 2));
+            it->c2 = uchar(*(p + 3));
+            p += 4;
+            lit = NULL;
+            continue;
+          }
+          case 'f': {  /* frontier? */
+            const char *ep;
+            unsigned char *set;
+            int c;
+            p += 2;
+            if (*p != '[' || (ep = rawclassend(p, p_end)) == NULL)
+              return 0;  /* missing or malformed set */
+            it = newitem(cs, PI_FRONTIER);
+            it->set = set = newset(cs);
+            makeset(set, p, ep, &c);
+            p = ep;
+            lit = NULL;
+            continue;
+          }
+          case '0': case '1': case '2': case '3':
+          case '4': case '5': case '6': case '7':
+          case '8': case '9': {  /* capture results (%0-%9)? */
+            int l = uchar(*(p + 1)) - '1';
+            if (l < 0 || l >= level || !closed[l])
+              return 0;  /* invalid capture index */
+            it = newitem(cs, PI_BACKREF);
+            it->c1 = uchar(l);
+            p += 2;
+            lit = NULL;
+            continue;
+          }
+          default: goto dflt;
+        }
+      }
+      default: dflt: {  /* pattern class plus optional suffix */
+        const char *ep = rawclassend(p, p_end);
+        unsigned char set[SETSIZE];
+        int c;
+        char rep = 0;
+        if (ep == NULL)
+          return 0;  /* malformed class */
+        if (*ep == '?' || *ep == '*' || *ep == '+' || *ep == '-')
+          rep = *ep;
+        memset(set, 0, SETSIZE);
+        if (makeset(set, p, ep, &c) == 1 && rep == 0) {  /* single char.? */
+          if (lit == NULL)
+            lit = newitem(cs, PI_LIT);
+          addlitchar(cs, lit, c);
+          p = ep;
+          continue;
+        }
+        it = newitem(cs, PI_SET);
+        it->rep = rep;
+        it->set = (const unsigned char *)memcpy(newset(cs), set, SETSIZE);
+        if (rep == 0 || rep == '+')  /* item needs a character? */
+          it->first = it->set;
+        p = ep + (rep != 0);
+        lit = NULL;
+        continue;
+      }
+    }
+  }
+  newitem(cs, PI_END);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** Data for the Two-Way string matching algorithm (Crochemore and
+** Perrin): the needle is split at its critical position 'crit'; when
+** it is periodic, with period 'period', a shift by the period keeps its
+** first 'mem0' bytes matched.
+*/
+typedef struct TwoWay {
+  size_t crit;
+  size_t period;
+  size_t mem0;
+} TwoWay;
+
+
+/*
+** Start of the maximal suffix of 'x' (of length 'n') in lexicographical
+** order ('rev' == 0) or reverse order ('rev' == 1), and its period.
+*/
+static size_t maxsuffix (const char *x, size_t n, int rev, size_t *period) {
+  size_t i = 0;  /* start of maximal suffix found so far */
+  size_t j = 1;  /* start of suffix being compared to it */
+  size_t k = 1;  /* position of compared characters */
+  size_t p = 1;  /* period of maximal suffix */
+  while (j + k <= n) {
+    int c = (int)uchar(x[i + k - 1]) - (int)uchar(x[j + k - 1]);
+    if (rev) c = -c;
+    if (c == 0) {  /* advance in same period */
+      if (k == p) { j += p; k = 1; }
+      else k++;
+    }
+    else if (c > 0) {  /* suffix at 'j' is smaller; period grows */
+      j += k; k = 1;
+      p = j - i;
+    }
+    else {  /* suffix at 'j' is larger; it is the new maximal suffix */
+      i = j++;
+      k = p = 1;
+    }
+  }
+  *period = p;
+  return i;
+}
+
+
+static void twowayinit (TwoWay *tw, const char *x, size_t n) {
+  size_t p1, p2;
+  size_t i1 = maxsuffix(x, n, 0, &p1);
+  size_t i2 = maxsuffix(x, n, 1, &p2);
+  size_t crit = (i2 > i1) ? i2 : i1;
+  size_t p = (i2 > i1) ? p2 : p1;
+  if (memcmp(x, x + p, crit) == 0)  /* periodic needle? */
+    tw->mem0 = n - p;
+  else {
+    tw->mem0 = 0;
+    p = ((crit - 1 > n - crit) ? crit - 1 : n - crit) + 1;
+  }
+  tw->crit = crit;
+  tw->period = p;
+}
+
+
+static const char *twowayfind (const char *h, const char *e,
+                               const char *x, size_t n, const TwoWay *tw) {
+  size_t mem = 0;  /* prefix of the needle already matched at 'h' */
+  while ((size_t)(e - h) >= n) {
+    size_t k = (tw->crit > mem) ? tw->crit : mem;
+    while (k < n && x[k] == h[k])  /* match right half */
+      k++;
+    if (k < n) {
+      h += k - tw->crit + 1;
+      mem = 0;
+    }
+    else {
+      k = tw->crit;
+      while (k > mem && x[k - 1] == h[k - 1])  /* match left half */
+        k--;
+      if (k <= mem)
+        return h;
+      h += tw->period;
+      mem = tw->mem0;
+    }
+  }
+  return NULL;
+}
+
+
+/*
+** Bytes that a plain search can compare in failed candidates, besides
+** twice the bytes it skipped, before it changes to Two-Way
+*/
+#if !defined(LUAI_FINDWORK)
+#define LUAI_FINDWORK	1024
+#endif
+
+
+/*
+** Find 's2' inside 's1'. Most searches are fastest with 'memchr' and
+** 'memcmp', but they are quadratic in the worst case; so, when failed
+** candidates cost too much, the search finishes with Two-Way, which is
+** linear. 'tw' is the Two-Way data of 's2', or NULL to compute it
+** only if needed.
+*/
 static const char *lmemfind (const char *s1, size_t l1,
-                               const char *s2, size_t l2) {
+                             const char *s2, size_t l2, const TwoWay *tw) {
   if (l2 == 0) return s1;  /* empty strings are everywhere */
   else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
   else {
     const char *init;  /* to search for a '*s2' inside 's1' */
+    const char *start = s1;
+    const char *end = s1 + l1;
+    size_t work = 0;  /* bytes compared in failed candidates */
     l2--;  /* 1st char will be checked by 'memchr' */
     l1 = l1-l2;  /* 's2' cannot be found after that */
     while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
       init++;   /* 1st char is already checked */
       if (memcmp(init, s2+1, l2) == 0)
         return init-1;
-      else {  /* correct 'l1' and 's1' to try again */
-        l1 -= init-s1;
-        s1 = init;
+      work += l2;
+      if (work > LUAI_FINDWORK + 2 * (size_t)(init - start)) {
+        TwoWay ltw;
+        if (tw == NULL) {
+          twowayinit(&ltw, s2, l2 + 1);
+          tw = &ltw;
+        }
+        return twowayfind(init, end, s2, l2 + 1, tw);
       }
+      /* correct 'l1' and 's1' to try again */
+      l1 -= init-s1;
+      s1 = init;
     }
     return NULL;  /* not found */
   }
@@ -588,6 +1132,178 @@ static int nospecials (const char *p, size_t l) {
 }
 
 
+/*
+** Analysis of a pattern. Every match of the pattern (after its anchor)
+** starts with the literal 'lit', which unanchored searches look for
+** before trying the matcher; without such a literal, they look for a
+** character in 'first', if it is not NULL. The compiled pattern and
+** the literal follow the structure in memory.
+*/
+typedef struct Pattern {
+  int anchor;  /* pattern starts with '^' */
+  int plain;  /* pattern has no special characters */
+  TwoWay tw;  /* Two-Way data for 'lit' (if 'llit' > 0) */
+  const PItem *prog;  /* compiled pattern (NULL if it has errors) */
+  const unsigned char *first;  /* characters that can start a match */
+  size_t llit;  /* length of 'lit' */
+  char *lit;  /* literal prefix of the pattern */
+} Pattern;
+
+
+/*
+** Collect in 'lit' the characters that start every match of pattern
+** 'p': single characters (or escaped non-alphanumeric characters) up
+** to the first other item or to a character with an optional repetition.
+*/
+static size_t literalprefix (const char *p, const char *p_end, char *lit) {
+  size_t n = 0;
+  while (p < p_end) {
+    const char *ep = p + 1;  /* end of current item */
+    char c = *p;
+    switch (c) {
+      case '(': case ')': case '.': case '[':
+        return n;
+      case '$':
+        if (ep == p_end)  /* anchor at the end? */
+          return n;
+        break;
+      case L_ESC:
+        if (ep == p_end || isalnum(uchar(*ep)))  /* class, %b, %f, %1? */
+          return n;
+        c = *ep++;  /* escaped character */
+        break;
+      default: break;
+    }
+    if (ep < p_end && (*ep == '?' || *ep == '*' || *ep == '-'))
+      return n;  /* character may be absent */
+    lit[n++] = c;
+    if (ep < p_end && *ep == '+')
+      return n;  /* character may repeat */
+    p = ep;
+  }
+  return n;
+}
+
+
+/*
+** Patterns are analyzed once and kept in a per-state cache: the table
+** at registry[LUA_PATTERNS_TABLE] maps pattern strings to their
+** analyses. The table has weak values, so the collector clears it.
+** Compiled classes depend on the locale; 'os.setlocale' drops the
+** whole table.
+*/
+
+
+/* characters that can start a match of 'prog', or NULL for any */
+static const unsigned char *firstset (const PItem *it) {
+  while (it->kind == PI_OPEN || it->kind == PI_POSITION ||
+         it->kind == PI_CLOSE || it->kind == PI_FRONTIER)
+    it++;  /* skip items that do not consume characters */
+  return it->first;
+}
+
+
+static Pattern *newpattern (lua_State *L, const char *p, size_t lp) {
+  CompileState cs;
+  Pattern *pt;
+  int anchor = (*p == '^');
+  int plain = nospecials(p, lp);
+  size_t size = 0;  /* size of compiled pattern */
+  if (anchor) {
+    p++; lp--;  /* skip anchor character */
+  }
+  cs.items = NULL;
+  if (!plain && compile(&cs, p, p + lp))  /* count its parts */
+    size = cs.nitems * sizeof(PItem) + cs.nsets * SETSIZE + cs.nlits;
+  pt = (Pattern *)lua_newuserdata(L, sizeof(Pattern) + size + lp);
+  pt->anchor = anchor;
+  pt->plain = plain;
+  pt->prog = NULL;
+  pt->first = NULL;
+  pt->lit = (char *)(pt + 1) + size;
+  if (size > 0) {  /* compile it */
+    cs.items = (PItem *)(pt + 1);
+    cs.sets = (unsigned char *)(cs.items + cs.nitems);
+    cs.lits = (char *)(cs.sets + cs.nsets * SETSIZE);
+    compile(&cs, p, p + lp);
+    pt->prog = cs.items;
+    pt->first = firstset(pt->prog);
+  }
+  if (plain) {
+    memcpy(pt->lit, p, lp * sizeof(char));
+    pt->llit = lp;
+  }
+  else
+    pt->llit = literalprefix(p, p + lp, pt->lit);
+  if (pt->llit > 0)  /* (cached analyses are never written after this) */
+    twowayinit(&pt->tw, pt->lit, pt->llit);
+  return pt;
+}
+
+
+/*
+** Get the analysis of the pattern string at index 'arg', with contents
+** 'p'. Leave the cache and the analysis on the stack, so that the
+** analysis lives while the caller uses it.
+*/
+static Pattern *getpattern (lua_State *L, int arg, const char *p,
+                            size_t lp) {
+  Pattern *pt;
+  if (lua_getfield(L, LUA_REGISTRYINDEX, LUA_PATTERNS_TABLE) == LUA_TNIL) {
+    lua_pop(L, 1);  /* remove nil */
+    lua_newtable(L);  /* create cache */
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");  /* cache has weak values */
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_PATTERNS_TABLE);
+  }
+  lua_pushvalue(L, arg);
+  if (lua_rawget(L, -2) == LUA_TUSERDATA)  /* pattern in the cache? */
+    pt = (Pattern *)lua_touserdata(L, -1);
+  else {
+    lua_pop(L, 1);  /* remove nil */
+    pt = newpattern(L, p, lp);
+    lua_pushvalue(L, arg);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);  /* cache[pattern] = analysis */
+  }
+  return pt;
+}
+
+
+/*
+** Skip to the first place in 's' (up to 'e') where the pattern with
+** analysis 'pt' can match, or return NULL if there is none. An
+** anchored pattern, or one without analysis, can match anywhere.
+*/
+static const char *skiptolit (const Pattern *pt, const char *s,
+                               const char *e) {
+  if (pt == NULL || pt->anchor)
+    return s;
+  else if (pt->llit > 0)
+    return lmemfind(s, e - s, pt->lit, pt->llit, &pt->tw);
+  else if (pt->first != NULL) {
+    while (s < e && !testset(pt->first, uchar(*s)))
+      s++;
+    return (s < e) ? s : NULL;
+  }
+  else
+    return s;
+}
+
+
+/* match with the compiled pattern, if there is one */
+static const char *domatch (MatchState *ms, Pattern *pt, const char *s,
+                            const char *p) {
+  if (pt != NULL && pt->prog != NULL)
+    return cmatch(ms, s, pt->prog);
+  else
+    return match(ms, s, p);
+}
+
+
 static void prepstate (MatchState *ms, lua_State *L,
                        const char *s, size_t ls, const char *p, size_t lp) {
   ms->L = L;
@@ -604,20 +1320,40 @@ static void reprepstate (MatchState *ms) {
 }
 
 
+/*
+** A subject that is a view can be closed, moved, or resized by Lua code
+** called between matches; check that the subject at 'idx' still has
+** the contents being matched by 'ms'. (Byte arrays, the other userdata
+** subjects, are not views and cannot change their contents.)
+*/
+static void checkopen (lua_State *L, int idx, const MatchState *ms) {
+  if (lua_type(L, idx) == LUA_TUSERDATA &&
+      lua_toarray(L, idx, NULL, NULL) == NULL) {
+    luaL_View *v = (luaL_View *)lua_touserdata(L, idx);
+    if (v->p != ms->src_init || v->len != (size_t)(ms->src_end - v->p))
+      luaL_error(L, "subject changed during pattern matching");
+  }
+}
+
+
 static int str_find_aux (lua_State *L, int find) {
   size_t ls, lp;
-  const char *s = luaL_checklstring(L, 1, &ls);
+  const char *s = luaL_checkview(L, 1, &ls);
   const char *p = luaL_checklstring(L, 2, &lp);
   lua_Integer init = posrelat(luaL_optinteger(L, 3, 1), ls);
+  int plain = find && lua_toboolean(L, 4);  /* explicit request? */
+  Pattern *pt;
   if (init < 1) init = 1;
   else if (init > (lua_Integer)ls + 1) {  /* start after string's end? */
     lua_pushnil(L);  /* cannot find anything */
     return 1;
   }
+  pt = plain ? NULL : getpattern(L, 2, p, lp);
   /* explicit request or no special characters? */
-  if (find && (lua_toboolean(L, 4) || nospecials(p, lp))) {
+  if (plain || (find && pt != NULL && pt->plain)) {
     /* do a plain search */
-    const char *s2 = lmemfind(s + init - 1, ls - (size_t)init + 1, p, lp);
+    const char *s2 = lmemfind(s + init - 1, ls - (size_t)init + 1, p, lp,
+                              (pt != NULL) ? &pt->tw : NULL);
     if (s2) {
       lua_pushinteger(L, (s2 - s) + 1);
       lua_pushinteger(L, (s2 - s) + lp);
@@ -634,8 +1370,10 @@ static int str_find_aux (lua_State *L, int find) {
     prepstate(&ms, L, s, ls, p, lp);
     do {
       const char *res;
+      if ((s1 = skiptolit(pt, s1, ms.src_end)) == NULL)
+        break;  /* no place where pattern can match */
       reprepstate(&ms);
-      if ((res=match(&ms, s1, p)) != NULL) {
+      if ((res=domatch(&ms, pt, s1, p)) != NULL) {
         if (find) {
           lua_pushinteger(L, (s1 - s) + 1);  /* start */
           lua_pushinteger(L, res - s);   /* end */
@@ -666,18 +1404,23 @@ typedef struct GMatchState {
   const char *src;  /* current position */
   const char *p;  /* pattern */
   const char *lastmatch;  /* end of last match */
+  Pattern *pt;  /* analysis of the pattern */
   MatchState ms;  /* match state */
 } GMatchState;
 
 
 static int gmatch_aux (lua_State *L) {
-  GMatchState *gm = (GMatchState *)lua_touserdata(L, lua_upvalueindex(3));
+  GMatchState *gm = (GMatchState *)lua_touserdata(L, lua_upvalueindex(5));
   const char *src;
+  checkopen(L, lua_upvalueindex(1), &gm->ms);
   gm->ms.L = L;
   for (src = gm->src; src <= gm->ms.src_end; src++) {
     const char *e;
+    if ((src = skiptolit(gm->pt, src, gm->ms.src_end)) == NULL)
+      break;  /* no more matches */
     reprepstate(&gm->ms);
-    if ((e = match(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
+    if ((e = domatch(&gm->ms, gm->pt, src, gm->p)) != NULL &&
+        e != gm->lastmatch) {
       gm->src = gm->lastmatch = e;
       return push_captures(&gm->ms, src, e);
     }
@@ -688,14 +1431,18 @@ static int gmatch_aux (lua_State *L) {
 
 static int gmatch (lua_State *L) {
   size_t ls, lp;
-  const char *s = luaL_checklstring(L, 1, &ls);
+  const char *s = luaL_checkview(L, 1, &ls);
   const char *p = luaL_checklstring(L, 2, &lp);
   GMatchState *gm;
+  Pattern *pt;
   lua_settop(L, 2);  /* keep them on closure to avoid being collected */
+  pt = getpattern(L, 2, p, lp);
+  lua_settop(L, 4);  /* keep cache and analysis too */
   gm = (GMatchState *)lua_newuserdata(L, sizeof(GMatchState));
   prepstate(&gm->ms, L, s, ls, p, lp);
   gm->src = s; gm->p = p; gm->lastmatch = NULL;
-  lua_pushcclosure(L, gmatch_aux, 3);
+  gm->pt = (pt->anchor) ? NULL : pt;  /* '^' is not an anchor here */
+  lua_pushcclosure(L, gmatch_aux, 5);
   return 1;
 }
 
@@ -749,6 +1496,7 @@ static void add_value (MatchState *ms, luaL_Buffer *b, const char *s,
       return;
     }
   }
+  checkopen(L, 1, ms);  /* Lua code may have changed subject */
   if (!lua_toboolean(L, -1)) {  /* nil or false? */
     lua_pop(L, 1);
     lua_pushlstring(L, s, e - s);  /* keep original text */
@@ -761,18 +1509,20 @@ static void add_value (MatchState *ms, luaL_Buffer *b, const char *s,
 
 static int str_gsub (lua_State *L) {
   size_t srcl, lp;
-  const char *src = luaL_checklstring(L, 1, &srcl);  /* subject */
+  const char *src = luaL_checkview(L, 1, &srcl);  /* subject */
   const char *p = luaL_checklstring(L, 2, &lp);  /* pattern */
   const char *lastmatch = NULL;  /* end of last match */
   int tr = lua_type(L, 3);  /* replacement type */
   lua_Integer max_s = luaL_optinteger(L, 4, srcl + 1);  /* max replacements */
   int anchor = (*p == '^');
+  Pattern *pt;
   lua_Integer n = 0;  /* replacement count */
   MatchState ms;
   luaL_Buffer b;
   luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table expected");
+  pt = getpattern(L, 2, p, lp);
   luaL_buffinit(L, &b);
   if (anchor) {
     p++; lp--;  /* skip anchor character */
@@ -780,8 +1530,13 @@ static int str_gsub (lua_State *L) {
   prepstate(&ms, L, src, srcl, p, lp);
   while (n < max_s) {
     const char *e;
+    const char *s1 = skiptolit(pt, src, ms.src_end);
+    if (s1 == NULL) break;  /* no more matches */
+    luaL_addlstring(&b, src, s1 - src);  /* keep skipped characters */
+    src = s1;
     reprepstate(&ms);  /* (re)prepare state for new match */
-    if ((e = match(&ms, src, p)) != NULL && e != lastmatch) {  /* match? */
+    e = domatch(&ms, pt, src, p);
+    if (e != NULL && e != lastmatch) {  /* match? */
       n++;
       add_value(&ms, &b, src, e, tr);  /* add replacement to buffer */
       src = lastmatch = e;
@@ -1013,22 +1768,24 @@ static void addlenmod (char *form, const char *lenmod) {
 }
 
 
-static int str_format (lua_State *L) {
+/*
+** Add to buffer 'b' the formatting of the values that follow the
+** format string at index 'arg'. The buffer must not have pushed
+** anything yet, so that the stack top is the last value.
+*/
+static void addformat (lua_State *L, luaL_Buffer *b, int arg) {
   int top = lua_gettop(L);
-  int arg = 1;
   size_t sfl;
   const char *strfrmt = luaL_checklstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
   while (strfrmt < strfrmt_end) {
     if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
+      luaL_addchar(b, *strfrmt++);
     else if (*++strfrmt == L_ESC)
-      luaL_addchar(&b, *strfrmt++);  /* %% */
+      luaL_addchar(b, *strfrmt++);  /* %% */
     else { /* format item */
       char form[MAX_FORMAT];  /* to store the format ('%...') */
-      char *buff = luaL_prepbuffsize(&b, MAX_ITEM);  /* to put formatted item */
+      char *buff = luaL_prepbuffsize(b, MAX_ITEM);  /* to put formatted item */
       int nb = 0;  /* number of bytes in added item */
       if (++arg > top)
         luaL_argerror(L, arg, "no value");
@@ -1058,19 +1815,19 @@ static int str_format (lua_State *L) {
           break;
         }
         case 'q': {
-          addliteral(L, &b, arg);
+          addliteral(L, b, arg);
           break;
         }
         case 's': {
           size_t l;
           const char *s = luaL_tolstring(L, arg, &l);
           if (form[2] == '\0')  /* no modifiers? */
-            luaL_addvalue(&b);  /* keep entire string */
+            luaL_addvalue(b);  /* keep entire string */
           else {
             luaL_argcheck(L, l == strlen(s), arg, "string contains zeros");
             if (!strchr(form, '.') && l >= 100) {
               /* no precision and string is too long to be formatted */
-              luaL_addvalue(&b);  /* keep entire string */
+              luaL_addvalue(b);  /* keep entire string */
             }
             else {  /* format the string into 'buff' */
               nb = l_sprintf(buff, MAX_ITEM, form, s);
@@ -1080,14 +1837,21 @@ static int str_format (lua_State *L) {
           break;
         }
         default: {  /* also treat cases 'pnLlh' */
-          return luaL_error(L, "invalid option '%%%c' to 'format'",
-                               *(strfrmt - 1));
+          luaL_error(L, "invalid option '%%%c' to 'format'",
+                        *(strfrmt - 1));
         }
       }
       lua_assert(nb < MAX_ITEM);
-      luaL_addsize(&b, nb);
+      luaL_addsize(b, nb);
     }
   }
+}
+
+
+static int str_format (lua_State *L) {
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  addformat(L, &b, 1);
   luaL_pushresult(&b);
   return 1;
 }
@@ -1327,21 +2091,23 @@ static void copywithendian (volatile char *dest, volatile const char *src,
 }
 
 
-static int str_pack (lua_State *L) {
-  luaL_Buffer b;
+/*
+** Add to buffer 'b' the packing of the values that follow the format
+** string at index 'arg'. The caller must push a mark above the values
+** before initializing the buffer, so that a missing value is not
+** confused with a box pushed by the buffer.
+*/
+static void addpack (lua_State *L, luaL_Buffer *b, int arg) {
   Header h;
-  const char *fmt = luaL_checkstring(L, 1);  /* format string */
-  int arg = 1;  /* current argument to pack */
+  const char *fmt = luaL_checkstring(L, arg);  /* format string */
   size_t totalsize = 0;  /* accumulate total size of result */
   initheader(L, &h);
-  lua_pushnil(L);  /* mark to separate arguments from string buffer */
-  luaL_buffinit(L, &b);
   while (*fmt != '\0') {
     int size, ntoalign;
     KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
     totalsize += ntoalign + size;
     while (ntoalign-- > 0)
-     luaL_addchar(&b, LUAL_PACKPADBYTE);  /* fill alignment */
+     luaL_addchar(b, LUAL_PACKPADBYTE);  /* fill alignment */
     arg++;
     switch (opt) {
       case Kint: {  /* signed integers */
@@ -1350,7 +2116,7 @@ static int str_pack (lua_State *L) {
           lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
           luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
         }
-        packint(&b, (lua_Unsigned)n, h.islittle, size, (n < 0));
+        packint(b, (lua_Unsigned)n, h.islittle, size, (n < 0));
         break;
       }
       case Kuint: {  /* unsigned integers */
@@ -1358,19 +2124,19 @@ static int str_pack (lua_State *L) {
         if (size < SZINT)  /* need overflow check? */
           luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
                            arg, "unsigned overflow");
-        packint(&b, (lua_Unsigned)n, h.islittle, size, 0);
+        packint(b, (lua_Unsigned)n, h.islittle, size, 0);
         break;
       }
       case Kfloat: {  /* floating-point options */
         volatile Ftypes u;
-        char *buff = luaL_prepbuffsize(&b, size);
+        char *buff = luaL_prepbuffsize(b, size);
         lua_Number n = luaL_checknumber(L, arg);  /* get argument */
         if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
         else if (size == sizeof(u.d)) u.d = (double)n;
         else u.n = n;
         /* move 'u' to final result, correcting endianness if needed */
         copywithendian(buff, u.buff, size, h.islittle);
-        luaL_addsize(&b, size);
+        luaL_addsize(b, size);
         break;
       }
       case Kchar: {  /* fixed-size string */
@@ -1378,9 +2144,9 @@ static int str_pack (lua_State *L) {
         const char *s = luaL_checklstring(L, arg, &len);
         luaL_argcheck(L, len <= (size_t)size, arg,
                          "string longer than given size");
-        luaL_addlstring(&b, s, len);  /* add string */
+        luaL_addlstring(b, s, len);  /* add string */
         while (len++ < (size_t)size)  /* pad extra space */
-          luaL_addchar(&b, LUAL_PACKPADBYTE);
+          luaL_addchar(b, LUAL_PACKPADBYTE);
         break;
       }
       case Kstring: {  /* strings with length count */
@@ -1389,8 +2155,8 @@ static int str_pack (lua_State *L) {
         luaL_argcheck(L, size >= (int)sizeof(size_t) ||
                          len < ((size_t)1 << (size * NB)),
                          arg, "string length does not fit in given size");
-        packint(&b, (lua_Unsigned)len, h.islittle, size, 0);  /* pack length */
-        luaL_addlstring(&b, s, len);
+        packint(b, (lua_Unsigned)len, h.islittle, size, 0);  /* pack length */
+        luaL_addlstring(b, s, len);
         totalsize += len;
         break;
       }
@@ -1398,17 +2164,25 @@ static int str_pack (lua_State *L) {
         size_t len;
         const char *s = luaL_checklstring(L, arg, &len);
         luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
-        luaL_addlstring(&b, s, len);
-        luaL_addchar(&b, '\0');  /* add zero at the end */
+        luaL_addlstring(b, s, len);
+        luaL_addchar(b, '\0');  /* add zero at the end */
         totalsize += len + 1;
         break;
       }
-      case Kpadding: luaL_addchar(&b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
+      case Kpadding: luaL_addchar(b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
       case Kpaddalign: case Knop:
         arg--;  /* undo increment */
         break;
     }
   }
+}
+
+
+static int str_pack (lua_State *L) {
+  luaL_Buffer b;
+  lua_pushnil(L);  /* mark to separate arguments from string buffer */
+  luaL_buffinit(L, &b);
+  addpack(L, &b, 1);
   luaL_pushresult(&b);
   return 1;
 }
@@ -1477,7 +2251,7 @@ static int str_unpack (lua_State *L) {
   Header h;
   const char *fmt = luaL_checkstring(L, 1);
   size_t ld;
-  const char *data = luaL_checklstring(L, 2, &ld);
+  const char *data = luaL_checkview(L, 2, &ld);
   size_t pos = (size_t)posrelat(luaL_optinteger(L, 3, 1), ld) - 1;
   int n = 0;  /* number of results */
   luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
@@ -1539,6 +2313,207 @@ static int str_unpack (lua_State *L) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** BUFFERS
+** =======================================================
+*/
+
+/*
+** A buffer is a mutable string that Lua code can fill piecewise. It
+** starts with a 'luaL_View', so that string functions can read its
+** contents without copying them. A buffer without memory ('size' == 0)
+** points to an empty literal, as a NULL pointer marks closed views.
+*/
+
+#define BUFFER		"buffer"
+
+
+/* minimum size of the memory of a buffer */
+#if !defined(LUAI_MINBUFFER)
+#define LUAI_MINBUFFER	32
+#endif
+
+
+typedef struct Buffer {
+  luaL_View v;  /* contents (must be the first field) */
+  size_t size;  /* size of the memory block */
+} Buffer;
+
+
+#define tobuffer(L,i)	((Buffer *)luaL_checkudata(L, i, BUFFER))
+
+
+/*
+** Make room for 'l' more bytes in buffer 'buf' and return a pointer
+** to that room. The memory at least doubles at each reallocation, so
+** that a sequence of appends takes linear time.
+*/
+static char *prepbuffer (lua_State *L, Buffer *buf, size_t l) {
+  if (buf->size - buf->v.len < l) {  /* not enough space? */
+    void *ud;
+    lua_Alloc allocf = lua_getallocf(L, &ud);
+    size_t newsize = (buf->size <= MAXSIZE / 2) ? buf->size * 2 : MAXSIZE;
+    char *p;
+    if (l > MAXSIZE - buf->v.len)
+      luaL_error(L, "buffer too large");
+    if (newsize < buf->v.len + l)
+      newsize = buf->v.len + l;
+    if (newsize < LUAI_MINBUFFER)
+      newsize = LUAI_MINBUFFER;
+    p = (char *)allocf(ud, (buf->size > 0) ? (void *)buf->v.p : NULL,
+                           buf->size, newsize);
+    if (p == NULL)  /* keep old contents */
+      luaL_error(L, "not enough memory for buffer allocation");
+    buf->v.p = p;
+    buf->size = newsize;
+  }
+  return (char *)buf->v.p + buf->v.len;
+}
+
+
+/*
+** Contents 's' of argument 'arg' after buffer 'buf' made room for
+** them: if the argument is the buffer itself, its contents may have
+** moved.
+*/
+static const char *recheck (lua_State *L, Buffer *buf, int arg,
+                            const char *s) {
+  return (lua_touserdata(L, arg) == (void *)buf) ? buf->v.p : s;
+}
+
+
+/*
+** Append to buffer 'buf' the contents of the temporary buffer 'b'
+** and remove everything above the buffer from the stack.
+*/
+static int addresult (lua_State *L, Buffer *buf, luaL_Buffer *b) {
+  memcpy(prepbuffer(L, buf, b->n), b->b, b->n * sizeof(char));
+  buf->v.len += b->n;
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int buf_new (lua_State *L) {
+  lua_Integer size = luaL_optinteger(L, 1, 0);
+  Buffer *buf;
+  luaL_argcheck(L, 0 <= size && (lua_Unsigned)size <= MAXSIZE, 1,
+                   "invalid size");
+  buf = (Buffer *)lua_newuserdata(L, sizeof(Buffer));
+  buf->v.p = "";
+  buf->v.len = 0;
+  buf->size = 0;
+  luaL_setmetatable(L, BUFFER);
+  if (size > 0)
+    prepbuffer(L, buf, (size_t)size);
+  return 1;
+}
+
+
+static int buf_append (lua_State *L) {
+  Buffer *buf = tobuffer(L, 1);
+  int n = lua_gettop(L);
+  int i;
+  for (i = 2; i <= n; i++) {
+    size_t l;
+    const char *s = luaL_checkview(L, i, &l);
+    char *p = prepbuffer(L, buf, l);
+    memcpy(p, recheck(L, buf, i, s), l * sizeof(char));
+    buf->v.len += l;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int buf_appendf (lua_State *L) {
+  Buffer *buf = tobuffer(L, 1);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  addformat(L, &b, 2);
+  return addresult(L, buf, &b);
+}
+
+
+static int buf_pack (lua_State *L) {
+  Buffer *buf = tobuffer(L, 1);
+  luaL_Buffer b;
+  lua_pushnil(L);  /* mark to separate arguments from string buffer */
+  luaL_buffinit(L, &b);
+  addpack(L, &b, 2);
+  return addresult(L, buf, &b);
+}
+
+
+static int buf_rep (lua_State *L) {
+  Buffer *buf = tobuffer(L, 1);
+  size_t l, lsep = 0;
+  const char *s = luaL_checkview(L, 2, &l);
+  lua_Integer n = luaL_checkinteger(L, 3);
+  const char *sep = lua_isnoneornil(L, 4) ? "" : luaL_checkview(L, 4, &lsep);
+  if (n > 0) {
+    size_t totallen;
+    char *p;
+    if (l + lsep < l || l + lsep > MAXSIZE / n)  /* may overflow? */
+      return luaL_error(L, "resulting string too large");
+    totallen = (size_t)n * l + (size_t)(n - 1) * lsep;
+    p = prepbuffer(L, buf, totallen);
+    s = recheck(L, buf, 2, s);
+    sep = recheck(L, buf, 4, sep);
+    while (n-- > 1) {  /* first n-1 copies (followed by separator) */
+      memcpy(p, s, l * sizeof(char)); p += l;
+      if (lsep > 0) {  /* empty 'memcpy' is not that cheap */
+        memcpy(p, sep, lsep * sizeof(char));
+        p += lsep;
+      }
+    }
+    memcpy(p, s, l * sizeof(char));  /* last copy (not followed by separator) */
+    buf->v.len += totallen;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int buf_reset (lua_State *L) {
+  Buffer *buf = tobuffer(L, 1);
+  buf->v.len = 0;  /* keep memory for reuse */
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int buf_tostring (lua_State *L) {
+  Buffer *buf = tobuffer(L, 1);
+  lua_pushlstring(L, buf->v.p, buf->v.len);
+  return 1;
+}
+
+
+static int buf_len (lua_State *L) {
+  Buffer *buf = tobuffer(L, 1);
+  lua_pushinteger(L, (lua_Integer)buf->v.len);
+  return 1;
+}
+
+
+static int buf_gc (lua_State *L) {
+  Buffer *buf = tobuffer(L, 1);
+  if (buf->size > 0) {
+    void *ud;
+    lua_Alloc allocf = lua_getallocf(L, &ud);
+    allocf(ud, (void *)buf->v.p, buf->size, 0);
+  }
+  buf->v.p = "";  /* buffer stays usable if resurrected */
+  buf->v.len = 0;
+  buf->size = 0;
+  return 0;
+}
+
+/* }====================================================== */
+
+
 static const luaL_Reg strlib[] = {
   {"byte", str_byte},
   {"char", str_char},
@@ -1582,3 +2557,42 @@ LUAMOD_API int luaopen_string (lua_State *L) {
   return 1;
 }
 
+
+static const luaL_Reg buflib[] = {
+  {"new", buf_new},
+  {NULL, NULL}
+};
+
+
+/*
+** methods for buffers
+*/
+static const luaL_Reg bufmeth[] = {
+  {"append", buf_append},
+  {"appendf", buf_appendf},
+  {"pack", buf_pack},
+  {"rep", buf_rep},
+  {"reset", buf_reset},
+  {"tostring", buf_tostring},
+  {"__gc", buf_gc},
+  {"__len", buf_len},
+  {"__tostring", buf_tostring},
+  {NULL, NULL}
+};
+
+
+/*
+** Open buffer library
+*/
+LUAMOD_API int luaopen_buffer (lua_State *L) {
+  luaL_newmetatable(L, BUFFER);  /* metatable for buffers */
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, bufmeth, 0);
+  lua_pushboolean(L, 1);
+  lua_setfield(L, -2, LUAL_VIEWFIELD);  /* buffers are views */
+  lua_pop(L, 1);
+  luaL_newlib(L, buflib);
+  return 1;
+}
+
@@ -25,6 +25,7 @@
 
 #include <math.h>
 #include <limits.h>
+#include <string.h>
 
 #include "lua.h"
 
@@ -307,6 +308,20 @@ static void setarrayvector (lua_State *L, Table *t, unsigned int size) {
 }
 
 
+/* make all nodes of the hash part of 't' free */
+static void clearnodes (Table *t) {
+  int i;
+  int size = sizenode(t);
+  for (i = 0; i < size; i++) {
+    Node *n = gnode(t, i);
+    gnext(n) = 0;
+    setnilvalue(wgkey(n));
+    setnilvalue(gval(n));
+  }
+  t->lastfree = gnode(t, size);  /* all positions are free */
+}
+
+
 static void setnodevector (lua_State *L, Table *t, unsigned int size) {
   if (size == 0) {  /* no elements to hash part? */
     t->node = cast(Node *, dummynode);  /* use common 'dummynode' */
@@ -314,20 +329,13 @@ static void setnodevector (lua_State *L, Table *t, unsigned int size) {
     t->lastfree = NULL;  /* signal that it is using dummy node */
   }
   else {
-    int i;
     int lsize = luaO_ceillog2(size);
     if (lsize > MAXHBITS)
       luaG_runerror(L, "table overflow");
     size = twoto(lsize);
     t->node = luaM_newvector(L, size, Node);
-    for (i = 0; i < (int)size; i++) {
-      Node *n = gnode(t, i);
-      gnext(n) = 0;
-      setnilvalue(wgkey(n));
-      setnilvalue(gval(n));
-    }
     t->lsizenode = cast_byte(lsize);
-    t->lastfree = gnode(t, size);  /* all positions are free */
+    clearnodes(t);
   }
 }
 
@@ -425,11 +433,25 @@ Table *luaH_new (lua_State *L) {
   t->flags = cast_byte(~0);
   t->array = NULL;
   t->sizearray = 0;
+  t->lenhint = 0;
   setnodevector(L, t, 0);
   return t;
 }
 
 
+/*
+** Remove all entries from 't', keeping its array and hash parts for
+** new entries.
+*/
+void luaH_clear (Table *t) {
+  unsigned int i;
+  for (i = 0; i < t->sizearray; i++)
+    setnilvalue(&t->array[i]);
+  if (!isdummy(t))
+    clearnodes(t);
+}
+
+
 void luaH_free (lua_State *L, Table *t) {
   if (!isdummy(t))
     luaM_freearray(L, t->node, cast(size_t, sizenode(t)));
@@ -653,12 +675,34 @@ static lua_Unsigned unbound_search (Table *t, lua_Unsigned j) {
 }
 
 
+/* remember border 'b' of 't' for the next call to 'luaH_getn' */
+static unsigned int sethint (Table *t, unsigned int b) {
+  if (!isfrozen(t))  /* frozen tables may be shared among threads */
+    t->lenhint = b;
+  return b;
+}
+
+
 /*
 ** Try to find a boundary in table 't'. A 'boundary' is an integer index
 ** such that t[i] is non-nil and t[i+1] is nil (and 0 if t[1] is nil).
+** First checks the boundary found last time, which is usually still
+** one, or just moved by an append ('t[#t + 1] = v') or a removal
+** ('t[#t] = nil'), so these idioms take constant time.
 */
 lua_Unsigned luaH_getn (Table *t) {
   unsigned int j = t->sizearray;
+  unsigned int h = t->lenhint;
+  if (h < j) {  /* hint in the array part? */
+    if (!ttisnil(&t->array[h])) {  /* t[h + 1] is present? */
+      if (h + 1 < j && ttisnil(&t->array[h + 1]))  /* after an append? */
+        return sethint(t, h + 1);
+    }
+    else if (h == 0 || !ttisnil(&t->array[h - 1]))  /* still a boundary? */
+      return h;
+    else if (h == 1 || !ttisnil(&t->array[h - 2]))  /* after a removal? */
+      return sethint(t, h - 1);
+  }
   if (j > 0 && ttisnil(&t->array[j - 1])) {
     /* there is a boundary in the array part: (binary) search for it */
     unsigned int i = 0;
@@ -667,7 +711,7 @@ lua_Unsigned luaH_getn (Table *t) {
       if (ttisnil(&t->array[m - 1])) j = m;
       else i = m;
     }
-    return i;
+    return sethint(t, i);
   }
   /* else must find a boundary in hash part */
   else if (isdummy(t))  /* hash part is empty? */
@@ -677,6 +721,631 @@ lua_Unsigned luaH_getn (Table *t) {
 
 
 
+/*
+** {======================================================
+** Sorting of arrays (see 'lua_rawsort')
+** Quicksort based on 'Algorithms in MODULA-3', Robert Sedgewick;
+** Addison-Wesley, 1993.
+** =======================================================
+*/
+
+/* order used by the sorts: true iff 'a' < 'b' */
+typedef int (*SortLT) (lua_State *L, const TValue *a, const TValue *b);
+
+
+/*
+** Produce a "random" 'unsigned int' to randomize pivot choice. This
+** macro is used only when a quicksort detects a big imbalance in the
+** result of a partition. (If you don't want/need this "randomness", ~0
+** is a good choice.)
+*/
+#if !defined(l_randomizePivot)		/* { */
+
+#include <time.h>
+
+/* size of 'e' measured in number of 'unsigned int's */
+#define sof(e)		(sizeof(e) / sizeof(unsigned int))
+
+/*
+** Use 'time' and 'clock' as sources of "randomness". Because we don't
+** know the types 'clock_t' and 'time_t', we cannot cast them to
+** anything without risking overflows. A safe way to use their values
+** is to copy them to an array of a known type and use the array values.
+*/
+static unsigned int l_randomizePivot (void) {
+  clock_t c = clock();
+  time_t t = time(NULL);
+  unsigned int buff[sof(c) + sof(t)];
+  unsigned int i, rnd = 0;
+  memcpy(buff, &c, sof(c) * sizeof(unsigned int));
+  memcpy(buff + sof(c), &t, sof(t) * sizeof(unsigned int));
+  for (i = 0; i < sof(buff); i++)
+    rnd += buff[i];
+  return rnd;
+}
+
+#endif					/* } */
+
+
+/* arrays larger than 'RANLIMIT' may use randomized pivots */
+#define RANLIMIT	100u
+
+/* arrays of numbers larger than 'RADIXLIMIT' use radix sort */
+#define RADIXLIMIT	16u
+
+/* top-k selections with 'k' below 'n/HEAPRATIO' use a heap */
+#define HEAPRATIO	16u
+
+/* runs shorter than 'MINRUN' are extended by insertion before merging */
+#define MINRUN		32u
+
+/*
+** Maximum number of pending runs in a merge sort. Their lengths grow
+** at least as fast as Fibonacci numbers, so this is plenty.
+*/
+#define MAXRUNS		64
+
+
+/*
+** Call the order function, on the top of the stack, with 'a' and 'b'.
+** The call reuses the same three slots above it every time.
+*/
+static int callorder (lua_State *L, const TValue *a, const TValue *b) {
+  StkId func = L->top;
+  setobj2s(L, func, L->top - 1);
+  setobj2s(L, func + 1, a);
+  setobj2s(L, func + 2, b);
+  L->top = func + 3;
+  luaD_callnoyield(L, func, 1);
+  L->top--;  /* remove result */
+  return !l_isfalse(L->top);
+}
+
+
+static void swapvalues (lua_State *L, TValue *a, unsigned int i,
+                                                 unsigned int j) {
+  TValue temp;
+  setobj(L, &temp, &a[i]);
+  setobj(L, &a[i], &a[j]);
+  setobj(L, &a[j], &temp);
+}
+
+
+/*
+** Does the partition: Pivot P is at 'a[up - 1]'.
+** precondition: a[lo] <= P == a[up-1] <= a[up],
+** so it only needs to do the partition from lo + 1 to up - 2.
+** Pos-condition: a[lo .. i - 1] <= a[i] == P <= a[i + 1 .. up]
+** returns 'i'.
+*/
+static unsigned int partition (lua_State *L, TValue *a, unsigned int lo,
+                               unsigned int up, SortLT lt) {
+  unsigned int i = lo;  /* will be incremented before first use */
+  unsigned int j = up - 1;  /* will be decremented before first use */
+  const TValue *P = &a[up - 1];
+  /* loop invariant: a[lo .. i] <= P <= a[j .. up] */
+  for (;;) {
+    while (lt(L, &a[++i], P)) {  /* repeat ++i while a[i] < P */
+      if (i == up - 1)  /* a[i] < P  but a[up - 1] == P  ?? */
+        luaG_runerror(L, "invalid order function for sorting");
+    }
+    while (lt(L, P, &a[--j])) {  /* repeat --j while P < a[j] */
+      if (j < i)  /* j < i  but  a[j] > P ?? */
+        luaG_runerror(L, "invalid order function for sorting");
+    }
+    if (j < i) {  /* no elements out of place? */
+      swapvalues(L, a, up - 1, i);  /* put pivot in its place */
+      return i;
+    }
+    swapvalues(L, a, i, j);  /* restore invariant and repeat */
+  }
+}
+
+
+/*
+** Sort 'a[lo]', 'a[up]', and a pivot chosen between them (in the middle
+** or, with 'rnd', "randomly" in the 2nd-3rd quarters), and partition
+** 'a[lo .. up]' around the pivot. Returns its final position, or
+** 'up + 1' if the interval had at most 3 elements and is now sorted.
+*/
+static unsigned int split (lua_State *L, TValue *a, unsigned int lo,
+                           unsigned int up, unsigned int rnd, SortLT lt) {
+  unsigned int p;
+  if (lt(L, &a[up], &a[lo]))  /* a[up] < a[lo]? */
+    swapvalues(L, a, lo, up);
+  if (up - lo == 1)  /* only 2 elements? */
+    return up + 1;  /* already sorted */
+  if (up - lo < RANLIMIT || rnd == 0)  /* small interval or no randomize? */
+    p = (lo + up)/2;  /* middle element is a good pivot */
+  else {  /* for larger intervals, it is worth a random pivot */
+    unsigned int r4 = (up - lo) / 4;  /* range/4 */
+    p = rnd % (r4 * 2) + (lo + r4);
+  }
+  if (lt(L, &a[p], &a[lo]))  /* a[p] < a[lo]? */
+    swapvalues(L, a, p, lo);
+  else if (lt(L, &a[up], &a[p]))  /* a[up] < a[p]? */
+    swapvalues(L, a, p, up);
+  if (up - lo == 2)  /* only 3 elements? */
+    return up + 1;  /* already sorted */
+  swapvalues(L, a, p, up - 1);  /* move Pivot to a[up - 1] */
+  return partition(L, a, lo, up, lt);
+}
+
+
+static void quicksort (lua_State *L, TValue *a, unsigned int lo,
+                       unsigned int up, unsigned int rnd, SortLT lt) {
+  while (lo < up) {  /* loop for tail recursion */
+    unsigned int p = split(L, a, lo, up, rnd, lt);  /* Pivot index */
+    unsigned int n;  /* size of the smaller interval */
+    if (p > up)  /* small interval? */
+      return;  /* already sorted */
+    /* a[lo .. p - 1] <= a[p] == P <= a[p + 1 .. up] */
+    if (p - lo < up - p) {  /* lower interval is smaller? */
+      quicksort(L, a, lo, p - 1, rnd, lt);
+      n = p - lo;
+      lo = p + 1;  /* tail call for [p + 1 .. up] (upper interval) */
+    }
+    else {
+      quicksort(L, a, p + 1, up, rnd, lt);
+      n = up - p;
+      up = p - 1;  /* tail call for [lo .. p - 1]  (lower interval) */
+    }
+    if ((up - lo) / 128 > n) /* partition too imbalanced? */
+      rnd = l_randomizePivot();  /* try a new randomization */
+  }  /* tail call quicksort(L, a, lo, up, rnd, lt) */
+}
+
+
+/*
+** Rearrange 'a[lo .. up]' so that 'a[k]' gets the value it would have
+** if sorted, with no larger values before it and no smaller ones after
+** it. Like 'quicksort', but goes only into the interval with 'k'.
+*/
+static void quickselect (lua_State *L, TValue *a, unsigned int lo,
+                         unsigned int up, unsigned int k, SortLT lt) {
+  unsigned int rnd = 0;
+  while (lo < up) {
+    unsigned int p = split(L, a, lo, up, rnd, lt);
+    unsigned int n;  /* size of the discarded interval */
+    if (p > up || p == k)  /* small interval or 'k' in its place? */
+      return;
+    else if (k < p) {
+      n = up - p + 1;
+      up = p - 1;
+    }
+    else {
+      n = p - lo + 1;
+      lo = p + 1;
+    }
+    if ((up - lo) / 128 > n) /* partition too imbalanced? */
+      rnd = l_randomizePivot();
+  }
+}
+
+
+/* restore the max-heap 'a[0 .. n - 1]' after a change in 'a[i]' */
+static void siftdown (lua_State *L, TValue *a, unsigned int i,
+                      unsigned int n, SortLT lt) {
+  for (;;) {
+    unsigned int c = 2 * i + 1;  /* left child */
+    if (c >= n)
+      return;
+    if (c + 1 < n && lt(L, &a[c], &a[c + 1]))
+      c++;  /* larger child */
+    if (!lt(L, &a[i], &a[c]))
+      return;
+    swapvalues(L, a, i, c);
+    i = c;
+  }
+}
+
+
+/*
+** Put the 'k' smallest values of 'a[0 .. n - 1]', sorted, in
+** 'a[0 .. k - 1]'. They are kept in a max-heap while the other values
+** are scanned, so this needs O(n log k) comparisons, and most values
+** need only one.
+*/
+static void heapselect (lua_State *L, TValue *a, unsigned int n,
+                        unsigned int k, SortLT lt) {
+  unsigned int i;
+  for (i = k / 2; i-- > 0; )  /* build the heap */
+    siftdown(L, a, i, k, lt);
+  for (i = k; i < n; i++) {
+    if (lt(L, &a[i], &a[0])) {  /* smaller than the largest kept value? */
+      swapvalues(L, a, 0, i);
+      siftdown(L, a, 0, k, lt);
+    }
+  }
+  for (i = k; i > 1; i--) {  /* sort the heap */
+    swapvalues(L, a, 0, i - 1);
+    siftdown(L, a, 0, i - 1, lt);
+  }
+}
+
+
+/*
+** Stable merge sort that takes advantage of ordered runs (a simplified
+** Timsort). The stack of pending runs keeps the invariants
+** len[i - 2] > len[i - 1] + len[i] and len[i - 1] > len[i], so merges
+** are balanced. The values and the scratch space are the arrays of two
+** tables, so a merge, which can run a collection step at each
+** comparison while some values are only in the scratch space, needs
+** barriers on the tables where it copies values.
+*/
+typedef struct MergeState {
+  Table *h;  /* table with the values being sorted */
+  Table *b;  /* table with scratch space for merges */
+  SortLT lt;
+  int nruns;  /* number of pending runs */
+  unsigned int base[MAXRUNS];  /* where each run starts */
+  unsigned int len[MAXRUNS];  /* length of each run */
+} MergeState;
+
+
+/*
+** Binary insertion sort of 'a[lo .. up - 1]', where 'a[lo .. start - 1]'
+** is already sorted. Each value goes after all values equal to it.
+*/
+static void binsort (lua_State *L, TValue *a, unsigned int lo,
+                     unsigned int start, unsigned int up, SortLT lt) {
+  for (; start < up; start++) {
+    unsigned int l = lo, r = start;
+    TValue v;
+    while (l < r) {
+      unsigned int m = l + (r - l) / 2;
+      if (lt(L, &a[start], &a[m]))
+        r = m;
+      else
+        l = m + 1;
+    }
+    setobj(L, &v, &a[start]);
+    for (r = start; r > l; r--)
+      setobj(L, &a[r], &a[r - 1]);
+    setobj(L, &a[l], &v);
+  }
+}
+
+
+/*
+** Length of the run starting at 'a[lo]' and ending before 'a[up]': the
+** longest non-descending or strictly descending sequence. Reverses a
+** descending run, which is stable as its values are all different.
+*/
+static unsigned int countrun (lua_State *L, TValue *a, unsigned int lo,
+                              unsigned int up, SortLT lt) {
+  unsigned int i = lo + 1;
+  if (i == up)
+    return 1;
+  else if (lt(L, &a[i], &a[lo])) {  /* descending? */
+    unsigned int l, r;
+    while (++i < up && lt(L, &a[i], &a[i - 1])) ;
+    for (l = lo, r = i - 1; l < r; l++, r--)
+      swapvalues(L, a, l, r);
+  }
+  else {
+    while (++i < up && !lt(L, &a[i], &a[i - 1])) ;
+  }
+  return i - lo;
+}
+
+
+/* merge the runs 'i' and 'i + 1' */
+static void mergeat (lua_State *L, MergeState *ms, int i) {
+  TValue *a = ms->h->array;
+  TValue *buff = ms->b->array;
+  unsigned int lo = ms->base[i];
+  unsigned int mid = lo + ms->len[i];
+  unsigned int up = mid + ms->len[i + 1];
+  ms->len[i] += ms->len[i + 1];
+  if (i == ms->nruns - 3) {  /* there is a run after them? */
+    ms->base[i + 1] = ms->base[i + 2];
+    ms->len[i + 1] = ms->len[i + 2];
+  }
+  ms->nruns--;
+  if (ms->lt(L, &a[mid], &a[mid - 1])) {  /* not already in order? */
+    unsigned int n = mid - lo;
+    unsigned int i1 = 0, i2 = mid;
+    for (i1 = 0; i1 < n; i1++) {  /* move first run to 'buff' */
+      setobj2t(L, &buff[i1], &a[lo + i1]);
+      luaC_barrierback(L, ms->b, &buff[i1]);
+    }
+    i1 = 0;
+    while (i1 < n && i2 < up) {  /* on ties, first run goes first */
+      if (ms->lt(L, &a[i2], &buff[i1])) {
+        setobj2t(L, &a[lo++], &a[i2++]);  /* (value stays in 'h') */
+      }
+      else {
+        setobj2t(L, &a[lo], &buff[i1++]);
+        luaC_barrierback(L, ms->h, &a[lo]);
+        lo++;
+      }
+    }
+    for (; i1 < n; i1++, lo++) {  /* rest of first run */
+      setobj2t(L, &a[lo], &buff[i1]);
+      luaC_barrierback(L, ms->h, &a[lo]);
+    }
+  }
+}
+
+
+/* merge pending runs until the invariants hold again */
+static void mergecollapse (lua_State *L, MergeState *ms) {
+  unsigned int *len = ms->len;
+  while (ms->nruns > 1) {
+    int i = ms->nruns - 2;
+    if ((i > 0 && len[i - 1] <= len[i] + len[i + 1]) ||
+        (i > 1 && len[i - 2] <= len[i - 1] + len[i])) {
+      if (len[i - 1] < len[i + 1])
+        i--;
+    }
+    else if (len[i] > len[i + 1])
+      break;  /* invariants hold */
+    mergeat(L, ms, i);
+  }
+}
+
+
+static void mergesort (lua_State *L, Table *h, Table *b, unsigned int n,
+                       SortLT lt) {
+  MergeState ms;
+  TValue *a = h->array;
+  unsigned int lo = 0;
+  ms.h = h; ms.b = b; ms.lt = lt;
+  ms.nruns = 0;
+  while (lo < n) {
+    unsigned int len = countrun(L, a, lo, n, lt);
+    if (len < MINRUN) {  /* extend short run */
+      unsigned int force = (n - lo < MINRUN) ? n - lo : MINRUN;
+      binsort(L, a, lo, lo + len, lo + force, lt);
+      len = force;
+    }
+    lua_assert(ms.nruns < MAXRUNS);
+    ms.base[ms.nruns] = lo;
+    ms.len[ms.nruns++] = len;
+    lo += len;
+    mergecollapse(L, &ms);
+  }
+  while (ms.nruns > 1) {  /* merge all remaining runs */
+    int i = ms.nruns - 2;
+    if (i > 0 && ms.len[i - 1] < ms.len[i + 1])
+      i--;
+    mergeat(L, &ms, i);
+  }
+}
+
+
+/*
+** Radix sort works on unsigned keys with the same order as the numbers.
+** Floats have such keys when they have the same size as integers.
+*/
+#define KEYSIGN		(~(~(lua_Unsigned)0 >> 1))
+#define RADIXBITS	8
+#define RADIXSIZE	(1 << RADIXBITS)
+#define NDIGITS		cast_int(sizeof(lua_Unsigned) * CHAR_BIT / RADIXBITS)
+
+#define fltkeys		(sizeof(lua_Number) == sizeof(lua_Unsigned))
+
+typedef union {
+  lua_Number n;
+  lua_Unsigned k;
+} NumKey;
+
+
+static lua_Unsigned fltkey (lua_Number n) {
+  NumKey u;
+  u.n = n;
+  return (u.k & KEYSIGN) ? ~u.k : u.k | KEYSIGN;
+}
+
+
+static lua_Number keyflt (lua_Unsigned k) {
+  NumKey u;
+  u.k = (k & KEYSIGN) ? k & ~KEYSIGN : ~k;
+  return u.n;
+}
+
+
+/*
+** LSD radix sort of 'a[0 .. n - 1]', using 'aux' as scratch space.
+** Skips the digits where all keys agree. Returns the array holding the
+** result ('a' or 'aux').
+*/
+static lua_Unsigned *radixsort (lua_Unsigned *a, lua_Unsigned *aux,
+                                unsigned int n) {
+  unsigned int count[NDIGITS][RADIXSIZE] = {{0}};
+  unsigned int i;
+  int d;
+  for (i = 0; i < n; i++) {  /* count all digits in one pass */
+    lua_Unsigned k = a[i];
+    for (d = 0; d < NDIGITS; d++)
+      count[d][(k >> (d * RADIXBITS)) & (RADIXSIZE - 1)]++;
+  }
+  for (d = 0; d < NDIGITS; d++) {
+    unsigned int *c = count[d];
+    int shift = d * RADIXBITS;
+    unsigned int sum = 0;
+    lua_Unsigned *temp;
+    if (c[(a[0] >> shift) & (RADIXSIZE - 1)] == n)
+      continue;  /* all keys have the same digit */
+    for (i = 0; i < RADIXSIZE; i++) {  /* compute first slot of each digit */
+      unsigned int nd = c[i];
+      c[i] = sum;
+      sum += nd;
+    }
+    for (i = 0; i < n; i++) {
+      lua_Unsigned k = a[i];
+      aux[c[(k >> shift) & (RADIXSIZE - 1)]++] = k;
+    }
+    temp = a; a = aux; aux = temp;
+  }
+  return a;
+}
+
+
+/* sort 'a[0 .. n - 1]', all integers ('isint') or floats without NaNs */
+static void sortnumbers (lua_State *L, TValue *a, unsigned int n,
+                                                  int isint) {
+  size_t size = 2 * cast(size_t, n);
+  lua_Unsigned *keys = luaM_newvector(L, size, lua_Unsigned);
+  lua_Unsigned *res;
+  unsigned int i;
+  for (i = 0; i < n; i++)
+    keys[i] = isint ? l_castS2U(ivalue(&a[i])) ^ KEYSIGN
+                    : fltkey(fltvalue(&a[i]));
+  res = radixsort(keys, keys + n, n);
+  for (i = 0; i < n; i++) {
+    if (isint) {
+      setivalue(&a[i], l_castU2S(res[i] ^ KEYSIGN));
+    }
+    else {
+      setfltvalue(&a[i], keyflt(res[i]));
+    }
+  }
+  luaM_freearray(L, keys, size);
+}
+
+
+/*
+** Sort 'h->array[0 .. n - 1]' as told by 'how' (see 'lua_rawsort');
+** the array of 'b' is scratch space for a stable sort.
+*/
+static void sortvalues (lua_State *L, Table *h, Table *b, unsigned int n,
+                        int how, unsigned int k, SortLT lt) {
+  TValue *a = h->array;
+  switch (how) {
+    case LUA_SORTSTABLE:
+      mergesort(L, h, b, n, lt);
+      break;
+    case LUA_SORTTOPK:
+      if (k < n / HEAPRATIO)
+        heapselect(L, a, n, k, lt);
+      else {  /* select the k-th value and sort the ones before it */
+        quickselect(L, a, 0, n - 1, k - 1, lt);
+        if (k > 2)
+          quicksort(L, a, 0, k - 2, 0, lt);
+      }
+      break;
+    case LUA_SORTNTH:
+      quickselect(L, a, 0, n - 1, k - 1, lt);
+      break;
+    default:
+      quicksort(L, a, 0, n - 1, 0, lt);
+      break;
+  }
+}
+
+
+/*
+** Check whether 'a[0 .. n - 1]' can be sorted in place without an
+** order function, because comparing its values runs no Lua code: they
+** must be all numbers or all strings, as comparing a number with a
+** string calls the '__lt' metamethod of strings, which could change
+** the table. Returns 2 if the values can be radix sorted (with 'isint'
+** telling whether they are integers), 1 if they are all numbers or all
+** strings, and 0 otherwise. For a stable sort, floats with both zeros
+** cannot be radix sorted, as radix sort would order them.
+*/
+static int sortinplace (const TValue *a, unsigned int n, int how,
+                                         int *isint) {
+  unsigned int i, nint = 0, nflt = 0, nstr = 0;
+  int nan = 0, negzero = 0;
+  for (i = 0; i < n; i++) {
+    if (ttisinteger(&a[i]))
+      nint++;
+    else if (ttisfloat(&a[i])) {
+      lua_Number x = fltvalue(&a[i]);
+      nflt++;
+      nan |= luai_numisnan(x);
+      negzero |= (x == 0 && fltkeys && fltkey(x) == ~KEYSIGN);
+    }
+    else if (ttisstring(&a[i]))
+      nstr++;
+    else
+      return 0;  /* may have metamethods */
+  }
+  if (nstr != 0 && nstr != n)
+    return 0;  /* numbers and strings: comparisons call metamethods */
+  *isint = (nint == n);
+  if (n > RADIXLIMIT && (how == LUA_SORT || how == LUA_SORTSTABLE) &&
+      (nint == n ||
+       (nflt == n && fltkeys && !nan &&
+        !(negzero && how == LUA_SORTSTABLE))))
+    return 2;
+  else
+    return 1;
+}
+
+
+/*
+** Sort 't[1 .. n]' with raw accesses, with the order function on the
+** top of the stack (nil for '<'). Values that can be compared without
+** running Lua code are sorted in place. Otherwise, they are sorted in
+** a temporary table, which the order function or metamethods cannot
+** change, and then copied back.
+*/
+void luaH_sort (lua_State *L, Table *t, unsigned int n, int how,
+                                        unsigned int k) {
+  StkId func = L->top - 1;
+  unsigned int i;
+  if (n < 2 || (how == LUA_SORTTOPK && k == 0))
+    return;  /* nothing to sort */
+  if (ttisnil(func) && n <= t->sizearray) {
+    int isint;
+    switch (sortinplace(t->array, n, how, &isint)) {
+      case 2:
+        sortnumbers(L, t->array, n, isint);
+        return;
+      case 1:
+        if (how != LUA_SORTSTABLE) {
+          sortvalues(L, t, NULL, n, how, k, luaV_lessthan);
+          return;
+        }
+        break;
+      default: break;
+    }
+  }
+  {
+    Table *h, *b = NULL;
+    ptrdiff_t oldfunc;
+    luaD_checkstack(L, 6);  /* tables, function, and its arguments */
+    func = L->top - 1;
+    oldfunc = savestack(L, func);  /* comparisons may move the stack */
+    h = luaH_new(L);
+    sethvalue(L, L->top, h);  /* anchor it */
+    L->top++;
+    luaH_resizearray(L, h, n);
+    for (i = 0; i < n; i++)
+      setobj2t(L, &h->array[i], (i < t->sizearray) ? &t->array[i]
+                                                   : luaH_getint(t, i + 1));
+    if (how == LUA_SORTSTABLE) {
+      b = luaH_new(L);
+      sethvalue(L, L->top, b);  /* anchor it */
+      L->top++;
+      luaH_resizearray(L, b, n);
+    }
+    setobj2s(L, L->top, func);  /* order function goes on top */
+    L->top++;
+    sortvalues(L, h, b, n, how, k, ttisnil(func) ? luaV_lessthan
+                                                 : callorder);
+    if (isfrozen(t))  /* frozen by the order function? */
+      luaG_runerror(L, "attempt to modify a frozen table");
+    for (i = 0; i < n; i++) {  /* copy the result back */
+      TValue *v = &h->array[i];
+      if (i < t->sizearray)
+        setobj2t(L, &t->array[i], v);
+      else if (!ttisnil(v) || !ttisnil(luaH_getint(t, i + 1)))
+        luaH_setint(L, t, i + 1, v);
+      luaC_barrierback(L, t, v);
+    }
+    L->top = restorestack(L, oldfunc) + 1;  /* remove temporary tables */
+  }
+}
+
+/* }====================================================== */
+
+
+
 #if defined(LUA_DEBUG)
 
 Node *luaH_mainposition (const Table *t, const TValue *key) {
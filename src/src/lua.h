@@ -143,6 +143,7 @@ extern const char lua_ident[];
 ** state manipulation
 */
 LUA_API lua_State *(lua_newstate) (lua_Alloc f, void *ud);
+LUA_API lua_State *(lua_newsharedstate) (lua_Alloc f, void *ud, lua_State *L);
 LUA_API void       (lua_close) (lua_State *L);
 LUA_API lua_State *(lua_newthread) (lua_State *L);
 
@@ -185,6 +186,8 @@ LUA_API const char     *(lua_tolstring) (lua_State *L, int idx, size_t *len);
 LUA_API size_t          (lua_rawlen) (lua_State *L, int idx);
 LUA_API lua_CFunction   (lua_tocfunction) (lua_State *L, int idx);
 LUA_API void	       *(lua_touserdata) (lua_State *L, int idx);
+LUA_API void	       *(lua_toarray) (lua_State *L, int idx, int *kind,
+                                       size_t *n);
 LUA_API lua_State      *(lua_tothread) (lua_State *L, int idx);
 LUA_API const void     *(lua_topointer) (lua_State *L, int idx);
 
@@ -225,6 +228,8 @@ LUA_API void        (lua_pushnil) (lua_State *L);
 LUA_API void        (lua_pushnumber) (lua_State *L, lua_Number n);
 LUA_API void        (lua_pushinteger) (lua_State *L, lua_Integer n);
 LUA_API const char *(lua_pushlstring) (lua_State *L, const char *s, size_t len);
+LUA_API const char *(lua_pushexternalstring) (lua_State *L,
+                const char *s, size_t len, lua_Alloc falloc, void *ud);
 LUA_API const char *(lua_pushstring) (lua_State *L, const char *s);
 LUA_API const char *(lua_pushvfstring) (lua_State *L, const char *fmt,
                                                       va_list argp);
@@ -248,9 +253,15 @@ LUA_API int (lua_rawgetp) (lua_State *L, int idx, const void *p);
 
 LUA_API void  (lua_createtable) (lua_State *L, int narr, int nrec);
 LUA_API void *(lua_newuserdata) (lua_State *L, size_t sz);
+LUA_API void *(lua_newarray) (lua_State *L, int kind, size_t n);
 LUA_API int   (lua_getmetatable) (lua_State *L, int objindex);
 LUA_API int  (lua_getuservalue) (lua_State *L, int idx);
 
+/* kinds of typed arrays (see 'lua_newarray') */
+#define LUA_ARRINT	1	/* elements are 'lua_Integer's */
+#define LUA_ARRFLT	2	/* elements are 'lua_Number's */
+#define LUA_ARRBYTE	3	/* elements are unsigned bytes */
+
 
 /*
 ** set functions (stack -> Lua)
@@ -262,6 +273,7 @@ LUA_API void  (lua_seti) (lua_State *L, int idx, lua_Integer n);
 LUA_API void  (lua_rawset) (lua_State *L, int idx);
 LUA_API void  (lua_rawseti) (lua_State *L, int idx, lua_Integer n);
 LUA_API void  (lua_rawsetp) (lua_State *L, int idx, const void *p);
+LUA_API void  (lua_cleartable) (lua_State *L, int idx);
 LUA_API int   (lua_setmetatable) (lua_State *L, int objindex);
 LUA_API void  (lua_setuservalue) (lua_State *L, int idx);
 
@@ -312,6 +324,16 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
 
+/*
+** frozen objects (shared heap)
+*/
+LUA_API void  (lua_freeze) (lua_State *L, int idx);
+LUA_API int   (lua_isfrozen) (lua_State *L, int idx);
+LUA_API void  (lua_xshare) (lua_State *from, lua_State *to, int idx);
+LUA_API const void *(lua_tofrozen) (lua_State *L, int idx, const void **heap);
+LUA_API int   (lua_pushfrozen) (lua_State *L, const void *heap, const void *p);
+
+
 /*
 ** miscellaneous functions
 */
@@ -322,6 +344,22 @@ LUA_API int   (lua_next) (lua_State *L, int idx);
 
 LUA_API void  (lua_concat) (lua_State *L, int n);
 LUA_API void  (lua_len)    (lua_State *L, int idx);
+LUA_API int   (lua_rawconcat) (lua_State *L, int idx, lua_Integer i,
+                               lua_Integer j, const char *sep, size_t lsep);
+LUA_API lua_Integer (lua_rawgetnumbers) (lua_State *L, int idx,
+                                         lua_Integer i, lua_Integer n,
+                                         lua_Number *buff);
+LUA_API void  (lua_rawsetnumbers) (lua_State *L, int idx, lua_Integer i,
+                                   lua_Integer n, const lua_Number *buff,
+                                   int toint);
+
+LUA_API void  (lua_rawsort) (lua_State *L, int idx, lua_Integer n, int how,
+                             lua_Integer k);
+
+#define LUA_SORT	0
+#define LUA_SORTSTABLE	1
+#define LUA_SORTTOPK	2
+#define LUA_SORTNTH	3
 
 LUA_API size_t   (lua_stringtonumber) (lua_State *L, const char *s);
 
@@ -72,6 +72,35 @@
 #endif
 
 
+/*
+@@ LUA_USE_THREADS allows several system threads to use the same state
+** (e.g., each one resuming its own coroutine), using POSIX threads.
+** A thread holds a global lock while running Lua code and releases it
+** while running C functions and at the points where the VM may collect
+** garbage, so C functions run in parallel with Lua code. Lua code
+** itself runs in one thread at a time: to use several cores on Lua
+** code, use independent states (see 'lua_newsharedstate' and the
+** 'parallel' library). The libraries guard the data they keep per
+** state, with two exceptions: only one thread at a time may run
+** 'sched.run' on a state, as the scheduler wakes the tasks of all
+** asynchronous file operations of the state; and 'parallel.workers'
+** must be called before other threads use the 'parallel' library, as
+** its pool is created and replaced without a lock. (It needs an extra
+** library, -lpthread, and a compiler with GCC atomic builtins.)
+*/
+/* #define LUA_USE_THREADS */
+
+
+/*
+@@ LUA_USE_MAPCHUNK makes 'luaL_loadfile' map regular files in memory
+** (with POSIX 'mmap') and parse them in place, instead of reading them
+** through a C stream. It is off by default: if a file is truncated
+** while it is being loaded, the program gets a SIGBUS signal instead
+** of a read error.
+*/
+/* #define LUA_USE_MAPCHUNK */
+
+
 /*
 @@ LUA_C89_NUMBERS ensures that Lua uses the largest types available for
 ** C89 ('long' and 'double'); Windows always has '__int64', so it does
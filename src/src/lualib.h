@@ -35,6 +35,21 @@ LUAMOD_API int (luaopen_string) (lua_State *L);
 #define LUA_UTF8LIBNAME	"utf8"
 LUAMOD_API int (luaopen_utf8) (lua_State *L);
 
+#define LUA_BUFLIBNAME	"buffer"
+LUAMOD_API int (luaopen_buffer) (lua_State *L);
+
+#define LUA_ARRLIBNAME	"array"
+LUAMOD_API int (luaopen_array) (lua_State *L);
+
+#define LUA_CHANLIBNAME	"channel"
+LUAMOD_API int (luaopen_channel) (lua_State *L);
+
+#define LUA_PARLIBNAME	"parallel"
+LUAMOD_API int (luaopen_parallel) (lua_State *L);
+
+#define LUA_SCHEDLIBNAME	"sched"
+LUAMOD_API int (luaopen_sched) (lua_State *L);
+
 #define LUA_BITLIBNAME	"bit32"
 LUAMOD_API int (luaopen_bit32) (lua_State *L);
 
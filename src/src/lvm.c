@@ -65,6 +65,38 @@
 
 
 
+/* maximum length of a numeral in a string without its own terminator */
+#if !defined (L_MAXLENNUM)
+#define L_MAXLENNUM	200
+#endif
+
+
+/*
+** Try to convert string 'obj' to a number, storing it in 'result'.
+** 'luaO_str2num' needs a terminating zero, which a string in a shared
+** buffer may lack (see 'luaS_extend'); such a string is copied to a
+** local buffer, as the bytes of a string are never written (other
+** system threads may be reading the longer strings in the buffer).
+** Numerals that do not fit in that buffer are rejected.
+*/
+static int l_strton (const TValue *obj, TValue *result) {
+  TString *ts = tsvalue(obj);
+  const char *s = getstr(ts);
+  size_t len = tsslen(ts);
+  if (s[len] == '\0')  /* usual case */
+    return (luaO_str2num(s, result) == len + 1);
+  else {
+    char buff[L_MAXLENNUM + 1];
+    lua_assert(isbufstr(ts));
+    if (len > L_MAXLENNUM)
+      return 0;  /* too long to be a numeral */
+    memcpy(buff, s, len);
+    buff[len] = '\0';
+    return (luaO_str2num(buff, result) == len + 1);
+  }
+}
+
+
 /*
 ** Try to convert a value to a float. The float case is already handled
 ** by the macro 'tonumber'.
@@ -76,7 +108,7 @@ int luaV_tonumber_ (const TValue *obj, lua_Number *n) {
     return 1;
   }
   else if (cvt2num(obj) &&  /* string convertible to number? */
-            luaO_str2num(svalue(obj), &v) == vslen(obj) + 1) {
+            l_strton(obj, &v)) {
     *n = nvalue(&v);  /* convert result of 'luaO_str2num' to a float */
     return 1;
   }
@@ -108,8 +140,7 @@ int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode) {
     *p = ivalue(obj);
     return 1;
   }
-  else if (cvt2num(obj) &&
-            luaO_str2num(svalue(obj), &v) == vslen(obj) + 1) {
+  else if (cvt2num(obj) && l_strton(obj, &v)) {
     obj = &v;
     goto again;  /* convert result from 'luaO_str2num' to an integer */
   }
@@ -152,6 +183,87 @@ static int forlimit (const TValue *obj, lua_Integer *p, lua_Integer step,
 }
 
 
+/*
+** {==================================================================
+** Typed arrays (see 'lua_newarray')
+** ===================================================================
+*/
+
+/*
+** Check whether 'key' is an integer index (maybe in a float), as only
+** these keys select elements of a typed array.
+*/
+static int arraykey (const TValue *key, lua_Integer *i) {
+  if (ttisinteger(key)) {
+    *i = ivalue(key);
+    return 1;
+  }
+  else return (ttisfloat(key) && luaV_tointeger(key, i, 0));
+}
+
+
+/* 'val = a[i]' for typed array 'u'; out-of-bounds elements are nil */
+static void arrayget (Udata *u, lua_Integer i, TValue *val) {
+  lua_Unsigned k = l_castS2U(i) - 1u;  /* 0-based position */
+  const char *mem = getudatamem(u);
+  switch (u->arrkind) {
+    case LUA_ARRINT: {
+      if (k < u->len / sizeof(lua_Integer)) {
+        setivalue(val, cast(const lua_Integer *, mem)[k]);
+        return;
+      }
+      break;
+    }
+    case LUA_ARRFLT: {
+      if (k < u->len / sizeof(lua_Number)) {
+        setfltvalue(val, cast(const lua_Number *, mem)[k]);
+        return;
+      }
+      break;
+    }
+    default: {
+      lua_assert(u->arrkind == LUA_ARRBYTE);
+      if (k < u->len) {
+        setivalue(val, cast(const lu_byte *, mem)[k]);
+        return;
+      }
+      break;
+    }
+  }
+  setnilvalue(val);
+}
+
+
+/*
+** 'a[i] = v' for typed array 'u'. Typed arrays do not grow, and 'v'
+** must be a number that an element can hold.
+*/
+static void arrayset (lua_State *L, Udata *u, lua_Integer i,
+                      const TValue *v) {
+  lua_Unsigned k = l_castS2U(i) - 1u;  /* 0-based position */
+  char *mem = getudatamem(u);
+  if (k >= arraylen(u))
+    luaG_runerror(L, "index out of bounds");
+  else if (!ttisnumber(v))
+    luaG_runerror(L, "number expected, got %s", luaT_objtypename(L, v));
+  else if (u->arrkind == LUA_ARRFLT)
+    cast(lua_Number *, mem)[k] = nvalue(v);
+  else {
+    lua_Integer n;
+    if (!luaV_tointeger(v, &n, 0))
+      luaG_runerror(L, "number has no integer representation");
+    if (u->arrkind == LUA_ARRINT)
+      cast(lua_Integer *, mem)[k] = n;
+    else if (l_castS2U(n) > 0xFFu)
+      luaG_runerror(L, "value out of range");
+    else
+      cast(lu_byte *, mem)[k] = cast_byte(n);
+  }
+}
+
+/* }================================================================== */
+
+
 /*
 ** Finish the table access 'val = t[key]'.
 ** if 'slot' is NULL, 't' is not a table; otherwise, 'slot' points to
@@ -163,7 +275,12 @@ void luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
   const TValue *tm;  /* metamethod */
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
     if (slot == NULL) {  /* 't' is not a table? */
+      lua_Integer i;
       lua_assert(!ttistable(t));
+      if (isarray(t) && arraykey(key, &i)) {  /* element of typed array? */
+        arrayget(uvalue(t), i, val);
+        return;
+      }
       tm = luaT_gettmbyobj(L, t, TM_INDEX);
       if (ttisnil(tm))
         luaG_typeerror(L, t, "index");  /* no metamethod */
@@ -207,6 +324,8 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
     const TValue *tm;  /* '__newindex' metamethod */
     if (slot != NULL) {  /* is 't' a table? */
       Table *h = hvalue(t);  /* save 't' table */
+      if (isfrozen(h))
+        luaG_runerror(L, "attempt to modify a frozen table");
       lua_assert(ttisnil(slot));  /* old value must be nil */
       tm = fasttm(L, h->metatable, TM_NEWINDEX);  /* get metamethod */
       if (tm == NULL) {  /* no metamethod? */
@@ -221,6 +340,11 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
       /* else will try the metamethod */
     }
     else {  /* not a table; check metamethod */
+      lua_Integer i;
+      if (isarray(t) && arraykey(key, &i)) {  /* element of typed array? */
+        arrayset(L, uvalue(t), i, val);
+        return;
+      }
       if (ttisnil(tm = luaT_gettmbyobj(L, t, TM_NEWINDEX)))
         luaG_typeerror(L, t, "index");
     }
@@ -243,13 +367,17 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
 ** -larger than zero if 'ls' is smaller-equal-larger than 'rs'.
 ** The code is a little tricky because it allows '\0' in the strings
 ** and it uses 'strcoll' (to respect locales) for each segments
-** of the strings.
+** of the strings. (Strings that may lack their final '\0' get one
+** first; see 'luaS_extend'.)
 */
-static int l_strcmp (const TString *ls, const TString *rs) {
-  const char *l = getstr(ls);
+static int l_strcmp (lua_State *L, TString *ls, TString *rs) {
+  const char *l, *r;
   size_t ll = tsslen(ls);
-  const char *r = getstr(rs);
   size_t lr = tsslen(rs);
+  luaS_seal(L, ls);
+  luaS_seal(L, rs);
+  l = getstr(ls);
+  r = getstr(rs);
   for (;;) {  /* for each segment */
     int temp = strcoll(l, r);
     if (temp != 0)  /* not equal? */
@@ -366,7 +494,7 @@ int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
   if (ttisnumber(l) && ttisnumber(r))  /* both operands are numbers? */
     return LTnum(l, r);
   else if (ttisstring(l) && ttisstring(r))  /* both are strings? */
-    return l_strcmp(tsvalue(l), tsvalue(r)) < 0;
+    return l_strcmp(L, tsvalue(l), tsvalue(r)) < 0;
   else if ((res = luaT_callorderTM(L, l, r, TM_LT)) < 0)  /* no metamethod? */
     luaG_ordererror(L, l, r);  /* error */
   return res;
@@ -386,7 +514,7 @@ int luaV_lessequal (lua_State *L, const TValue *l, const TValue *r) {
   if (ttisnumber(l) && ttisnumber(r))  /* both operands are numbers? */
     return LEnum(l, r);
   else if (ttisstring(l) && ttisstring(r))  /* both are strings? */
-    return l_strcmp(tsvalue(l), tsvalue(r)) <= 0;
+    return l_strcmp(L, tsvalue(l), tsvalue(r)) <= 0;
   else if ((res = luaT_callorderTM(L, l, r, TM_LE)) >= 0)  /* try 'le' */
     return res;
   else {  /* try 'lt': */
@@ -499,9 +627,10 @@ void luaV_concat (lua_State *L, int total) {
         copy2buff(top, n, buff);  /* copy strings to buffer */
         ts = luaS_newlstr(L, buff, tl);
       }
-      else {  /* long string; copy strings directly to final result */
-        ts = luaS_createlngstrobj(L, tl);
-        copy2buff(top, n, getstr(ts));
+      else {  /* long string; extend first operand with the others */
+        size_t fl = vslen(top - n);
+        ts = luaS_extend(L, tsvalue(top - n), tl);
+        copy2buff(top, n - 1, getstr(ts) + fl);
       }
       setsvalue2s(L, top - n, ts);  /* create result */
     }
@@ -511,6 +640,93 @@ void luaV_concat (lua_State *L, int total) {
 }
 
 
+/*
+** Grow the buffer 'nums' that keeps the texts of numbers for
+** 'luaV_concattable'. It is a userdata anchored at 'anchor'.
+*/
+static char *growtexts (lua_State *L, StkId anchor, char *nums,
+                        size_t *size, size_t used) {
+  size_t newsize = (*size == 0) ? 8 * MAXNUMBER2STR : *size * 2;
+  Udata *u = luaS_newudata(L, newsize);
+  char *newnums = cast(char *, getudatamem(u));
+  if (used > 0)
+    memcpy(newnums, nums, used * sizeof(char));
+  setuvalue(L, anchor, u);
+  *size = newsize;
+  return newnums;
+}
+
+
+/*
+** Concatenate 't[i .. j]', with 'sep' between values, into a new string
+** at stack slot 'ra' (below the top), which also anchors scratch space.
+** The interval must be inside the array part of 't'. Returns 0 if some
+** value in it is not a string or a number. The first pass computes the
+** length of the result (converting numbers to texts, each after a byte
+** with its length), so that the second one creates the result only once
+** and copies each value directly into it.
+*/
+int luaV_concattable (lua_State *L, StkId ra, Table *t, unsigned int i,
+                      unsigned int j, const char *sep, size_t lsep) {
+  char sbuff[LUAI_MAXSHORTLEN];
+  char *nums = NULL;  /* texts of numbers */
+  size_t nsize = 0, nused = 0;
+  size_t tl = 0;
+  unsigned int k;
+  TString *ts = NULL;
+  char *b;
+  lua_assert(1 <= i && i <= j && j <= t->sizearray && ra < L->top);
+  for (k = i; k <= j; k++) {  /* compute total length */
+    const TValue *o = &t->array[k - 1];
+    size_t l;
+    if (ttisstring(o))
+      l = vslen(o);
+    else if (ttisnumber(o)) {
+      if (nsize - nused <= MAXNUMBER2STR)
+        nums = growtexts(L, ra, nums, &nsize, nused);
+      l = luaO_tostr(o, nums + nused + 1);
+      nums[nused] = cast(char, l);
+      nused += l + 1;
+    }
+    else
+      return 0;
+    if (l >= (MAX_SIZE/sizeof(char)) - tl)
+      luaG_runerror(L, "string length overflow");
+    tl += l;
+  }
+  if (lsep > 0 && j - i >= ((MAX_SIZE/sizeof(char)) - tl) / lsep)
+    luaG_runerror(L, "string length overflow");
+  tl += (j - i) * lsep;
+  if (tl <= LUAI_MAXSHORTLEN)  /* is result a short string? */
+    b = sbuff;
+  else {
+    ts = luaS_createlngstrobj(L, tl);
+    b = getstr(ts);
+  }
+  for (k = i; ; k++) {  /* copy values */
+    const TValue *o = &t->array[k - 1];
+    size_t l;
+    if (ttisstring(o)) {
+      l = vslen(o);
+      memcpy(b, svalue(o), l * sizeof(char));
+    }
+    else {
+      l = cast(unsigned char, *nums);
+      memcpy(b, nums + 1, l * sizeof(char));
+      nums += l + 1;
+    }
+    b += l;
+    if (k == j) break;
+    memcpy(b, sep, lsep * sizeof(char));
+    b += lsep;
+  }
+  if (ts == NULL)  /* short string? */
+    ts = luaS_newlstr(L, sbuff, tl);
+  setsvalue2s(L, ra, ts);
+  return 1;
+}
+
+
 /*
 ** Main operation 'ra' = #rb'.
 */
@@ -532,6 +748,12 @@ void luaV_objlen (lua_State *L, StkId ra, const TValue *rb) {
       setivalue(ra, tsvalue(rb)->u.lnglen);
       return;
     }
+    case LUA_TUSERDATA: {
+      if (uvalue(rb)->arrkind != 0) {  /* typed array? */
+        setivalue(ra, arraylen(uvalue(rb)));
+        return;
+      }
+    }  /* FALLTHROUGH */
     default: {  /* try metamethod */
       tm = luaT_gettmbyobj(L, rb, TM_LEN);
       if (ttisnil(tm))  /* no metamethod? */
@@ -746,10 +968,25 @@ void luaV_finishOp (lua_State *L) {
 
 #define Protect(x)	{ {x;}; base = ci->u.l.base; }
 
+/*
+** Collector safepoints give way to other system threads sharing the
+** state; loops do too, as they may run for long without creating
+** objects. (While the lock is released, a collection run by another
+** thread may shrink the stack, so the yields reload 'base'.)
+*/
+#if defined(LUA_USE_THREADS)
+#define gcyield(L)	Protect(luai_threadyield(L))
+#define loopyield(L)	Protect(luai_threadyield(L))
+#else
+#define gcyield(L)	luai_threadyield(L)
+#define loopyield(L)	((void)0)
+#endif
+
+
 #define checkGC(L,c)  \
 	{ luaC_condGC(L, L->top = (c),  /* limit of live values */ \
                          Protect(L->top = ci->top));  /* restore top */ \
-           luai_threadyield(L); }
+           gcyield(L); }
 
 
 /* fetch an instruction and prepare its execution */
@@ -842,7 +1079,9 @@ void luaV_execute (lua_State *L) {
       vmcase(OP_GETTABLE) {
         StkId rb = RB(i);
         TValue *rc = RKC(i);
-        gettableProtected(L, rb, rc, ra);
+        if (isarray(rb) && ttisinteger(rc))  /* element of typed array? */
+          arrayget(uvalue(rb), ivalue(rc), ra);
+        else gettableProtected(L, rb, rc, ra);
         vmbreak;
       }
       vmcase(OP_SETTABUP) {
@@ -861,7 +1100,9 @@ void luaV_execute (lua_State *L) {
       vmcase(OP_SETTABLE) {
         TValue *rb = RKB(i);
         TValue *rc = RKC(i);
-        settableProtected(L, ra, rb, rc);
+        if (isarray(ra) && ttisinteger(rb))  /* element of typed array? */
+          arrayset(L, uvalue(ra), ivalue(rb), rc);
+        else settableProtected(L, ra, rb, rc);
         vmbreak;
       }
       vmcase(OP_NEWTABLE) {
@@ -1061,7 +1302,11 @@ void luaV_execute (lua_State *L) {
         vmbreak;
       }
       vmcase(OP_LEN) {
-        Protect(luaV_objlen(L, ra, RB(i)));
+        TValue *rb = RB(i);
+        if (isarray(rb)) {  /* typed array? */
+          setivalue(ra, arraylen(uvalue(rb)));
+        }
+        else Protect(luaV_objlen(L, ra, rb));
         vmbreak;
       }
       vmcase(OP_CONCAT) {
@@ -1079,6 +1324,8 @@ void luaV_execute (lua_State *L) {
       }
       vmcase(OP_JMP) {
         dojump(ci, i, 0);
+        if (GETARG_sBx(i) < 0)  /* jump back? */
+          loopyield(L);
         vmbreak;
       }
       vmcase(OP_EQ) {
@@ -1196,6 +1443,7 @@ void luaV_execute (lua_State *L) {
             ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
             chgivalue(ra, idx);  /* update internal index... */
             setivalue(ra + 3, idx);  /* ...and external index */
+            loopyield(L);
           }
         }
         else {  /* floating loop */
@@ -1207,6 +1455,7 @@ void luaV_execute (lua_State *L) {
             ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
             chgfltvalue(ra, idx);  /* update internal index... */
             setfltvalue(ra + 3, idx);  /* ...and external index */
+            loopyield(L);
           }
         }
         vmbreak;
@@ -1257,6 +1506,7 @@ void luaV_execute (lua_State *L) {
         if (!ttisnil(ra + 1)) {  /* continue loop? */
           setobjs2s(L, ra, ra + 1);  /* save control variable */
            ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
+          loopyield(L);
         }
         vmbreak;
       }
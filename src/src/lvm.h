@@ -70,18 +70,18 @@
 
 
 /*
-** Fast track for set table. If 't' is a table and 't[k]' is not nil,
-** call GC barrier, do a raw 't[k]=v', and return true; otherwise,
-** return false with 'slot' equal to NULL (if 't' is not a table) or
-** 'nil'. (This is needed by 'luaV_finishget'.) Note that, if the macro
-** returns true, there is no need to 'invalidateTMcache', because the
-** call is not creating a new entry.
+** Fast track for set table. If 't' is a table that is not frozen and
+** 't[k]' is not nil, call GC barrier, do a raw 't[k]=v', and return
+** true; otherwise, return false with 'slot' equal to NULL (if 't' is not
+** a table) or to 't[k]'. (This is needed by 'luaV_finishget'.) Note
+** that, if the macro returns true, there is no need to
+** 'invalidateTMcache', because the call is not creating a new entry.
 */
 #define luaV_fastset(L,t,k,slot,f,v) \
   (!ttistable(t) \
    ? (slot = NULL, 0) \
    : (slot = f(hvalue(t), k), \
-     ttisnil(slot) ? 0 \
+     (ttisnil(slot) || isfrozen(hvalue(t))) ? 0 \
      : (luaC_barrierback(L, hvalue(t), v), \
         setobj2t(L, cast(TValue *,slot), v), \
         1)))
@@ -105,6 +105,9 @@ LUAI_FUNC void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
 LUAI_FUNC void luaV_finishOp (lua_State *L);
 LUAI_FUNC void luaV_execute (lua_State *L);
 LUAI_FUNC void luaV_concat (lua_State *L, int total);
+LUAI_FUNC int luaV_concattable (lua_State *L, StkId ra, Table *t,
+                                unsigned int i, unsigned int j,
+                                const char *sep, size_t lsep);
 LUAI_FUNC lua_Integer luaV_div (lua_State *L, lua_Integer x, lua_Integer y);
 LUAI_FUNC lua_Integer luaV_mod (lua_State *L, lua_Integer x, lua_Integer y);
 LUAI_FUNC lua_Integer luaV_shiftl (lua_Integer x, lua_Integer y);
@@ -0,0 +1,52 @@
+-- Regression tests for the sorts of tables
+-- Run with 'make test' in the parent directory (or 'lua sort.lua').
+
+print("testing sorts")
+
+-- A stable sort whose order function removes the values from the table
+-- and runs the collector: the values being merged then live only in
+-- the temporary tables of the sort, which must keep them alive.
+do
+  local N = 3000
+  local t = {}
+  for i = 1, N do
+    t[i] = {key = (i * 7919) % 101, pos = i, name = "value " .. i}
+  end
+  local cleared = false
+  table.sortstable(t, function (a, b)
+    if not cleared then
+      for i = 1, N do t[i] = nil end
+      cleared = true
+    end
+    collectgarbage("step")
+    return a.key < b.key
+  end)
+  collectgarbage()
+  assert(#t == N)
+  for i = 1, N do
+    local v = t[i]
+    assert(v.name == "value " .. v.pos)
+    if i > 1 then
+      local p = t[i - 1]
+      assert(p.key < v.key or (p.key == v.key and p.pos < v.pos))
+    end
+  end
+end
+
+-- the same with a full collection at each comparison
+do
+  local N = 300
+  local t = {}
+  for i = 1, N do t[i] = {key = (N - i) // 3, pos = i} end
+  table.sortstable(t, function (a, b)
+    for i = 1, N do t[i] = nil end
+    collectgarbage()
+    return a.key < b.key
+  end)
+  for i = 2, N do
+    local p, v = t[i - 1], t[i]
+    assert(p.key < v.key or (p.key == v.key and p.pos < v.pos))
+  end
+end
+
+print("OK")